@@ -5,22 +5,57 @@
 #include <dirent.h>
 #include <errno.h>
 #include <vector>
-#include <fstream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <future>
+#include <chrono>
 //#include <regex> // Requires TR-1 compatible compiler
 
 // Non-standard libraries that may need to be installed
 #include "boost/regex.hpp"
 
 #include "RiveScript.h"
+#include "rs_mmap.h"
+#include "rs_normalize.h"
+#include "rs_snapshot.h"
 
 using std::string;
 using std::map;
 using std::vector;
+using std::string_view;
 using std::cout;
 using std::endl;
 
+// Trace points. The message is only built if the level is enabled.
+#define RS_SAY(phase, message)  RS_TRACE(this->trace, RS_TRACE_DEBUG, phase, message)
+#define RS_WARN(phase, message) RS_TRACE(this->trace, RS_TRACE_WARN, phase, message)
+
+// Trim whitespace off both ends of a view without copying anything.
+static string_view rs_trim (string_view s) {
+	const char *ws = " \t\x0A\x0D";
+	size_t first = s.find_first_not_of(ws);
+	if (first == string_view::npos) {
+		return string_view();
+	}
+	size_t last = s.find_last_not_of(ws);
+	return s.substr(first, last - first + 1);
+}
+
+// Replace every occurrence of "search" with "with", left to right.
+static void rs_replace (string &text, string_view search, string_view with) {
+	for (size_t pos = text.find(search); pos != string::npos; pos = text.find(search, pos + with.length())) {
+		text.replace(pos, search.length(), with);
+	}
+}
+
 /******************************************************************************
  * Constructor Methods                                                        *
  ******************************************************************************/
@@ -43,637 +78,4286 @@ void RiveScript::init (bool debug, int depth) {
 	this->debug      = debug;
 	this->depth      = depth;
 	this->rs_version = 2.0;
-	cout << "RS object created with debug mode " << this->debug << " and depth " << this->depth << endl;
-	cout << "We support RS version " << this->rs_version << endl;
+	this->budget     = 0;
+
+	// Debug mode traces (and prints) everything; otherwise only warnings.
+	rs_trace_level level = debug ? RS_TRACE_DEBUG : RS_TRACE_WARN;
+	this->trace.setLevel(level);
+	this->trace.setEcho(level);
+
+	// Start out with an empty brain, so there's always one to reply from.
+	this->live.publish(new rs_brain());
+	RS_SAY("init", "RS object created with debug mode " + std::to_string(this->debug) + " and depth " + std::to_string(this->depth));
+	char version[32];
+	snprintf(version, sizeof(version), "%g", this->rs_version);
+	RS_SAY("init", "We support RS version " + string(version));
 }
 
 // Debug methods
-void RiveScript::say (string line) {
-	if (this->debug == true) { // not working?
-		cout << "RS: " << line << endl;
+void RiveScript::say (const string &line) {
+	RS_SAY("user", line);
+}
+void RiveScript::warn (const string &line) {
+	RS_WARN("user", line);
+}
+void RiveScript::warn (const string &line, const string &file, int lineno) {
+	RS_WARN("user", line + " at " + file + " line " + std::to_string(lineno));
+}
+rs_tracer &RiveScript::tracer () {
+	return this->trace;
+}
+
+bool RiveScript::loadDirectory (string folder) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	RS_SAY("load", "Loading directory " + folder);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "load", "loadDirectory");
+
+	// Vector to hold file names.
+	vector<string> files = vector<string>();
+
+	// Directory handles.
+	DIR *dp;
+	struct dirent *dirp;
+	if ((dp = opendir(folder.c_str())) == NULL) {
+		RS_WARN("load", "Error (" + std::to_string(errno) + ") opening " + folder);
+		return false;
+	}
+
+	// Read files.
+	while ((dirp = readdir(dp)) != NULL) {
+		string file = string(dirp->d_name);
+		if (indexOf(file, ".") == 0) {
+			continue;
+		}
+		files.push_back(file);
+	}
+
+	// Close the folder.
+	closedir(dp);
+
+	// Load in a fixed order: a begin file must always be first, then the
+	// rest by name.
+	std::sort(files.begin(), files.end(), _loadBefore);
+
+	// Parse every file on its own, in parallel; each gets its own document.
+	// With a memory budget, each one's arena is capped at what's left of it.
+	size_t left = this->budget > 0 ? _budgetLeft(0) : 0;
+	if (this->budget > 0 && left == 0) {
+		RS_WARN("load", "Not loading " + folder + ": the memory budget of " + std::to_string(this->budget) + " bytes is already used up");
+		return false;
+	}
+	vector<std::shared_ptr<rs_document> > docs (files.size());
+	vector<char> opened (files.size(), 0);
+	vector<char> parsed (files.size(), 0);
+	vector<char> over (files.size(), 0);
+	{
+		rs_pool pool (std::min<size_t>(rs_pool::defaultSize(), std::max<size_t>(files.size(), 1)));
+		for (unsigned int i = 0; i < files.size(); i++) {
+			docs[i].reset(new rs_document());
+			docs[i]->arena.setLimit(left);
+			pool.submit([this, &folder, &files, &docs, &opened, &parsed, &over, i] () {
+				rs_mmap fh;
+				string path = folder + "/" + files[i];
+				if (fh.open(path)) {
+					opened[i] = 1;
+					docs[i]->hash = rs_fnv1a(fh.data(), fh.size());
+					try {
+						parsed[i] = _parse(path, fh.lines(), *docs[i]);
+					}
+					catch (const std::bad_alloc &) {
+						over[i] = 1;
+					}
+				}
+			});
+		}
+		pool.wait();
+	}
+
+	// Nothing's merged unless all of it fits.
+	if (this->budget > 0) {
+		size_t bytes = 0;
+		for (unsigned int i = 0; i < files.size(); i++) {
+			bytes += over[i] ? left : _loadingBytes(*docs[i]);
+		}
+		if (bytes > left) {
+			RS_WARN("load", "Not loading " + folder + ": it would go over the memory budget of " + std::to_string(this->budget) + " bytes");
+			return false;
+		}
+	}
+
+	// Merge them in load order, stopping where a serial load would have.
+	for (unsigned int i = 0; i < files.size(); i++) {
+		string path = folder + "/" + files[i];
+		if (!opened[i]) {
+			RS_WARN("load", "Unable to open file " + path + " for reading!");
+		}
+		else {
+			_merge(path, docs[i]);
+			_stage().sources.push_back(path);
+			_stage().hashes.push_back(docs[i]->hash);
+			if (!parsed[i]) {
+				RS_WARN("load", "Failed to parse " + path);
+			}
+		}
+
+		if (!opened[i] || !parsed[i]) {
+			RS_WARN("load", "Couldn't load file " + path);
+			return false;
+		}
+	}
+
+	// Sort and index the triggers now that everything's in.
+	sortReplies();
+
+	return true;
+}
+
+bool RiveScript::loadFile (string file) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	RS_SAY("load", "Loading RiveScript document " + file);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "load", "loadFile");
+
+	// Map the file into memory; parse() works on views of its lines.
+	rs_mmap fh;
+	if (fh.open(file)) {
+		RS_SAY("load", "Opening of " + file + " was successful.");
+
+		// Parse it. If it won't fit in the memory budget, none of it is
+		// loaded.
+		std::shared_ptr<rs_document> doc (new rs_document());
+		doc->hash = rs_fnv1a(fh.data(), fh.size());
+		bool ok;
+		if (!_parseBudgeted(file, fh.lines(), *doc, ok, 0)) {
+			return false;
+		}
+		_stage().sources.push_back(file);
+		_stage().hashes.push_back(doc->hash);
+		_merge(file, doc);
+		if (!ok) {
+			RS_WARN("load", "Failed to parse " + file);
+			return false;
+		}
+	}
+	else {
+		RS_WARN("load", "Unable to open file " + file + " for reading!");
+		return false;
+	}
+
+	sortReplies();
+	return true;
+}
+
+bool RiveScript::reloadFile (const string &file) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	RS_SAY("load", "Reloading RiveScript document " + file);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "load", "reloadFile");
+
+	// Finish off anything that was being streamed in.
+	endStream();
+
+	// A brain that came from a snapshot doesn't have its documents, so all
+	// of its sources have to be loaded again. Otherwise just this file's
+	// document is replaced. Either way, what goes makes room in the memory
+	// budget for what replaces it.
+	bool rebuild = false;
+	size_t freed = 0;
+	{
+		rs_rcu<rs_brain>::reader live (this->live);
+		const rs_brain &brain = this->staging ? *this->staging : *live;
+		std::set<string> known;
+		for (unsigned int i = 0; i < brain.documents.size(); i++) {
+			known.insert(brain.documents[i].first);
+			if (brain.documents[i].first == file) {
+				freed += sizeof(rs_document) + _documentBytes(*brain.documents[i].second);
+			}
+		}
+		for (unsigned int i = 0; i < brain.sources.size(); i++) {
+			if (known.count(brain.sources[i]) == 0) {
+				rebuild = true;
+			}
+		}
+		if (rebuild) {
+			freed = _loadedBytes(brain);
+		}
+	}
+
+	// Parse the new version on its own. If the file's gone, everything it
+	// contributed goes with it.
+	std::shared_ptr<rs_document> doc;
+	if (access(file.c_str(), F_OK) == 0) {
+		rs_mmap fh;
+		if (!fh.open(file)) {
+			RS_WARN("load", "Unable to open file " + file + " for reading!");
+			return false;
+		}
+		// A version that doesn't parse (say, a save caught half way), or
+		// doesn't fit, leaves the old one and the live brain as they were.
+		doc.reset(new rs_document());
+		doc->hash = rs_fnv1a(fh.data(), fh.size());
+		bool ok;
+		if (!_parseBudgeted(file, fh.lines(), *doc, ok, freed)) {
+			return false;
+		}
+		if (!ok) {
+			RS_WARN("load", "Failed to parse " + file + "; keeping the version that was loaded");
+			return false;
+		}
+	}
+	else {
+		RS_SAY("load", file + " is gone; removing what it contributed.");
+	}
+
+	// Only what's live has been sorted. If anything else has been loaded
+	// since, it all has to be sorted anyway.
+	bool incremental = !this->staging;
+	rs_brain &brain = _stage();
+	if (rebuild) {
+		return _rebuild(file, doc);
+	}
+
+	// Swap the file's document for the new one, taking note of every topic
+	// either version adds to.
+	vector<std::pair<string, std::shared_ptr<const rs_document> > > documents;
+	vector<string> touched;
+	const rs_document *old = NULL;
+	unsigned int replaced = 0;
+	for (unsigned int i = 0; i < brain.documents.size(); i++) {
+		if (brain.documents[i].first != file) {
+			documents.push_back(brain.documents[i]);
+			continue;
+		}
+		old = brain.documents[i].second.get();
+		_touched(*old, touched);
+		if (doc && replaced == 0) {
+			documents.push_back(std::make_pair(file, doc));
+		}
+		replaced++;
+	}
+	if (doc) {
+		_touched(*doc, touched);
+		if (replaced == 0) {
+			documents.push_back(std::make_pair(file, doc));
+		}
+	}
+
+	// Keep the list of sources, and what each one's contents were, in step.
+	bool listed = false;
+	for (unsigned int i = 0; i < brain.sources.size(); ) {
+		if (brain.sources[i] != file) {
+			i++;
+		}
+		else if (doc) {
+			brain.hashes[i++] = doc->hash;
+			listed = true;
+		}
+		else {
+			brain.sources.erase(brain.sources.begin() + i);
+			brain.hashes.erase(brain.hashes.begin() + i);
+		}
+	}
+	if (doc && !listed) {
+		brain.sources.push_back(file);
+		brain.hashes.push_back(doc->hash);
+	}
+	bool definitions = replaced > 1 || !_sameDefinitions(old, doc.get());
+	brain.documents.swap(documents); // (Which keeps the old one alive until we're done)
+
+	// Variables, arrays and substitutions find their way into any trigger's
+	// regexp, so if they've changed (or the objects have) everything gets
+	// sorted again.
+	if (definitions) {
+		brain.globals.clear();
+		brain.bot.clear();
+		brain.subs.clear();
+		brain.person.clear();
+		brain.arrays.clear();
+		brain.objects.clear();
+		for (unsigned int i = 0; i < brain.documents.size(); i++) {
+			_mergeDefinitions(brain, *brain.documents[i].second);
+		}
+		incremental = false;
+	}
+
+	// Put each touched topic back together from every document, in order.
+	for (unsigned int i = 0; i < touched.size(); i++) {
+		rs_dict<rs_topic>::iterator topic = brain.topics.find(string_view(touched[i]));
+		if (topic != brain.topics.end()) {
+			brain.topics.erase(topic);
+		}
+		rs_dict<rs_that_topic>::iterator that = brain.thats.find(string_view(touched[i]));
+		if (that != brain.thats.end()) {
+			brain.thats.erase(that);
+		}
+		for (unsigned int j = 0; j < brain.documents.size(); j++) {
+			_mergeTopic(*brain.documents[j].second, touched[i], brain.topics, brain.thats);
+		}
+
+		// A topic that's gone altogether is left to a full sort, which
+		// forgets its name.
+		if (brain.topics.find(string_view(touched[i])) == brain.topics.end() && brain.thats.find(string_view(touched[i])) == brain.thats.end()) {
+			incremental = false;
+		}
+	}
+
+	if (incremental) {
+		_sortTouched(brain, touched, rs_pool::defaultSize());
+	}
+	else {
+		sortReplies();
+	}
+	return true;
+}
+
+bool RiveScript::_rebuild (const string &file, const std::shared_ptr<rs_document> &doc) {
+	// Load the brain's sources again from scratch, with the new version of
+	// "file" (or without it, if "doc" is NULL).
+	vector<string> sources = _stage().sources;
+	if (doc && std::find(sources.begin(), sources.end(), file) == sources.end()) {
+		sources.push_back(file);
+	}
+
+	// If any of the others won't load, nothing changes.
+	std::unique_ptr<rs_brain> before (std::move(this->staging));
+	this->staging.reset(new rs_brain());
+	for (unsigned int i = 0; i < sources.size(); i++) {
+		if (sources[i] == file) {
+			if (doc) {
+				if (this->budget > 0 && _loadingBytes(*doc) > _budgetLeft(0)) {
+					RS_WARN("load", "Not loading " + file + ": it would go over the memory budget of " + std::to_string(this->budget) + " bytes");
+					this->staging = std::move(before);
+					return false;
+				}
+				_merge(file, doc);
+				this->staging->sources.push_back(file);
+				this->staging->hashes.push_back(doc->hash);
+			}
+			continue;
+		}
+
+		rs_mmap fh;
+		if (!fh.open(sources[i])) {
+			RS_WARN("load", "Unable to open file " + sources[i] + " for reading!");
+			this->staging = std::move(before);
+			return false;
+		}
+		std::shared_ptr<rs_document> other (new rs_document());
+		other->hash = rs_fnv1a(fh.data(), fh.size());
+		bool ok;
+		if (!_parseBudgeted(sources[i], fh.lines(), *other, ok, 0)) {
+			this->staging = std::move(before);
+			return false;
+		}
+		if (!ok) {
+			RS_WARN("load", "Failed to parse " + sources[i]);
+			this->staging = std::move(before);
+			return false;
+		}
+		_merge(sources[i], other);
+		this->staging->sources.push_back(sources[i]);
+		this->staging->hashes.push_back(other->hash);
+	}
+
+	sortReplies();
+	return true;
+}
+
+bool RiveScript::watchDirectory (const string &folder) {
+	unwatch();
+
+	// Files are reported with the same path loadDirectory() gave them, so a
+	// changed file replaces what it loaded and a new one is added.
+	this->watcher.reset(new rs_watcher([this] (const string &file) {
+		reloadFile(file);
+	}));
+	if (!this->watcher->watch(folder)) {
+		RS_WARN("load", "Unable to watch " + folder + " for changes");
+		this->watcher.reset();
+		return false;
+	}
+
+	RS_SAY("load", "Watching " + folder + " for changes");
+	return true;
+}
+
+void RiveScript::unwatch () {
+	// Waits for a reload that's under way to finish.
+	this->watcher.reset();
+}
+
+bool RiveScript::_loadBefore (const string &a, const string &b) {
+	// begin.rive (or begin.rs) sorts ahead of everything else.
+	bool beginA = strcasecmp(a.c_str(), "begin.rive") == 0 || strcasecmp(a.c_str(), "begin.rs") == 0;
+	bool beginB = strcasecmp(b.c_str(), "begin.rive") == 0 || strcasecmp(b.c_str(), "begin.rs") == 0;
+	if (beginA != beginB) {
+		return beginA;
+	}
+	return a < b;
+}
+
+bool RiveScript::parse (string file, vector<string> code) {
+	// Parse straight out of the lines we were given.
+	vector<string_view> lines;
+	lines.reserve(code.size());
+	for (unsigned int i = 0; i < code.size(); i++) {
+		lines.push_back(code[i]);
+	}
+	return parse(file, lines);
+}
+
+bool RiveScript::parse (const string &file, const vector<string_view> &code) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	std::shared_ptr<rs_document> doc (new rs_document());
+	bool ok;
+	if (!_parseBudgeted(file, code, *doc, ok, 0)) {
+		return false;
+	}
+
+	// Whatever was parsed before an error still counts.
+	_merge(file, doc);
+	return ok;
+}
+
+// What a look-ahead line means for the command before it.
+enum rs_look {
+	RS_LOOK_SKIP,     // Nothing; keep looking
+	RS_LOOK_STOP,     // The command is complete
+	RS_LOOK_PREVIOUS, // It's the %Previous of a +Trigger (which is then complete)
+	RS_LOOK_JOIN,     // ^Continue: tack it onto the end of the command
+	RS_LOOK_JOIN_LINE // ^Continue on a !Definition: tack it on as a new line
+};
+
+static rs_look rs_lookahead (char cmd, char lookCmd, string_view lookahead) {
+	// Only continue if there's any data.
+	if (lookahead.length() == 0) {
+		return RS_LOOK_SKIP;
+	}
+
+	// The lookahead command has to be either a % or a ^.
+	if (lookCmd != '^' && lookCmd != '%') {
+		return RS_LOOK_STOP;
+	}
+
+	// If the current command is a +, see if the following command is a
+	// %Previous.
+	if (cmd == '+' && lookCmd == '%') {
+		return RS_LOOK_PREVIOUS;
+	}
+
+	// If the current command is a ! and the next command(s) are ^, we'll
+	// tack each extension on as a line break (which is useful information
+	// for arrays; everything else is gonna ditch this info).
+	if (cmd == '!') {
+		return lookCmd == '^' ? RS_LOOK_JOIN_LINE : RS_LOOK_SKIP;
+	}
+
+	// If the current line is not a ^ and the line after is a ^, then tack it
+	// onto the end of the current line (this is fine for every other type of
+	// command that doesn't require special treatment).
+	if (cmd != '^' && lookCmd == '^') {
+		return RS_LOOK_JOIN;
+	}
+	return RS_LOOK_SKIP;
+}
+
+bool RiveScript::_parse (const string &file, const vector<string_view> &code, rs_document &doc) {
+	RS_SAY("parse", "Called upon to parse " + file);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "parse", "parse");
+
+	rs_parser parser (file);
+	string joined; // Scratch space for a line with ^Continues tacked on
+
+	// Classify every line once, up front. The tokens are views into the
+	// caller's text; only the bits that get stored in the brain are ever
+	// copied.
+	vector<rs_token> tokens;
+	tokens.reserve(code.size());
+	for (unsigned int i = 0; i < code.size(); i++) {
+		tokens.push_back(_tokenize(code[i]));
+	}
+
+	unsigned int lp;
+	for (lp = 0; lp < tokens.size(); lp++) {
+		parser.lineno++;
+
+		char cmd;
+		string_view line;
+		if (!_parseLine(parser, tokens[lp], cmd, line)) {
+			continue;
+		}
+
+		// Reset the %Previous state if this is a new +Trigger.
+		if (cmd == '+') {
+			parser.isThat = "";
+		}
+
+		// Do a look-ahead for ^Continue and %Previous commands. It stops at
+		// the next real command, so each ^Continue is only looked at by the
+		// command it belongs to. (A ^ or % line can't use anything it would
+		// find, so they don't look at all.)
+		bool owned = false; // Whether "line" has moved into "joined"
+		for (unsigned int i = (lp + 1); cmd != '^' && cmd != '%' && i < tokens.size(); i++) {
+			const rs_token &next = tokens[i];
+			if (next.cmd == '\0') {
+				continue; // Blank line
+			}
+
+			rs_look look = rs_lookahead(cmd, next.cmd, next.data);
+			if (look == RS_LOOK_STOP) {
+				break;
+			}
+			else if (look == RS_LOOK_PREVIOUS) {
+				RS_SAY("parse", "This line has a %Previous (" + string(next.data) + ")");
+				parser.isThat = next.data;
+				break;
+			}
+			else if (look == RS_LOOK_JOIN || look == RS_LOOK_JOIN_LINE) {
+				if (!owned) {
+					joined.assign(line.data(), line.length());
+					owned = true;
+				}
+				if (look == RS_LOOK_JOIN_LINE) {
+					joined += "<crlf>";
+				}
+				joined.append(next.data.data(), next.data.length());
+				line = joined;
+				RS_SAY("parse", "^ Line: " + joined);
+			}
+		}
+
+		if (!_parseCommand(parser, doc, cmd, line)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+RiveScript::rs_token RiveScript::_tokenize (string_view raw) {
+	rs_token token;
+	token.raw  = raw;
+	token.text = rs_trim(raw);
+	if (token.text.length() == 0) {
+		token.cmd = '\0';
+		return token;
+	}
+
+	// The left-most character is the command code; what's after it (minus
+	// any spaces) is its data.
+	token.cmd  = token.text[0];
+	token.data = rs_trim(token.text.substr(1));
+	return token;
+}
+
+bool RiveScript::_parseLine (rs_parser &parser, const rs_token &token, char &cmd, string_view &line) {
+	// Inside an object, everything up to the "< object" is its code, as-is.
+	if (parser.inobj && !(token.cmd == '<' && token.data == "object")) {
+		parser.objBuf.append(token.raw.data(), token.raw.length());
+		parser.objBuf += '\n';
+		return false;
+	}
+
+	// Skip a blank line.
+	if (token.cmd == '\0') {
+		return false;
+	}
+
+	// Look for comments.
+	string_view text = token.text;
+	if (text.substr(0,2) == "//") { // Single line comment.
+		return false;
+	}
+	else if (text.substr(0,2) == "/*") { // Multi-line comment START
+		parser.comment = true;
+		return false;
+	}
+	else if (text.find("*/") != string_view::npos) {
+		parser.comment = false;
+		return false;
+	}
+	else if (parser.comment) {
+		return false;
+	}
+
+	cmd  = token.cmd;
+	line = token.data;
+
+	// Strip off in-line comments if there's a space before and after a "//"
+	size_t inlineComment = line.find(" // ");
+	if (inlineComment != string_view::npos) {
+		RS_SAY("parse", "This line has an inline comment!");
+		line = rs_trim(line.substr(0, inlineComment)); // Drop from there to the end
+	}
+
+	RS_SAY("parse", "Cmd [" + string(1, cmd) + "] Line: " + string(line) + " (Topic: " + parser.topic + ")");
+
+	// TODO: syntax check this line
+	return true;
+}
+
+bool RiveScript::_parseCommand (rs_parser &parser, rs_document &doc, char cmd, string_view line) {
+	if (cmd == '!') {
+		// ! DEFINE
+		vector<string> halves = split(string(line), "=", 2);
+		string what = trim(halves[0]);
+		string is   = trim(halves[1]);
+		RS_SAY("parse", "! DEFINE: " + what + " => " + is);
+
+		// Is this a !version declaration?
+		if (what == "version") {
+			RS_SAY("parse", "Using RiveScript Version " + is);
+
+			// Cast it to a double to validate the version.
+			double version = strtod (is.c_str(), NULL);
+			if (version > this->rs_version) {
+				RS_WARN("parse", "Unsupported RiveScript version " + is + "; refusing to parse file!");
+				return false;
+			}
+		}
+		else if (indexOf(what," ") > -1) {
+			// This is a type of definition.
+			vector<string> halves = split(what, " ", 2);
+			string type = trim(halves[0]);
+			string name = trim(halves[1]);
+			RS_SAY("parse", "Definition type=" + type + " name=" + name);
+
+			// If setting to <undef>, we delete the field.
+			bool undef = false;
+			if (is == "<undef>") {
+				undef = true;
+			}
+
+			// Handle the types.
+			if (type == "global") {
+				// Setting a global variable.
+				doc.globals[name] = rs_definition(undef, is);
+				RS_SAY("parse", "Set global " + name + " => " + is);
+			}
+			else if (type == "var") {
+				// Setting a bot variable.
+				doc.bot[name] = rs_definition(undef, is);
+			}
+			else if (type == "array") {
+				// Setting an array.
+				vector<string> parts = split(is, "<crlf>");
+				vector<string> fields;
+
+				// An array can be defined over many lines via the ^CONTINUE,
+				// and each line ("parts" here) can separate its array elements
+				// by a pipe symbol "|" or by spaces. First we go over the "parts"
+				// and then look at the elements defined on each part.
+				for (unsigned int i = 0; i < parts.size(); i++) {
+					string part = parts[i];
+
+					// Is it pipe-separated or space separated?
+					if (indexOf(part, "|") > -1) {
+						vector<string> pieces = split(part,"|");
+						for (unsigned int j = 0; j < pieces.size(); j++) {
+							fields.push_back(pieces[j]);
+						}
+					}
+					else {
+						vector<string> pieces = split(part," ");
+						for (unsigned int j = 0; j < pieces.size(); j++) {
+							if (pieces[j].length() == 0) {
+								// Skip blank pieces (in case of multiple spaces to separate)
+								continue;
+							}
+							fields.push_back(pieces[j]);
+						}
+					}
+				}
+
+				// Convert escape code \s into a space
+				for (unsigned int i = 0; i < fields.size(); i++) {
+					fields[i] = replace(fields[i], "\\\\s", " ");
+				}
+
+				// Store the array.
+				doc.arrays[name] = fields;
+			}
+			else if (type == "sub") {
+				// Setting a substitution variable.
+				doc.subs[name] = rs_definition(undef, is);
+			}
+			else if (type == "person") {
+				// Setting a substitution variable.
+				doc.person[name] = rs_definition(undef, is);
+			}
+			else {
+				RS_WARN("parse", "Unknown definition type \"" + type + "\"" + " at " + parser.file + " line " + std::to_string(parser.lineno));
+			}
+		}
+	}
+	else if (cmd == '>') {
+		// > LABEL
+		vector<string> parts = split(string(line), " ");
+		string type  = parts[0];
+		string name  = parts.size() >= 2 ? parts[1] : "";
+
+		// Handle the label types.
+		if (type == "begin") {
+			RS_SAY("parse", "Found the BEGIN Statement.");
+			type = "topic";
+			name = "__begin__";
+		}
+		if (type == "topic") {
+			RS_SAY("parse", "Set topic to " + name);
+			parser.ontrig = "";
+			parser.topic  = name;
+
+			// TODO look for inherits and includes keywords
+			if (parts.size() >= 3) {
+				string mode = ""; // inherits or includes
+				for (unsigned int i = 2; i < parts.size(); i++) {
+					string text = parts[i];
+					if (text == "inherits" || text == "includes") {
+						mode = text;
+					}
+					else {
+						if (mode == "inherits") {
+							rs_slot(doc.topics, parser.topic).inherits.emplace_back(text);
+						}
+						else if (mode == "includes") {
+							rs_slot(doc.topics, parser.topic).includes.emplace_back(text);
+						}
+					}
+				}
+			}
+		}
+		if (type == "object") {
+			// If an extra field was provided, it should be the programming language.
+			string lang = parts.size() >= 3 ? parts[2] : "";
+			lang = trim(lang);
+			RS_SAY("parse", "Found an object definition named " + name + " of language " + lang);
+			parser.inobj   = true;
+			parser.objName = name;
+			parser.objLang = lang;
+			parser.objBuf.clear();
+		}
+	}
+	else if (cmd == '<') {
+		// < LABEL
+		string type (line);
+
+		if (type == "begin" || type == "topic") {
+			RS_SAY("parse", "End " + type + " label.");
+			parser.topic = "random";
+		}
+		else if (type == "object" && parser.inobj) {
+			RS_SAY("parse", "End object label.");
+			rs_object &object = doc.objects[parser.objName];
+			object.lang = parser.objLang;
+			object.code.swap(parser.objBuf);
+			parser.inobj = false;
+		}
+	}
+	else if (cmd == '+') {
+		// + TRIGGER
+		RS_SAY("parse", "Trigger pattern: " + string(line));
+//				// Initialize the rs_trigger object. (DON'T NEED TO! YAY!)
+//				rs_trigger trigger;
+//				rs_slot(doc.topics, parser.topic).trigger[line] = trigger;
+		parser.ontrig = line;
+	}
+	else if (cmd == '-') {
+		// - REPLY
+		RS_SAY("parse", "Reply: " + string(line));
+		if (parser.ontrig.length() == 0) {
+			RS_WARN("parse", "Reply found before a trigger!");
+			return true;
+		}
+
+		// Add the reply to this trigger (or its %Previous).
+		rs_list<rs_reply> &replies = parser.isThat.length() > 0
+			? rs_slot(rs_slot(rs_slot(doc.thats, parser.topic).that, parser.isThat).trigger, parser.ontrig).reply
+			: rs_slot(rs_slot(doc.topics, parser.topic).trigger, parser.ontrig).reply;
+		replies.emplace_back();
+		_compileReply(line, replies.back());
+	}
+	else if (cmd == '%') {
+		// % PREVIOUS
+		RS_SAY("parse", "%Previous pattern: " + string(line));
+		// This was handled above.
+	}
+	else if (cmd == '^') {
+		// ^ CONTINUE
+		// This was handled above.
+	}
+	else if (cmd == '@') {
+		// @ REDIRECT
+		RS_SAY("parse", "Redirect: " + string(line));
+		if (parser.ontrig.length() == 0) {
+			RS_WARN("parse", "Redirect found before a trigger!");
+			return true;
+		}
+
+		// Set the redirect for this trigger.
+		if (parser.isThat.length() > 0) {
+			rs_slot(rs_slot(rs_slot(doc.thats, parser.topic).that, parser.isThat).trigger, parser.ontrig).redirect = line;
+		}
+		else {
+			rs_slot(rs_slot(doc.topics, parser.topic).trigger, parser.ontrig).redirect = line;
+		}
+	}
+	else if (cmd == '*') {
+		// * CONDITION
+		RS_SAY("parse", "Condition: " + string(line));
+		rs_list<rs_condition> &conditions = parser.isThat.length() > 0
+			? rs_slot(rs_slot(rs_slot(doc.thats, parser.topic).that, parser.isThat).trigger, parser.ontrig).condition
+			: rs_slot(rs_slot(doc.topics, parser.topic).trigger, parser.ontrig).condition;
+		conditions.emplace_back();
+		_compileCondition(line, conditions.back());
+	}
+	else {
+		RS_WARN("parse", "Unrecognized command \"" + string(1, cmd) + "\"" + " at " + parser.file + " line " + std::to_string(parser.lineno));
+	}
+
+	return true;
+}
+
+bool RiveScript::stream (string_view code) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	if (!this->streaming) {
+		RS_SAY("parse", "Starting a stream");
+		this->streaming.reset(new rs_stream());
+	}
+	rs_stream &stream = *this->streaming;
+
+	// Feed it every line that's complete. Whatever's left over after the
+	// last newline waits for the next chunk.
+	while (code.length() > 0) {
+		size_t nl = code.find('\n');
+		if (nl == string_view::npos) {
+			stream.partial.append(code.data(), code.length());
+			break;
+		}
+
+		if (stream.partial.length() > 0) {
+			stream.partial.append(code.data(), nl);
+			_streamLine(stream, stream.partial);
+			stream.partial.clear();
+		}
+		else {
+			_streamLine(stream, code.substr(0, nl));
+		}
+		code = code.substr(nl + 1);
+	}
+
+	return !stream.failed;
+}
+
+bool RiveScript::endStream () {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	if (!this->streaming) {
+		return true;
+	}
+	rs_stream &stream = *this->streaming;
+
+	// The last line needn't end in a newline.
+	if (stream.partial.length() > 0) {
+		_streamLine(stream, stream.partial);
+	}
+
+	// Nothing else can follow what's still waiting, so it's all complete.
+	while (!stream.pending.empty() && !stream.failed) {
+		stream.pending.front().open = false;
+		_streamCommands(stream);
+	}
+	_mergeDocument(_stage(), *stream.doc);
+	_fold(*stream.doc, *stream.all);
+	_stage().documents.push_back(std::make_pair(stream.parser.file, stream.all));
+
+	bool ok = !stream.failed;
+	this->streaming.reset();
+	RS_SAY("parse", "Finished a stream");
+	return ok;
+}
+
+void RiveScript::_streamLine (rs_stream &stream, string_view raw) {
+	if (stream.failed) {
+		return; // Like parse(), give up on the rest of it
+	}
+	stream.parser.lineno++;
+
+	rs_token token = _tokenize(raw);
+	if (token.cmd == '\0' && !stream.parser.inobj) {
+		return;
+	}
+
+	// First, it's a look-ahead line for the commands still waiting on one.
+	for (unsigned int i = 0; i < stream.pending.size(); i++) {
+		rs_pending &pending = stream.pending[i];
+		if (!pending.open) {
+			continue;
+		}
+
+		rs_look look = rs_lookahead(pending.cmd, token.cmd, token.data);
+		if (look == RS_LOOK_STOP) {
+			pending.open = false;
+		}
+		else if (look == RS_LOOK_PREVIOUS) {
+			RS_SAY("parse", "This line has a %Previous (" + string(token.data) + ")");
+			pending.that.assign(token.data.data(), token.data.length());
+			pending.open = false;
+		}
+		else if (look == RS_LOOK_JOIN || look == RS_LOOK_JOIN_LINE) {
+			if (look == RS_LOOK_JOIN_LINE) {
+				pending.line += "<crlf>";
+			}
+			pending.line.append(token.data.data(), token.data.length());
+			RS_SAY("parse", "^ Line: " + pending.line);
+		}
+	}
+	_streamCommands(stream);
+
+	// Then it's a line in its own right, which waits for its own look-ahead
+	// (unless it's a ^ or % line, which can't use one).
+	char cmd;
+	string_view line;
+	if (_parseLine(stream.parser, token, cmd, line)) {
+		rs_pending pending;
+		pending.cmd    = cmd;
+		pending.line   = line;
+		pending.lineno = stream.parser.lineno;
+		pending.open   = cmd != '^' && cmd != '%';
+		stream.pending.push_back(std::move(pending));
+	}
+}
+
+void RiveScript::_streamCommands (rs_stream &stream) {
+	// Run the commands that are complete, in order.
+	while (!stream.pending.empty() && !stream.pending.front().open) {
+		rs_pending pending = std::move(stream.pending.front());
+		stream.pending.pop_front();
+
+		// A new trigger or topic means the last trigger is finished, so
+		// hand everything so far over to the brain.
+		if (pending.cmd == '+' || pending.cmd == '>' || pending.cmd == '<') {
+			_mergeDocument(_stage(), *stream.doc);
+			_fold(*stream.doc, *stream.all);
+			stream.doc.reset(new rs_document());
+		}
+
+		int lineno = stream.parser.lineno;
+		stream.parser.lineno = pending.lineno;
+		if (pending.cmd == '+') {
+			stream.parser.isThat = pending.that;
+		}
+		if (!_parseCommand(stream.parser, *stream.doc, pending.cmd, pending.line)) {
+			stream.failed = true;
+			stream.pending.clear();
+		}
+		stream.parser.lineno = lineno;
+	}
+}
+
+RiveScript::rs_brain &RiveScript::_stage () {
+	// Loading never touches the live brain; it works on a copy that gets
+	// published by sortReplies().
+	if (!this->staging) {
+		rs_rcu<rs_brain>::reader live (this->live);
+		this->staging.reset(new rs_brain(*live));
+	}
+	return *this->staging;
+}
+
+void RiveScript::_merge (const string &file, const std::shared_ptr<rs_document> &doc) {
+	// Keep the document, so the file can be reloaded on its own later.
+	rs_brain &brain = _stage();
+	brain.documents.push_back(std::make_pair(file, doc));
+	_mergeDocument(brain, *doc);
+}
+
+void RiveScript::_mergeDocument (rs_brain &brain, const rs_document &doc) {
+	// Fold one document's results into the brain, exactly as if it had been
+	// parsed straight into it.
+	_mergeDefinitions(brain, doc);
+
+	vector<string> topics;
+	_touched(doc, topics);
+	for (unsigned int i = 0; i < topics.size(); i++) {
+		_mergeTopic(doc, topics[i], brain.topics, brain.thats);
+	}
+}
+
+void RiveScript::_mergeDefinitions (rs_brain &brain, const rs_document &doc) {
+	// The last definition in the document wins and an <undef> deletes the
+	// field.
+	const map<string, rs_definition> *defs[] = { &doc.globals, &doc.bot, &doc.subs, &doc.person };
+	map<string, string> *into[] = { &brain.globals, &brain.bot, &brain.subs, &brain.person };
+	for (unsigned int i = 0; i < 4; i++) {
+		map<string, rs_definition>::const_iterator it;
+		for (it = defs[i]->begin(); it != defs[i]->end(); ++it) {
+			if (it->second.undef) {
+				into[i]->erase(it->first);
+			}
+			else {
+				(*into[i])[it->first] = it->second.value;
+			}
+		}
+	}
+
+	map<string, vector<string> >::const_iterator array_iter;
+	for (array_iter = doc.arrays.begin(); array_iter != doc.arrays.end(); ++array_iter) {
+		brain.arrays[array_iter->first] = array_iter->second;
+	}
+
+	map<string, rs_object>::const_iterator object_iter;
+	for (object_iter = doc.objects.begin(); object_iter != doc.objects.end(); ++object_iter) {
+		brain.objects[object_iter->first] = object_iter->second;
+	}
+}
+
+void RiveScript::_mergeTopic (const rs_document &doc, string_view name, rs_dict<rs_topic> &topics, rs_dict<rs_that_topic> &thats) {
+	// Triggers add their replies and conditions to any that already exist.
+	// (Copying out of the document's arena into the one "topics" uses.)
+	rs_dict<rs_topic>::const_iterator topic_iter = doc.topics.find(name);
+	if (topic_iter != doc.topics.end()) {
+		rs_topic &topic = rs_slot(topics, name);
+		const rs_topic &from = topic_iter->second;
+		topic.includes.insert(topic.includes.end(), from.includes.begin(), from.includes.end());
+		topic.inherits.insert(topic.inherits.end(), from.inherits.begin(), from.inherits.end());
+		_mergeTriggers(from.trigger, topic.trigger);
+	}
+
+	rs_dict<rs_that_topic>::const_iterator that_topic_iter = doc.thats.find(name);
+	if (that_topic_iter != doc.thats.end()) {
+		rs_that_topic &topic = rs_slot(thats, name);
+		rs_dict<rs_that>::const_iterator that_iter;
+		for (that_iter = that_topic_iter->second.that.begin(); that_iter != that_topic_iter->second.that.end(); ++that_iter) {
+			_mergeTriggers(that_iter->second.trigger, rs_slot(topic.that, that_iter->first).trigger);
+		}
+	}
+}
+
+void RiveScript::_fold (const rs_document &from, rs_document &into) {
+	// Fold one document into another, so that merging the result does the
+	// same as merging the two in turn. (For stream(), which merges as it
+	// goes but is reloaded as a whole.)
+	const map<string, rs_definition> *defs[] = { &from.globals, &from.bot, &from.subs, &from.person };
+	map<string, rs_definition> *to[] = { &into.globals, &into.bot, &into.subs, &into.person };
+	for (unsigned int i = 0; i < 4; i++) {
+		map<string, rs_definition>::const_iterator it;
+		for (it = defs[i]->begin(); it != defs[i]->end(); ++it) {
+			(*to[i])[it->first] = it->second;
+		}
+	}
+
+	map<string, vector<string> >::const_iterator array_iter;
+	for (array_iter = from.arrays.begin(); array_iter != from.arrays.end(); ++array_iter) {
+		into.arrays[array_iter->first] = array_iter->second;
+	}
+
+	map<string, rs_object>::const_iterator object_iter;
+	for (object_iter = from.objects.begin(); object_iter != from.objects.end(); ++object_iter) {
+		into.objects[object_iter->first] = object_iter->second;
+	}
+
+	vector<string> topics;
+	_touched(from, topics);
+	for (unsigned int i = 0; i < topics.size(); i++) {
+		_mergeTopic(from, topics[i], into.topics, into.thats);
+	}
+}
+
+void RiveScript::_touched (const rs_document &doc, vector<string> &topics) {
+	// Add the names of the topics the document adds anything to.
+	for (rs_dict<rs_topic>::const_iterator it = doc.topics.begin(); it != doc.topics.end(); ++it) {
+		topics.push_back(string(it->first));
+	}
+	for (rs_dict<rs_that_topic>::const_iterator it = doc.thats.begin(); it != doc.thats.end(); ++it) {
+		topics.push_back(string(it->first));
+	}
+	std::sort(topics.begin(), topics.end());
+	topics.erase(std::unique(topics.begin(), topics.end()), topics.end());
+}
+
+bool RiveScript::_sameDefinitions (const rs_document *a, const rs_document *b) {
+	// Whether two documents define the same things. (NULL defines nothing.)
+	rs_document none;
+	const rs_document &x = a ? *a : none;
+	const rs_document &y = b ? *b : none;
+	return x.globals == y.globals && x.bot == y.bot && x.subs == y.subs
+		&& x.person == y.person && x.arrays == y.arrays && x.objects == y.objects;
+}
+
+void RiveScript::_mergeTriggers (const rs_dict<rs_trigger> &from, rs_dict<rs_trigger> &into) {
+	rs_dict<rs_trigger>::const_iterator trig_iter;
+	for (trig_iter = from.begin(); trig_iter != from.end(); ++trig_iter) {
+		rs_trigger &trigger = rs_slot(into, trig_iter->first);
+		const rs_trigger &add = trig_iter->second;
+		trigger.reply.insert(trigger.reply.end(), add.reply.begin(), add.reply.end());
+		trigger.condition.insert(trigger.condition.end(), add.condition.begin(), add.condition.end());
+		if (add.redirect.length() > 0) {
+			trigger.redirect = add.redirect;
+		}
+	}
+}
+
+/******************************************************************************
+ * Snapshot Methods                                                           *
+ ******************************************************************************/
+
+// Snapshot file identification. Bump the version whenever the layout changes.
+static const uint32_t RS_SNAPSHOT_MAGIC   = 0x52425352; // "RSBR"
+static const uint32_t RS_SNAPSHOT_VERSION = 3;
+
+// The header: magic, version, then a checksum of everything after it.
+static const size_t RS_SNAPSHOT_HEADER = 16;
+
+bool RiveScript::saveSnapshot (const string &path) {
+	RS_SAY("snapshot", "Saving snapshot to " + path);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "snapshot", "saveSnapshot");
+	rs_rcu<rs_brain>::reader brain (this->live);
+
+	// The sources as they were when they were parsed, not as they are now:
+	// if one has changed since, the snapshot is already out of date.
+	uint64_t hash = _sourceHash(brain->sources, brain->hashes);
+
+	rs_snapshot_writer out;
+	out.u32(RS_SNAPSHOT_MAGIC);
+	out.u32(RS_SNAPSHOT_VERSION);
+	out.u64(0); // The checksum, filled in at the end
+	out.u64(hash);
+	out.strs(brain->sources);
+
+	// Definitions.
+	const map<string, string> *defs[] = { &brain->globals, &brain->bot, &brain->subs, &brain->person };
+	for (unsigned int i = 0; i < 4; i++) {
+		out.u32(defs[i]->size());
+		for (map<string, string>::const_iterator it = defs[i]->begin(); it != defs[i]->end(); ++it) {
+			out.str(it->first);
+			out.str(it->second);
+		}
+	}
+
+	out.u32(brain->arrays.size());
+	for (map<string, vector<string> >::const_iterator it = brain->arrays.begin(); it != brain->arrays.end(); ++it) {
+		out.str(it->first);
+		out.strs(it->second);
+	}
+
+	out.u32(brain->objects.size());
+	for (map<string, rs_object>::const_iterator it = brain->objects.begin(); it != brain->objects.end(); ++it) {
+		out.str(it->first);
+		out.str(it->second.lang);
+		out.str(it->second.code);
+	}
+
+	// Topics and %Previous triggers.
+	out.u32(brain->topics.size());
+	for (rs_dict<rs_topic>::const_iterator it = brain->topics.begin(); it != brain->topics.end(); ++it) {
+		out.str(it->first);
+		out.strs(it->second.includes);
+		out.strs(it->second.inherits);
+		_writeTriggers(out, it->second.trigger);
+	}
+
+	out.u32(brain->thats.size());
+	for (rs_dict<rs_that_topic>::const_iterator it = brain->thats.begin(); it != brain->thats.end(); ++it) {
+		out.str(it->first);
+		out.u32(it->second.that.size());
+		for (rs_dict<rs_that>::const_iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+			out.str(that->first);
+			_writeTriggers(out, that->second.trigger);
+		}
+	}
+
+	// Sorted buffers and their indexes.
+	out.u32(brain->sorted.size());
+	for (uint32_t id = 0; id < brain->sorted.size(); id++) {
+		out.str(brain->topicNames.name(id));
+
+		const vector<rs_sorted> *lists[] = { &brain->sorted[id].trigger, &brain->sorted[id].that };
+		for (unsigned int l = 0; l < 2; l++) {
+			out.u32(lists[l]->size());
+			for (unsigned int i = 0; i < lists[l]->size(); i++) {
+				const rs_sorted &entry = (*lists[l])[i];
+				out.str(brain->texts.name(entry.trigger));
+				out.str(entry.that != rs_symbols::none ? brain->texts.name(entry.that) : "");
+				out.str(brain->topicNames.name(entry.topic));
+				out.i32(entry.weight);
+				out.i32(entry.inherits);
+				out.i32(entry.category);
+				out.i32(entry.words);
+				out.i32(entry.length);
+			}
+		}
+
+		const rs_index &idx = brain->sorted[id].index;
+		out.u32(idx.required.size());
+		for (unsigned int i = 0; i < idx.required.size(); i++) {
+			out.u32(idx.required[i]);
+		}
+		out.u32(idx.wildcard.size());
+		for (unsigned int i = 0; i < idx.wildcard.size(); i++) {
+			out.u32(idx.wildcard[i]);
+		}
+		out.u32(idx.words.size());
+		for (size_t w = 0; w < idx.words.capacity(); w++) {
+			if (!idx.words.used(w)) {
+				continue;
+			}
+			const vector<unsigned int> &ranks = idx.words.value(w);
+			out.str(brain->words.name(idx.words.key(w)));
+			out.u32(ranks.size());
+			for (unsigned int i = 0; i < ranks.size(); i++) {
+				out.u32(ranks[i]);
+			}
+		}
+	}
+
+	string &image = out.image();
+	uint64_t checksum = rs_fnv1a(image.data() + RS_SNAPSHOT_HEADER, image.length() - RS_SNAPSHOT_HEADER);
+	memcpy(&image[RS_SNAPSHOT_HEADER - sizeof(checksum)], &checksum, sizeof(checksum));
+
+	// Write it out under a temporary name first so a crash can't leave a
+	// half-written snapshot behind.
+	string temp = path + ".tmp";
+	FILE *fh = fopen(temp.c_str(), "wb");
+	if (fh == NULL) {
+		RS_WARN("snapshot", "Unable to open " + temp + " for writing!");
+		return false;
+	}
+	bool written = fwrite(image.data(), 1, image.length(), fh) == image.length();
+	written = (fclose(fh) == 0) && written;
+	if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+		RS_WARN("snapshot", "Failed to write snapshot " + path);
+		remove(temp.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool RiveScript::loadSnapshot (const string &path) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	RS_SAY("snapshot", "Loading snapshot " + path);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "snapshot", "loadSnapshot");
+
+	rs_mmap fh;
+	if (!fh.open(path)) {
+		RS_WARN("snapshot", "Unable to open snapshot " + path + " for reading!");
+		return false;
+	}
+	rs_snapshot_reader in (fh.data(), fh.size());
+
+	if (in.u32() != RS_SNAPSHOT_MAGIC || in.u32() != RS_SNAPSHOT_VERSION) {
+		RS_WARN("snapshot", "Not a snapshot (or from an incompatible version): " + path);
+		return false;
+	}
+
+	// A damaged or truncated image is turned away before anything in it is
+	// believed. (The reader still checks every length and count against
+	// what's left, in case one that isn't ours happens to match.)
+	uint64_t checksum = in.u64();
+	if (!in.ok() || rs_fnv1a(fh.data() + RS_SNAPSHOT_HEADER, fh.size() - RS_SNAPSHOT_HEADER) != checksum) {
+		RS_WARN("snapshot", "Snapshot " + path + " is corrupt");
+		return false;
+	}
+
+	// Is it stale?
+	uint64_t hash = in.u64();
+	vector<string> sources;
+	in.strs(sources);
+
+	bool fresh = in.ok();
+	vector<uint64_t> hashes;
+	for (unsigned int i = 0; fresh && i < sources.size(); i++) {
+		rs_mmap fh;
+		fresh = fh.open(sources[i]);
+		if (fresh) {
+			hashes.push_back(rs_fnv1a(fh.data(), fh.size()));
+		}
+	}
+	if (!fresh || _sourceHash(sources, hashes) != hash) {
+		RS_WARN("snapshot", "Snapshot " + path + " is out of date with its source documents");
+		return false;
+	}
+
+	// Read everything into a new generation of the brain, so a bad snapshot
+	// doesn't leave a half-loaded one behind.
+	std::unique_ptr<rs_brain> brain (new rs_brain());
+	map<string, string> *defs[] = { &brain->globals, &brain->bot, &brain->subs, &brain->person };
+	for (unsigned int i = 0; i < 4; i++) {
+		uint32_t count = in.u32();
+		for (uint32_t j = 0; j < count && in.ok(); j++) {
+			string key (in.str());
+			(*defs[i])[key] = in.str();
+		}
+	}
+
+	uint32_t count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		string name (in.str());
+		in.strs(brain->arrays[name]);
+	}
+
+	count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		rs_object &object = brain->objects[string(in.str())];
+		object.lang = in.str();
+		object.code = in.str();
+	}
+
+	rs_dict<rs_topic> &topics = brain->topics;
+	count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		rs_topic &topic = rs_slot(topics, in.str());
+		in.strs(topic.includes);
+		in.strs(topic.inherits);
+		_readTriggers(in, topic.trigger);
+	}
+
+	rs_dict<rs_that_topic> &thats = brain->thats;
+	count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		rs_that_topic &topic = rs_slot(thats, in.str());
+		uint32_t that_count = in.u32();
+		for (uint32_t j = 0; j < that_count && in.ok(); j++) {
+			_readTriggers(in, rs_slot(topic.that, in.str()).trigger);
+		}
+	}
+
+	// The sorted buffers refer to everything by name in the snapshot; they
+	// get their IDs once the new brain is swapped in and interned.
+	struct rs_saved_entry {
+		string trigger, that, topic;
+		rs_sorted entry;
+	};
+	struct rs_saved_topic {
+		string name;
+		vector<rs_saved_entry> lists[2];
+		rs_index index;
+		vector< std::pair<string, vector<unsigned int> > > words;
+	};
+	vector<rs_saved_topic> saved;
+	count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		saved.emplace_back();
+		rs_saved_topic &buffer = saved.back();
+		buffer.name = in.str();
+
+		for (unsigned int l = 0; l < 2; l++) {
+			uint32_t entries = in.u32();
+			for (uint32_t j = 0; j < entries && in.ok(); j++) {
+				rs_saved_entry saved_entry;
+				rs_sorted &entry = saved_entry.entry;
+				saved_entry.trigger = in.str();
+				saved_entry.that    = in.str();
+				saved_entry.topic   = in.str();
+				entry.weight   = in.i32();
+				entry.inherits = in.i32();
+				entry.category = in.i32();
+				entry.words    = in.i32();
+				entry.length   = in.i32();
+
+				// Point the entry back at its trigger data.
+				entry.data = NULL;
+				if (saved_entry.that.length() == 0) {
+					rs_dict<rs_topic>::const_iterator topic = topics.find(string_view(saved_entry.topic));
+					if (topic != topics.end()) {
+						rs_dict<rs_trigger>::const_iterator trig = topic->second.trigger.find(string_view(saved_entry.trigger));
+						if (trig != topic->second.trigger.end()) {
+							entry.data = &trig->second;
+						}
+					}
+				}
+				else {
+					rs_dict<rs_that_topic>::const_iterator topic = thats.find(string_view(saved_entry.topic));
+					if (topic != thats.end() && topic->second.that.count(string_view(saved_entry.that)) > 0) {
+						const rs_dict<rs_trigger> &triggers = topic->second.that.find(string_view(saved_entry.that))->second.trigger;
+						rs_dict<rs_trigger>::const_iterator trig = triggers.find(string_view(saved_entry.trigger));
+						if (trig != triggers.end()) {
+							entry.data = &trig->second;
+						}
+					}
+				}
+				if (entry.data == NULL) {
+					RS_WARN("snapshot", "Snapshot " + path + " is corrupt (dangling sorted trigger)");
+					return false;
+				}
+
+				buffer.lists[l].push_back(saved_entry);
+			}
+		}
+
+		uint32_t n = in.u32();
+		for (uint32_t j = 0; j < n && in.ok(); j++) {
+			buffer.index.required.push_back(in.u32());
+		}
+		n = in.u32();
+		for (uint32_t j = 0; j < n && in.ok(); j++) {
+			buffer.index.wildcard.push_back(in.u32());
+		}
+		n = in.u32();
+		for (uint32_t j = 0; j < n && in.ok(); j++) {
+			buffer.words.push_back(std::make_pair(string(in.str()), vector<unsigned int>()));
+			uint32_t r = in.u32();
+			for (uint32_t k = 0; k < r && in.ok(); k++) {
+				buffer.words.back().second.push_back(in.u32());
+			}
+		}
+	}
+
+	if (!in.ok() || !in.done()) {
+		RS_WARN("snapshot", "Snapshot " + path + " is corrupt");
+		return false;
+	}
+
+	// All good. Rebuild the sorted buffers against the new brain's IDs.
+	brain->sources.swap(sources);
+	brain->hashes.swap(hashes);
+	_compileTables(*brain, NULL);
+	_compileSubs(*brain);
+	_bindMacros(*brain);
+
+	for (unsigned int i = 0; i < saved.size(); i++) {
+		uint32_t id = brain->topicNames.intern(saved[i].name);
+		if (id >= brain->sorted.size()) {
+			brain->sorted.resize(id + 1);
+		}
+		rs_sorted_topic &buffer = brain->sorted[id];
+
+		vector<rs_sorted> *lists[] = { &buffer.trigger, &buffer.that };
+		for (unsigned int l = 0; l < 2; l++) {
+			for (unsigned int j = 0; j < saved[i].lists[l].size(); j++) {
+				rs_saved_entry &saved_entry = saved[i].lists[l][j];
+				saved_entry.entry.trigger = brain->texts.intern(saved_entry.trigger);
+				saved_entry.entry.that    = saved_entry.that.length() > 0 ? brain->texts.intern(saved_entry.that) : rs_symbols::none;
+				saved_entry.entry.topic   = brain->topicNames.intern(saved_entry.topic);
+				lists[l]->push_back(saved_entry.entry);
+			}
+		}
+
+		buffer.index.required.swap(saved[i].index.required);
+		buffer.index.wildcard.swap(saved[i].index.wildcard);
+		for (unsigned int j = 0; j < saved[i].words.size(); j++) {
+			buffer.index.words[brain->words.intern(saved[i].words[j].first)].swap(saved[i].words[j].second);
+		}
+	}
+	brain->sorted.resize(brain->topicNames.size());
+	for (uint32_t id = 0; id < brain->sorted.size(); id++) {
+		_indexList(*brain, brain->sorted[id].that, true, brain->sorted[id].thatIndex);
+		_compileTopic(*brain, brain->sorted[id]);
+	}
+
+	// Publish it. (The new generation's nodes, and with them the sorted
+	// entries' data pointers, stay where they are. The old generation is
+	// released in one go once the last reply using it is done.)
+	this->staging.reset();
+	this->live.publish(brain.release());
+
+	return true;
+}
+
+uint64_t RiveScript::_sourceHash (const vector<string> &files, const vector<uint64_t> &hashes) {
+	// Hash the names of the source documents, in load order, along with the
+	// hash of each one's contents.
+	uint64_t hash = rs_fnv1a(NULL, 0);
+	for (unsigned int i = 0; i < files.size() && i < hashes.size(); i++) {
+		hash = rs_fnv1a(files[i].c_str(), files[i].length() + 1, hash);
+		hash = rs_fnv1a((const char*)&hashes[i], sizeof(hashes[i]), hash);
+	}
+	return hash;
+}
+
+void RiveScript::_writeTriggers (rs_snapshot_writer &out, const rs_dict<rs_trigger> &triggers) {
+	out.u32(triggers.size());
+	for (rs_dict<rs_trigger>::const_iterator it = triggers.begin(); it != triggers.end(); ++it) {
+		out.str(it->first);
+		out.str(it->second.redirect);
+		out.u32(it->second.reply.size());
+		for (unsigned int i = 0; i < it->second.reply.size(); i++) {
+			out.str(it->second.reply[i].source);
+		}
+		out.u32(it->second.condition.size());
+		for (unsigned int i = 0; i < it->second.condition.size(); i++) {
+			out.str(it->second.condition[i].source);
+		}
+	}
+}
+
+bool RiveScript::_readTriggers (rs_snapshot_reader &in, rs_dict<rs_trigger> &triggers) {
+	uint32_t count = in.u32();
+	for (uint32_t i = 0; i < count && in.ok(); i++) {
+		rs_trigger &trigger = rs_slot(triggers, in.str());
+		trigger.redirect = in.str();
+
+		// Replies and conditions are saved as written, and compiled again.
+		vector<string> replies, conditions;
+		in.strs(replies);
+		for (unsigned int j = 0; j < replies.size(); j++) {
+			trigger.reply.emplace_back();
+			_compileReply(replies[j], trigger.reply.back());
+		}
+		in.strs(conditions);
+		for (unsigned int j = 0; j < conditions.size(); j++) {
+			trigger.condition.emplace_back();
+			_compileCondition(conditions[j], trigger.condition.back());
+		}
+	}
+	return in.ok();
+}
+
+/******************************************************************************
+ * Reply Methods                                                              *
+ ******************************************************************************/
+
+// Replies for when things go wrong.
+static const char *RS_ERR_MATCH  = "[ERR: No Reply Matched]";
+static const char *RS_ERR_REPLY  = "[ERR: No Reply Found]";
+static const char *RS_ERR_DEEP   = "[ERR: Deep Recursion Detected]";
+static const char *RS_ERR_TOPIC  = "[ERR: No default topic 'random' was found]";
+static const char *RS_ERR_OBJECT = "[ERR: Object Not Found]";
+static const char *RS_ERR_BUSY   = "[ERR: Object Busy]";
+static const char *RS_ERR_SLOW   = "[ERR: Object Timed Out]";
+
+// How many of a user's past messages (and our replies) are kept around for
+// the <input1>-<input9> and <reply1>-<reply9> tags.
+static const unsigned int RS_HISTORY = 9;
+
+// The seed given to seedRandom(), and how many times it's been given one.
+// Each thread's generator picks up a new seed the next time it's used, mixed
+// with a turn number handed out in the order the threads get to it, so no two
+// threads draw the same sequence.
+static std::atomic<uint64_t> rs_seed (0);
+static std::atomic<uint64_t> rs_seeded (0);
+static std::atomic<uint64_t> rs_turns (0);
+
+// A random number in [0, n), from a generator of the calling thread's own.
+static uint64_t rs_random (uint64_t n) {
+	thread_local std::mt19937_64 rng (std::random_device{}());
+	thread_local uint64_t generation = 0;
+	uint64_t seeded = rs_seeded.load(std::memory_order_acquire);
+	if (seeded != generation) {
+		uint64_t seed = rs_seed.load(std::memory_order_relaxed);
+		uint64_t turn = rs_turns.fetch_add(1, std::memory_order_relaxed);
+		std::seed_seq mixed {
+			(uint32_t)seed, (uint32_t)(seed >> 32), (uint32_t)turn, (uint32_t)(turn >> 32)
+		};
+		rng.seed(mixed);
+		generation = seeded;
+	}
+	return std::uniform_int_distribution<uint64_t>(0, n - 1)(rng);
+}
+
+// Parse a whole string as an integer.
+static bool rs_integer (const string &text, long &value) {
+	if (text.length() == 0) {
+		return false;
+	}
+	char *end;
+	errno = 0;
+	value = strtol(text.c_str(), &end, 10);
+	return *end == '\0' && errno == 0;
+}
+
+string RiveScript::reply (const string &user, const string &message) {
+	RS_SAY("reply", "Asked to reply to [" + user + "] " + message);
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "reply", "reply");
+
+	// Pin the current brain for the whole reply. A reload in the meantime
+	// publishes a new one without pulling this one out from under us.
+	rs_rcu<rs_brain>::reader brain (this->live);
+
+	// Format their message.
+	return _reply(*brain, user, _formatMessage(*brain, message));
+}
+
+vector<string> RiveScript::replyBatch (const vector<rs_message> &messages) {
+	return replyBatch(messages.data(), messages.size());
+}
+
+vector<string> RiveScript::replyBatch (const rs_message *messages, size_t count) {
+	RS_SAY("reply", "Asked to reply to a batch of " + std::to_string(count) + " messages");
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "reply", "replyBatch");
+
+	// The whole batch is answered from the same brain.
+	rs_rcu<rs_brain>::reader live (this->live);
+	const rs_brain &brain = *live;
+	vector<string> replies (count);
+	if (count == 0) {
+		return replies;
+	}
+	rs_pool &pool = _workers();
+
+	// Format every message up front, in even slices across the workers;
+	// that doesn't depend on who sent them.
+	vector<string> formatted (count);
+	{
+		size_t slices = std::min<size_t>(count, pool.size() * 4);
+		rs_latch done (slices);
+		for (size_t s = 0; s < slices; s++) {
+			size_t from = count * s / slices;
+			size_t to = count * (s + 1) / slices;
+			pool.submit([this, &brain, messages, &formatted, &done, from, to] () {
+				for (size_t i = from; i < to; i++) {
+					formatted[i] = _formatMessage(brain, messages[i].second);
+				}
+				done.countDown();
+			});
+		}
+		done.wait();
+	}
+
+	// Then one task per user, which answers their messages in the order they
+	// came in. Different users' tasks run side by side.
+	std::unordered_map<string_view, vector<size_t> > byUser;
+	for (size_t i = 0; i < count; i++) {
+		byUser[messages[i].first].push_back(i);
+	}
+	{
+		rs_latch done (byUser.size());
+		std::unordered_map<string_view, vector<size_t> >::const_iterator it;
+		for (it = byUser.begin(); it != byUser.end(); ++it) {
+			const vector<size_t> *order = &it->second;
+			pool.submit([this, &brain, messages, &formatted, &replies, &done, order] () {
+				// Reading on our behalf, so a macro that publishes a new
+				// brain doesn't wait for us to let go of this one.
+				rs_rcu<rs_brain>::borrower reading;
+				for (size_t i = 0; i < order->size(); i++) {
+					size_t n = (*order)[i];
+					replies[n] = _reply(brain, messages[n].first, formatted[n]);
+				}
+				done.countDown();
+			});
+		}
+		done.wait();
+	}
+
+	return replies;
+}
+
+string RiveScript::_reply (const rs_brain &brain, const string &user, const string &msg) {
+	// Work on a copy of the user's state, and put it back when we're done.
+	rs_session state;
+	this->users.get(user, state);
+	rs_call call (brain, user, state);
+
+	string reply;
+	if (brain.topics.find(string_view("__begin__")) != brain.topics.end()) {
+		// The begin block gets the first say, and can wrap the real reply in
+		// its own with an {ok}.
+		string begin = _getReply(call, "request", true, 0);
+		if (begin.find("{ok}") != string::npos) {
+			rs_replace(begin, "{ok}", _getReply(call, msg, false, 0));
+		}
+		reply = _processTags(call, begin, vector<string>(), vector<string>(), 0);
+	}
+	else {
+		reply = _getReply(call, msg, false, 0);
+	}
+
+	// Save their history.
+	state.input.push(msg);
+	state.reply.push(reply);
+	this->users.put(user, std::move(state));
+
+	return reply;
+}
+
+string RiveScript::getUservar (const string &user, const string &name) {
+	string value;
+	return this->users.getVar(user, name, value) ? value : "undefined";
+}
+
+void RiveScript::setUservar (const string &user, const string &name, const string &value) {
+	this->users.setVar(user, name, value);
+}
+
+rs_pool &RiveScript::_workers () {
+	std::call_once(this->workersStarted, [this] () {
+		this->workers.reset(new rs_pool(rs_pool::defaultSize()));
+	});
+	return *this->workers;
+}
+
+rs_sessions &RiveScript::sessions () {
+	return this->users;
+}
+
+void RiveScript::seedRandom (uint64_t seed) {
+	rs_seed.store(seed, std::memory_order_relaxed);
+	rs_turns.store(0, std::memory_order_relaxed);
+	rs_seeded.fetch_add(1, std::memory_order_release);
+}
+
+string RiveScript::_getReply (rs_call &call, const string &message, bool begin, int step) {
+	const rs_brain &brain = call.brain;
+	rs_session &user = call.user;
+
+	// Which topic are they in? Put them back in "random" if it's gone.
+	string topic = _uservar(user, "topic");
+	if (brain.topics.find(string_view(topic)) == brain.topics.end()) {
+		topic = "random";
+		user.vars["topic"] = topic;
+	}
+
+	if (step > this->depth) {
+		return RS_ERR_DEEP;
+	}
+	if (begin) {
+		topic = "__begin__";
+	}
+
+	const rs_sorted_topic *sorted = _sortedTopic(brain, topic);
+	if (sorted == NULL) {
+		return RS_ERR_TOPIC;
+	}
+
+	const rs_sorted *matched = NULL;
+	vector<string> stars;
+	vector<string> botstars;
+
+	// Is this an answer to something we said? Only their own message (not a
+	// redirect) is checked against the %Previous triggers, and only the ones
+	// whose literal words are all in our last reply.
+	if (step == 0 && sorted->that.size() > 0) {
+		const string &lastReply = _lastReply(call);
+		vector<const rs_sorted*> candidates = _candidates(brain, sorted->thatIndex, sorted->that, lastReply);
+
+		// Many triggers can share a %Previous; one that doesn't match our
+		// last reply is only tried once.
+		vector<uint32_t> failed;
+		for (unsigned int i = 0; i < candidates.size(); i++) {
+			const rs_sorted &entry = *candidates[i];
+			if (std::find(failed.begin(), failed.end(), entry.that) != failed.end()) {
+				continue;
+			}
+			if (!_matchTrigger(call, entry.thatRegex, entry.thatPattern, lastReply, botstars)) {
+				failed.push_back(entry.that);
+				continue;
+			}
+			if (_matchTrigger(call, entry.regex, entry.pattern, message, stars)) {
+				matched = &entry;
+				break;
+			}
+		}
+	}
+
+	// Search their topic for a match to their message.
+	if (matched == NULL) {
+		vector<const rs_sorted*> candidates = _candidates(brain, topic, message);
+		for (unsigned int i = 0; i < candidates.size(); i++) {
+			if (_matchTrigger(call, candidates[i]->regex, candidates[i]->pattern, message, stars)) {
+				matched = candidates[i];
+				break;
+			}
+		}
+	}
+
+	if (matched == NULL) {
+		return RS_ERR_MATCH;
+	}
+	RS_SAY("reply", "Found a match: " + brain.texts.name(matched->trigger));
+	if (!begin) {
+		user.lastMatch = brain.texts.name(matched->trigger);
+	}
+	const rs_trigger &trigger = *matched->data;
+
+	// A hard redirect gets its reply from another trigger.
+	if (trigger.redirect.length() > 0) {
+		string redirect;
+		rs_casefold(_processTags(call, string(trigger.redirect), stars, botstars, step), redirect);
+		RS_SAY("reply", "Redirecting to " + redirect);
+		return _getReply(call, redirect, false, step + 1);
+	}
+
+	// The first condition that's true picks the reply; otherwise it's a
+	// random one of the normal replies.
+	const rs_reply *chosen = NULL;
+	for (unsigned int i = 0; i < trigger.condition.size(); i++) {
+		if (_checkCondition(call, trigger.condition[i], stars, botstars, step)) {
+			chosen = &trigger.condition[i].reply;
+			break;
+		}
+	}
+	if (chosen == NULL || chosen->source.length() == 0) {
+		chosen = _pickReply(trigger);
+	}
+	if (chosen == NULL || chosen->source.length() == 0) {
+		return RS_ERR_REPLY;
+	}
+
+	if (!begin) {
+		return _renderReply(call, *chosen, stars, botstars, step);
+	}
+	string reply (chosen->source);
+
+	// The begin block can only set the topic and user variables here; the
+	// rest of its tags wait until the real reply is in.
+	size_t pos;
+	while ((pos = reply.find("{topic=")) != string::npos) {
+		size_t end = reply.find('}', pos);
+		if (end == string::npos) {
+			break;
+		}
+		user.vars["topic"] = reply.substr(pos + 7, end - pos - 7);
+		reply.erase(pos, end - pos + 1);
+	}
+	while ((pos = reply.find("<set ")) != string::npos) {
+		size_t end = reply.find('>', pos);
+		if (end == string::npos) {
+			break;
+		}
+		vector<string> parts = split(reply.substr(pos + 5, end - pos - 5), "=", 2);
+		user.vars[trim(parts[0])] = trim(parts[1]);
+		reply.erase(pos, end - pos + 1);
+	}
+	return reply;
+}
+
+const string &RiveScript::_lastReply (rs_call &call) {
+	// Formatted once per message, however many times it's asked for.
+	if (!call.haveLastReply) {
+		call.lastReply = _formatMessage(call.brain, _history(call.user.reply, 1));
+		call.haveLastReply = true;
+	}
+	return call.lastReply;
+}
+
+string RiveScript::_formatMessage (const rs_brain &brain, const string &message) {
+	// Case-fold it and run the substitutions, then keep only the words
+	// (letters, numbers and single spaces). The scratch buffers are kept per
+	// thread so they don't have to be allocated for every message.
+	static thread_local string folded, subbed;
+	rs_casefold(message, folded);
+	brain.subst.apply(folded, subbed);
+
+	string out;
+	rs_words(subbed, out);
+	return out;
+}
+
+bool RiveScript::_matchTrigger (rs_call &call, const rs_regex &regex, const string &pattern, const string &message, vector<string> &stars) {
+	if (regex) {
+		return _matchRegexp(regex, message, stars);
+	}
+	if (pattern.length() == 0) {
+		return false; // It didn't compile.
+	}
+
+	// The pattern depends on the user: fill in their variables and history,
+	// then look it up in the cache.
+	string filled;
+	for (size_t i = 0; i < pattern.length(); i++) {
+		size_t end = pattern[i] == '<' ? pattern.find('>', i) : string::npos;
+		if (end == string::npos) {
+			filled += pattern[i];
+			continue;
+		}
+
+		string tag = pattern.substr(i + 1, end - i - 1);
+		string value;
+		if (tag.compare(0, 4, "get ") == 0) {
+			rs_casefold(_uservar(call.user, tag.substr(4)), value);
+		}
+		else if (tag.compare(0, 5, "input") == 0 || tag.compare(0, 5, "reply") == 0) {
+			unsigned int index = tag.length() > 5 ? atoi(tag.c_str() + 5) : 1;
+			value = _formatMessage(call.brain, _history(tag[0] == 'i' ? call.user.input : call.user.reply, index));
+		}
+		else {
+			filled += pattern[i];
+			continue;
+		}
+		filled += _quoteRegexp(value);
+		i = end;
+	}
+
+	return _matchRegexp(this->regexes.get(filled), message, stars);
+}
+
+void RiveScript::_compileCondition (string_view line, rs_condition &condition) {
+	// * left op right => reply
+	condition.source = line;
+	condition.op = 0;
+	size_t arrow = line.find("=>");
+	if (arrow == string_view::npos) {
+		return;
+	}
+
+	boost::smatch parts;
+	string test = trim(string(line.substr(0, arrow)));
+	rs_regex syntax = this->regexes.get("^(.+?)\\s+(==|eq|!=|ne|<>|<|<=|>|>=)\\s+(.*?)$");
+	if (!boost::regex_match(test, parts, *syntax)) {
+		return;
+	}
+
+	string op = parts[2].str();
+	condition.op = op == "==" || op == "eq" ? '='
+		: op == "!=" || op == "ne" || op == "<>" ? '!'
+		: op == "<=" ? 'l' : op == ">=" ? 'g' : op[0];
+	_compileOperand(parts[1].str(), condition.left);
+	_compileOperand(parts[3].str(), condition.right);
+	_compileReply(trim(string(line.substr(arrow + 2))), condition.reply);
+}
+
+void RiveScript::_compileOperand (const string &text, rs_operand &operand) {
+	operand.text  = text;
+	operand.index = 0;
+
+	// Plain text is a constant.
+	if (text.find_first_of("<{\\") == string::npos) {
+		operand.kind = RS_OPERAND_TEXT;
+		if (text.length() == 0) {
+			operand.text = "undefined";
+		}
+		operand.numeric = rs_integer(string(operand.text), operand.number);
+		return;
+	}
+
+	// So is a single tag we can look up by itself. Anything else is left to
+	// _processTags().
+	operand.kind = RS_OPERAND_TEMPLATE;
+	if (text[0] != '<' || text.find_first_of("<>", 1) != text.length() - 1) {
+		return;
+	}
+	string tag = text.substr(1, text.length() - 2);
+	size_t space = tag.find(' ');
+	string name = tag.substr(0, space);
+	string data = space == string::npos ? "" : tag.substr(space + 1);
+
+	const char *history[] = { "star", "botstar", "input", "reply" };
+	const rs_operand_kind kinds[] = { RS_OPERAND_STAR, RS_OPERAND_BOTSTAR, RS_OPERAND_INPUT, RS_OPERAND_REPLY };
+	for (unsigned int i = 0; i < 4; i++) {
+		size_t length = strlen(history[i]);
+		if (space != string::npos || name.compare(0, length, history[i]) != 0) {
+			continue;
+		}
+		if (name.length() == length) {
+			operand.kind  = kinds[i];
+			operand.index = 1;
+		}
+		else if (name.length() == length + 1 && name[length] >= '1' && name[length] <= '0' + (int)RS_HISTORY) {
+			operand.kind  = kinds[i];
+			operand.index = name[length] - '0';
+		}
+		return;
+	}
+
+	if (name == "id" && space == string::npos) {
+		operand.kind = RS_OPERAND_ID;
+		return;
+	}
+
+	for (size_t i = 0; i < name.length(); i++) {
+		name[i] = tolower((unsigned char)name[i]);
+	}
+	if ((name == "get" || name == "bot" || name == "env") && data.find('=') == string::npos) {
+		operand.kind = name == "get" ? RS_OPERAND_GET : name == "bot" ? RS_OPERAND_BOT : RS_OPERAND_ENV;
+		operand.text = data;
+	}
+}
+
+bool RiveScript::_checkCondition (rs_call &call, const rs_condition &condition, const vector<string> &stars, const vector<string> &botstars, int step) {
+	if (condition.op == 0) {
+		RS_WARN("reply", "Malformed condition: " + string(condition.source));
+		return false;
+	}
+
+	string left  = _operand(call, condition.left, stars, botstars, step);
+	string right = _operand(call, condition.right, stars, botstars, step);
+
+	bool passed = false;
+	if (condition.op == '=') {
+		passed = left == right;
+	}
+	else if (condition.op == '!') {
+		passed = left != right;
+	}
+	else {
+		// The rest only work on numbers. Constants were converted already.
+		long a = condition.left.number, b = condition.right.number;
+		if ((condition.left.numeric || rs_integer(left, a)) && (condition.right.numeric || rs_integer(right, b))) {
+			char op = condition.op;
+			passed = (op == '<' && a < b) || (op == 'l' && a <= b) || (op == '>' && a > b) || (op == 'g' && a >= b);
+		}
+	}
+
+	return passed;
+}
+
+string RiveScript::_operand (rs_call &call, const rs_operand &operand, const vector<string> &stars, const vector<string> &botstars, int step) {
+	string value;
+	const string *var;
+	switch (operand.kind) {
+		case RS_OPERAND_TEXT:
+			return string(operand.text);
+		case RS_OPERAND_STAR:
+			value = _history(stars, operand.index);
+			break;
+		case RS_OPERAND_BOTSTAR:
+			value = _history(botstars, operand.index);
+			break;
+		case RS_OPERAND_INPUT:
+			value = _history(call.user.input, operand.index);
+			break;
+		case RS_OPERAND_REPLY:
+			value = _history(call.user.reply, operand.index);
+			break;
+		case RS_OPERAND_GET:
+			value = _uservar(call.user, string(operand.text));
+			break;
+		case RS_OPERAND_BOT:
+		case RS_OPERAND_ENV:
+			var = operand.kind == RS_OPERAND_BOT ? _botVar(call.brain, operand.text) : _globalVar(call.brain, operand.text);
+			value = var != NULL ? *var : "undefined";
+			break;
+		case RS_OPERAND_ID:
+			value = call.id;
+			break;
+		case RS_OPERAND_TEMPLATE:
+			value = _processTags(call, string(operand.text), stars, botstars, step);
+			break;
+	}
+
+	// A value with tags of its own in it would have had them filled in too.
+	if (operand.kind != RS_OPERAND_TEMPLATE && value.find_first_of("<{\\") != string::npos) {
+		string text (operand.text);
+		if (operand.kind == RS_OPERAND_GET || operand.kind == RS_OPERAND_BOT || operand.kind == RS_OPERAND_ENV) {
+			const char *tag = operand.kind == RS_OPERAND_GET ? "get" : operand.kind == RS_OPERAND_BOT ? "bot" : "env";
+			text = string("<") + tag + " " + text + ">";
+		}
+		value = _processTags(call, text, stars, botstars, step);
+	}
+	return value.length() > 0 ? value : "undefined";
+}
+
+const RiveScript::rs_reply *RiveScript::_pickReply (const rs_trigger &trigger) {
+	// One draw picks a column of the alias table and a point within it: the
+	// column's own reply below its cutoff, its alias above.
+	if (trigger.total == 0 || trigger.alias.size() != trigger.reply.size()) {
+		return NULL;
+	}
+	uint64_t draw = rs_random(trigger.total * trigger.reply.size());
+	uint64_t column = draw / trigger.total;
+	return &trigger.reply[draw % trigger.total < trigger.cutoff[column] ? column : trigger.alias[column]];
+}
+
+void RiveScript::_buildAlias (rs_trigger &trigger) {
+	// Vose's alias method, in whole numbers: each reply's weight is scaled
+	// by the number of replies, so that every column holds exactly "total".
+	size_t n = trigger.reply.size();
+	trigger.cutoff.assign(n, 0);
+	trigger.alias.assign(n, 0);
+	trigger.total = 0;
+
+	vector<uint64_t> scaled (n);
+	for (size_t i = 0; i < n; i++) {
+		int weight = trigger.reply[i].weight;
+		if (weight <= 0) {
+			RS_WARN("reply", "Can't have a weight <= 0!");
+			weight = 1;
+		}
+		scaled[i] = (uint64_t)weight * n;
+		trigger.total += weight;
+	}
+
+	vector<uint32_t> small, large;
+	for (size_t i = 0; i < n; i++) {
+		(scaled[i] < trigger.total ? small : large).push_back(i);
+	}
+	while (small.size() > 0 && large.size() > 0) {
+		uint32_t less = small.back(), more = large.back();
+		small.pop_back();
+		large.pop_back();
+
+		// The short column is topped up from the tall one.
+		trigger.cutoff[less] = scaled[less];
+		trigger.alias[less]  = more;
+		scaled[more] -= trigger.total - scaled[less];
+		(scaled[more] < trigger.total ? small : large).push_back(more);
+	}
+	for (size_t i = 0; i < small.size(); i++) {
+		trigger.cutoff[small[i]] = trigger.total;
+	}
+	for (size_t i = 0; i < large.size(); i++) {
+		trigger.cutoff[large[i]] = trigger.total;
+	}
+}
+
+void RiveScript::_compileReply (string_view text, rs_reply &reply) {
+	reply.source = text;
+	reply.segments.clear();
+	reply.weight   = 1;
+	reply.compiled = false;
+	reply.finish   = false;
+
+	size_t pos = text.find("{weight=");
+	if (pos != string_view::npos) {
+		reply.weight = atoi(reply.source.c_str() + pos + 8);
+	}
+
+	// Do what _processTags() does to the text before any tags are filled in:
+	// expand the shortcuts, drop the {weight}s and apply the escapes. An
+	// escape could run into a tag's value, so those are left to it.
+	string body (text);
+	rs_replace(body, "<person>", "{person}<star>{/person}");
+	rs_replace(body, "<@>", "{@<star>}");
+	rs_replace(body, "<formal>", "{formal}<star>{/formal}");
+	rs_replace(body, "<sentence>", "{sentence}<star>{/sentence}");
+	rs_replace(body, "<uppercase>", "{uppercase}<star>{/uppercase}");
+	rs_replace(body, "<lowercase>", "{lowercase}<star>{/lowercase}");
+	rs_replace(body, "{__call__}", "<call>");
+	rs_replace(body, "{/__call__}", "</call>");
+	while ((pos = body.find("{weight=")) != string::npos) {
+		size_t end = body.find('}', pos);
+		if (end == string::npos) {
+			break;
+		}
+		body.erase(pos, end - pos + 1);
+	}
+	if (body.find("\\<") != string::npos) {
+		return;
+	}
+	rs_replace(body, "\\s", " ");
+	rs_replace(body, "\\n", "\n");
+	rs_replace(body, "\\#", "#");
+
+	// Cut it up into literal text and tags.
+	rs_list<rs_segment> &segments = reply.segments;
+	string literal;
+	auto flush = [&segments, &literal] () {
+		if (literal.length() > 0) {
+			segments.emplace_back();
+			segments.back().text = literal;
+			literal.clear();
+		}
+	};
+	auto add = [&segments, &flush] (rs_segment_kind kind, unsigned int index) -> rs_segment& {
+		flush();
+		segments.emplace_back();
+		segments.back().kind  = kind;
+		segments.back().index = index;
+		return segments.back();
+	};
+
+	// The tags that are filled in before anything else: <starN> and the
+	// like, and <id>.
+	auto history = [] (const string &tag, rs_segment_kind &kind, unsigned int &index) {
+		const char *names[] = { "star", "botstar", "input", "reply" };
+		const rs_segment_kind kinds[] = { RS_SEGMENT_STAR, RS_SEGMENT_BOTSTAR, RS_SEGMENT_INPUT, RS_SEGMENT_REPLY };
+		for (unsigned int i = 0; i < 4; i++) {
+			size_t length = strlen(names[i]);
+			if (tag.compare(0, length, names[i]) != 0) {
+				continue;
+			}
+			if (tag.length() == length) {
+				kind  = kinds[i];
+				index = 1;
+				return true;
+			}
+			if (tag.length() == length + 1 && tag[length] >= '1' && tag[length] <= '0' + (int)RS_HISTORY) {
+				kind  = kinds[i];
+				index = tag[length] - '0';
+				return true;
+			}
+		}
+		if (tag == "id") {
+			kind  = RS_SEGMENT_ID;
+			index = 0;
+			return true;
+		}
+		return false;
+	};
+
+	const char *formats[] = { "person", "formal", "sentence", "uppercase", "lowercase" };
+	const char *math[] = { "add", "sub", "mult", "div" };
+	unsigned int calls = 0;
+	for (size_t i = 0; i < body.length(); ) {
+		rs_segment_kind kind;
+		unsigned int index;
+
+		if (body[i] == '<') {
+			// A tag inside a tag (or a stray < before one) is left to
+			// _processTags(), which fills in the inner one first.
+			size_t close = body.find_first_of("<>", i + 1);
+			if (close == string::npos) {
+				literal += body[i++];
+				continue;
+			}
+			if (body[close] == '<') {
+				segments.clear();
+				return;
+			}
+
+			string tag = body.substr(i + 1, close - i - 1);
+			i = close + 1;
+			if (tag.length() == 0) {
+				literal += "<>";
+				continue;
+			}
+			if (history(tag, kind, index)) {
+				add(kind, index);
+				continue;
+			}
+			if (tag == "call") {
+				// An object call, its arguments split up front. One whose
+				// name or arguments come out of other tags is left to
+				// _processTags(); so is a reply with more calls than
+				// _renderReply() can mark.
+				size_t end = body.find("</call>", i);
+				if (end == string::npos) {
+					literal += "<call>";
+					continue;
+				}
+				string inner = body.substr(i, end - i);
+				if (inner.find_first_of("<{") != string::npos || ++calls > 255) {
+					segments.clear();
+					return;
+				}
+				vector<string> args = _macroArgs(inner);
+				rs_segment &segment = add(RS_SEGMENT_CALL, 0);
+				for (unsigned int j = 0; j < args.size(); j++) {
+					if (j == 0) {
+						segment.text = args[j];
+					}
+					else {
+						segment.choices.emplace_back(args[j]);
+					}
+				}
+				i = end + 7;
+				continue;
+			}
+
+			vector<string> parts = split(tag, " ", 2);
+			string name = parts[0];
+			for (size_t j = 0; j < name.length(); j++) {
+				name[j] = tolower((unsigned char)name[j]);
+			}
+			if (name == "bot" || name == "env") {
+				if (parts[1].find('=') != string::npos) {
+					segments.clear();
+					return; // _processTags() warns about these.
+				}
+				add(name == "bot" ? RS_SEGMENT_BOT : RS_SEGMENT_ENV, 0).text = parts[1];
+			}
+			else if (name == "get") {
+				add(RS_SEGMENT_GET, 0).text = parts[1];
+			}
+			else if (name == "set") {
+				vector<string> halves = split(parts[1], "=", 2);
+				if (halves[1].find_first_of("{\\") != string::npos) {
+					segments.clear();
+					return;
+				}
+				rs_segment &segment = add(RS_SEGMENT_SET, 0);
+				segment.text  = halves[0];
+				segment.value = halves[1];
+			}
+			else if (name == "add" || name == "sub" || name == "mult" || name == "div") {
+				vector<string> halves = split(parts[1], "=", 2);
+				unsigned int op = 0;
+				while (name != math[op]) {
+					op++;
+				}
+				rs_segment &segment = add(RS_SEGMENT_MATH, op);
+				segment.text  = halves[0];
+				segment.value = halves[1];
+			}
+			else {
+				// Not one of ours; it stays as it is.
+				literal += "<" + tag + ">";
+			}
+			continue;
+		}
+
+		if (body.compare(i, 8, "{random}") == 0) {
+			size_t end = body.find("{/random}", i);
+			if (end != string::npos) {
+				string inner = body.substr(i + 8, end - i - 8);
+				if (inner.find_first_of("<{") != string::npos) {
+					segments.clear();
+					return;
+				}
+				vector<string> choices = split(inner, inner.find('|') != string::npos ? "|" : " ");
+				rs_segment &segment = add(RS_SEGMENT_RANDOM, 0);
+				for (unsigned int j = 0; j < choices.size(); j++) {
+					segment.choices.emplace_back(choices[j]);
+				}
+				i = end + 9;
+				continue;
+			}
+		}
+
+		// {person} and the string formats. Only literal text, stars and
+		// history can go inside one; anything else would be formatted
+		// before it was filled in.
+		bool format = false;
+		for (unsigned int f = 0; f < 5 && body[i] == '{' && !format; f++) {
+			string open = string("{") + formats[f] + "}";
+			string close = string("{/") + formats[f] + "}";
+			size_t end = body.compare(i, open.length(), open) == 0 ? body.find(close, i) : string::npos;
+			if (end == string::npos) {
+				continue;
+			}
+			format = true;
+
+			add(RS_SEGMENT_FORMAT, f);
+			size_t at = segments.size() - 1;
+			for (size_t j = i + open.length(); j < end; j++) {
+				if (body[j] == '{') {
+					segments.clear();
+					return;
+				}
+				if (body[j] != '<') {
+					literal += body[j];
+					continue;
+				}
+				size_t tagEnd = body.find('>', j);
+				if (tagEnd > end || !history(body.substr(j + 1, tagEnd - j - 1), kind, index)) {
+					segments.clear();
+					return;
+				}
+				add(kind, index);
+				j = tagEnd;
+			}
+			flush();
+			segments[at].length = segments.size() - 1 - at;
+			i = end + close.length();
+		}
+		if (format) {
+			continue;
+		}
+
+		literal += body[i];
+		i++;
+	}
+	flush();
+
+	reply.compiled = true;
+	reply.finish = body.find("{topic=") != string::npos || body.find("{@") != string::npos;
+}
+
+string RiveScript::_renderReply (rs_call &call, const rs_reply &reply, const vector<string> &stars, const vector<string> &botstars, int step) {
+	if (!reply.compiled) {
+		return _processTags(call, string(reply.source), stars, botstars, step);
+	}
+
+	// Scratch space of this thread's own, reused from one reply to the next.
+	// Nothing below renders another reply until it's done with them.
+	thread_local vector<const string*> values;
+	thread_local vector<string> formatted;
+	thread_local string key, scratch, out;
+	static const string undefined ("undefined");
+	static const string_view special ("<{\\\0", 4); // What only _processTags() can handle, and our call marker
+
+	// Look up everything that can't change while the reply is filled in. A
+	// value with tags of its own would get those expanded by _processTags(),
+	// so if there's one of those, the reply goes to it instead, while nothing
+	// has been changed yet.
+	const rs_list<rs_segment> &segments = reply.segments;
+	const rs_session &user = call.user;
+	values.assign(segments.size(), NULL);
+	for (size_t i = 0; i < segments.size(); i++) {
+		const rs_segment &segment = segments[i];
+		const string *value = NULL;
+		switch (segment.kind) {
+			case RS_SEGMENT_STAR:
+				value = segment.index <= stars.size() ? &stars[segment.index - 1] : &undefined;
+				break;
+			case RS_SEGMENT_BOTSTAR:
+				value = segment.index <= botstars.size() ? &botstars[segment.index - 1] : &undefined;
+				break;
+			case RS_SEGMENT_INPUT:
+				value = segment.index <= user.input.size() ? &user.input[segment.index - 1] : &undefined;
+				break;
+			case RS_SEGMENT_REPLY:
+				value = segment.index <= user.reply.size() ? &user.reply[segment.index - 1] : &undefined;
+				break;
+			case RS_SEGMENT_ID:
+				value = &call.id;
+				break;
+			case RS_SEGMENT_BOT:
+			case RS_SEGMENT_ENV:
+				value = segment.var == rs_symbols::none ? NULL
+					: segment.kind == RS_SEGMENT_BOT ? call.brain.botVars.find(segment.var) : call.brain.globalVars.find(segment.var);
+				value = value != NULL ? value : &undefined;
+				break;
+			case RS_SEGMENT_GET:
+			case RS_SEGMENT_MATH: {
+				// Only checked: <set> and the math tags can change it.
+				key.assign(segment.text.data(), segment.text.length());
+				map<string, string>::const_iterator it = user.vars.find(key);
+				if (it != user.vars.end() && it->second.find_first_of(special) != string::npos) {
+					return _processTags(call, string(reply.source), stars, botstars, step);
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		if (value != NULL && value->find_first_of(special) != string::npos) {
+			return _processTags(call, string(reply.source), stars, botstars, step);
+		}
+		values[i] = value;
+	}
+
+	// The formats only wrap what was just looked up.
+	const char *formats[] = { "person", "formal", "sentence", "uppercase", "lowercase" };
+	unsigned int format = 0;
+	for (size_t i = 0; i < segments.size(); i++) {
+		if (segments[i].kind != RS_SEGMENT_FORMAT) {
+			continue;
+		}
+		scratch.clear();
+		for (size_t j = i + 1; j <= i + segments[i].length; j++) {
+			if (values[j] != NULL) {
+				scratch += *values[j];
+			}
+			else {
+				scratch += segments[j].text;
+			}
+		}
+		if (format == formatted.size()) {
+			formatted.emplace_back();
+		}
+		string &output = formatted[format++];
+		output = segments[i].index == 0 ? _substitute(call.brain, scratch, true) : _stringFormat(formats[segments[i].index], scratch);
+		if (output.find_first_of(special) != string::npos) {
+			return _processTags(call, string(reply.source), stars, botstars, step);
+		}
+		i += segments[i].length;
+	}
+
+	// Now fill it in, in one pass. Object calls go last, after {topic} and
+	// {@}, so for now each one only leaves a marker: a NUL and its number.
+	const char *math[] = { "add", "sub", "mult", "div" };
+	vector<const rs_segment*> calls;
+	out.clear();
+	format = 0;
+	for (size_t i = 0; i < segments.size(); i++) {
+		const rs_segment &segment = segments[i];
+		switch (segment.kind) {
+			case RS_SEGMENT_TEXT:
+				out += segment.text;
+				break;
+			case RS_SEGMENT_GET: {
+				key.assign(segment.text.data(), segment.text.length());
+				map<string, string>::const_iterator it = user.vars.find(key);
+				out += it != user.vars.end() ? it->second : undefined;
+				break;
+			}
+			case RS_SEGMENT_SET:
+				key.assign(segment.text.data(), segment.text.length());
+				call.user.vars[key] = segment.value;
+				break;
+			case RS_SEGMENT_MATH:
+				out += _mathTag(call.user, math[segment.index], string(segment.text), string(segment.value));
+				break;
+			case RS_SEGMENT_RANDOM:
+				out += segment.choices[rs_random(segment.choices.size())];
+				break;
+			case RS_SEGMENT_FORMAT:
+				out += formatted[format++];
+				i += segment.length;
+				break;
+			case RS_SEGMENT_CALL:
+				out += '\0';
+				out += (char)calls.size();
+				calls.push_back(&segment);
+				break;
+			default:
+				out += *values[i];
+				break;
+		}
+	}
+
+	string result (out);
+	if (reply.finish) {
+		_finishTags(call, result, step, false);
+	}
+	if (calls.empty()) {
+		return result;
+	}
+
+	// Run the calls, in order, through the slots they were bound to. One
+	// whose marker went into an inline redirect isn't run at all.
+	string spliced;
+	size_t from = 0;
+	for (size_t pos = result.find('\0'); pos != string::npos && pos + 1 < result.length(); pos = result.find('\0', from)) {
+		unsigned int index = (unsigned char)result[pos + 1];
+		spliced.append(result, from, pos - from);
+		from = pos + 2;
+		if (index >= calls.size()) {
+			continue;
+		}
+		const rs_segment &segment = *calls[index];
+		if (segment.text.length() == 0) {
+			spliced += RS_ERR_OBJECT;
+			continue;
+		}
+		vector<string> args (segment.choices.begin(), segment.choices.end());
+		string name (segment.text);
+		spliced += segment.macro != NULL ? _runMacro(call, segment.macro, name, args) : _callMacro(call, name, args);
+	}
+	spliced.append(result, from, string::npos);
+	return spliced;
+}
+
+string RiveScript::_processTags (rs_call &call, const string &text, const vector<string> &stars, const vector<string> &botstars, int step) {
+	string reply = text;
+	rs_session &user = call.user;
+
+	// Tag shortcuts.
+	rs_replace(reply, "<person>", "{person}<star>{/person}");
+	rs_replace(reply, "<@>", "{@<star>}");
+	rs_replace(reply, "<formal>", "{formal}<star>{/formal}");
+	rs_replace(reply, "<sentence>", "{sentence}<star>{/sentence}");
+	rs_replace(reply, "<uppercase>", "{uppercase}<star>{/uppercase}");
+	rs_replace(reply, "<lowercase>", "{lowercase}<star>{/lowercase}");
+
+	// Leftover {weight}s.
+	size_t pos;
+	while ((pos = reply.find("{weight=")) != string::npos) {
+		size_t end = reply.find('}', pos);
+		if (end == string::npos) {
+			break;
+		}
+		reply.erase(pos, end - pos + 1);
+	}
+
+	// Stars and history.
+	rs_replace(reply, "<star>", _history(stars, 1));
+	rs_replace(reply, "<botstar>", _history(botstars, 1));
+	rs_replace(reply, "<input>", _history(user.input, 1));
+	rs_replace(reply, "<reply>", _history(user.reply, 1));
+	for (unsigned int i = 1; i <= RS_HISTORY; i++) {
+		string n = std::to_string(i);
+		rs_replace(reply, "<star" + n + ">", _history(stars, i));
+		rs_replace(reply, "<botstar" + n + ">", _history(botstars, i));
+		rs_replace(reply, "<input" + n + ">", _history(user.input, i));
+		rs_replace(reply, "<reply" + n + ">", _history(user.reply, i));
+	}
+
+	// <id> and escape codes.
+	rs_replace(reply, "<id>", call.id);
+	rs_replace(reply, "\\s", " ");
+	rs_replace(reply, "\\n", "\n");
+	rs_replace(reply, "\\#", "#");
+
+	// Random bits.
+	pos = 0;
+	while ((pos = reply.find("{random}", pos)) != string::npos) {
+		size_t end = reply.find("{/random}", pos);
+		if (end == string::npos) {
+			break;
+		}
+		string inner = reply.substr(pos + 8, end - pos - 8);
+		vector<string> choices = split(inner, inner.find('|') != string::npos ? "|" : " ");
+		string output = choices.size() > 0 ? choices[rs_random(choices.size())] : "";
+		reply.replace(pos, end - pos + 9, output);
+		pos += output.length();
+	}
+
+	// Person substitutions and string formatting.
+	const char *formats[] = { "person", "formal", "sentence", "uppercase", "lowercase" };
+	for (unsigned int f = 0; f < 5; f++) {
+		string open = string("{") + formats[f] + "}";
+		string close = string("{/") + formats[f] + "}";
+		pos = 0;
+		while ((pos = reply.find(open, pos)) != string::npos) {
+			size_t end = reply.find(close, pos);
+			if (end == string::npos) {
+				break;
+			}
+			string inner = reply.substr(pos + open.length(), end - pos - open.length());
+			string output = f == 0 ? _substitute(call.brain, inner, true) : _stringFormat(formats[f], inner);
+			reply.replace(pos, end - pos + close.length(), output);
+			pos += output.length();
+		}
+	}
+
+	// Variable tags. The innermost tag goes first, so that they can nest (as
+	// in <set a=<get b>>). <call> tags are handled afterwards.
+	rs_replace(reply, "<call>", "{__call__}");
+	rs_replace(reply, "</call>", "{/__call__}");
+	while (true) {
+		// Find a <tag> with no other tag inside of it.
+		size_t open = string::npos, close = string::npos;
+		for (size_t i = reply.find('<'); i != string::npos; i = reply.find('<', i + 1)) {
+			size_t end = reply.find_first_of("<>", i + 1);
+			if (end != string::npos && reply[end] == '>' && end > i + 1) {
+				open = i;
+				close = end;
+				break;
+			}
+		}
+		if (open == string::npos) {
+			break;
+		}
+
+		string match = reply.substr(open + 1, close - open - 1);
+		vector<string> parts = split(match, " ", 2);
+		string tag = parts[0];
+		string data = parts[1];
+		for (size_t i = 0; i < tag.length(); i++) {
+			tag[i] = tolower((unsigned char)tag[i]);
+		}
+
+		string insert;
+		if (tag == "bot" || tag == "env") {
+			if (data.find('=') != string::npos) {
+				// The brain is read-only while replying.
+				RS_WARN("reply", "Can't set " + tag + " variables from a reply: <" + match + ">");
+			}
+			else {
+				const string *value = tag == "bot" ? _botVar(call.brain, data) : _globalVar(call.brain, data);
+				insert = value != NULL ? *value : "undefined";
+			}
+		}
+		else if (tag == "set") {
+			vector<string> halves = split(data, "=", 2);
+			user.vars[halves[0]] = halves[1];
+		}
+		else if (tag == "add" || tag == "sub" || tag == "mult" || tag == "div") {
+			vector<string> halves = split(data, "=", 2);
+			insert = _mathTag(user, tag, halves[0], halves[1]);
+		}
+		else if (tag == "get") {
+			insert = _uservar(user, data);
+		}
+		else {
+			// Not one of ours; put it back when we're done.
+			insert = string(1, '\x00') + match + '\x01';
+		}
+		reply.replace(open, close - open + 1, insert);
+	}
+	for (size_t i = 0; i < reply.length(); i++) {
+		if (reply[i] == '\x00') {
+			reply[i] = '<';
+		}
+		else if (reply[i] == '\x01') {
+			reply[i] = '>';
+		}
+	}
+
+	_finishTags(call, reply, step, true);
+	return reply;
+}
+
+string RiveScript::_mathTag (rs_session &user, const string &tag, const string &name, const string &value) {
+	// <add>, <sub>, <mult> or <div>. Returns what goes in the tag's place,
+	// which is nothing unless it's an error.
+	string current = _uservar(user, name);
+	long number, orig;
+	if (current == "undefined") {
+		current = "0";
+	}
+	if (!rs_integer(value, number)) {
+		return "[ERR: Math can't '" + tag + "' non-numeric value '" + value + "']";
+	}
+	if (!rs_integer(current, orig)) {
+		return "[ERR: Math couldn't '" + tag + "' to value '" + current + "']";
+	}
+	if (tag == "div" && number == 0) {
+		return "[ERR: Can't Divide By Zero]";
+	}
+	long result = tag == "add" ? orig + number : tag == "sub" ? orig - number : tag == "mult" ? orig * number : orig / number;
+	user.vars[name] = std::to_string(result);
+	return "";
+}
+
+void RiveScript::_finishTags (rs_call &call, string &reply, int step, bool calls) {
+	// The tags that act on the reply as a whole once everything else is
+	// filled in: {topic}, then inline redirects, then object calls (unless
+	// the caller has its own, already bound).
+	rs_session &user = call.user;
+	size_t pos;
+
+	// Topic setter.
+	while ((pos = reply.find("{topic=")) != string::npos) {
+		size_t end = reply.find('}', pos);
+		if (end == string::npos) {
+			break;
+		}
+		user.vars["topic"] = reply.substr(pos + 7, end - pos - 7);
+		reply.erase(pos, end - pos + 1);
+	}
+
+	// Inline redirects.
+	pos = 0;
+	while ((pos = reply.find("{@", pos)) != string::npos) {
+		size_t end = reply.find('}', pos);
+		if (end == string::npos) {
+			break;
+		}
+		string at = trim(reply.substr(pos + 2, end - pos - 2));
+		for (size_t i = 0; i < at.length(); i++) {
+			at[i] = tolower((unsigned char)at[i]);
+		}
+		string output = _getReply(call, at, false, step + 1);
+		reply.replace(pos, end - pos + 1, output);
+		pos += output.length();
+	}
+
+	if (!calls) {
+		return;
+	}
+
+	// Object calls: the macro's name and then its arguments.
+	rs_replace(reply, "{__call__}", "<call>");
+	rs_replace(reply, "{/__call__}", "</call>");
+	pos = 0;
+	while ((pos = reply.find("<call>", pos)) != string::npos) {
+		size_t end = reply.find("</call>", pos);
+		if (end == string::npos) {
+			break;
+		}
+		vector<string> args = _macroArgs(reply.substr(pos + 6, end - pos - 6));
+		string output = RS_ERR_OBJECT;
+		if (args.size() > 0) {
+			string name = args[0];
+			args.erase(args.begin());
+			output = _callMacro(call, name, args);
+		}
+		reply.replace(pos, end - pos + 7, output);
+		pos += output.length();
+	}
+}
+
+string RiveScript::_callMacro (rs_call &call, const string &name, const vector<string> &args) {
+	// Compiled calls are bound to their slots when the replies are sorted;
+	// this is for the rest. A name that's used anywhere was interned then
+	// too, so only one that came out of another tag goes to the registry.
+	uint32_t id = call.brain.macroNames.find(name);
+	rs_macro_slot *slot = id != rs_symbols::none ? call.brain.macroSlots[id] : this->macros.find(name);
+	return _runMacro(call, slot, name, args);
+}
+
+string RiveScript::_runMacro (rs_call &call, rs_macro_slot *slot, const string &name, const vector<string> &args) {
+	std::shared_ptr<const rs_macro> macro;
+	if (slot != NULL) {
+		macro = slot->get();
+	}
+	if (!macro) {
+		RS_WARN("reply", "Object " + name + " not found");
+		return RS_ERR_OBJECT;
+	}
+	if (!macro->async) {
+		return macro->run(*this, call.id, args);
+	}
+
+	// A slow one runs on the executor, and we only wait so long for it. If
+	// it's given up on, it still finishes, but nobody sees the result.
+	string user = call.id;
+	std::shared_ptr<std::packaged_task<string()> > task (new std::packaged_task<string()>(
+		[this, macro, user, args] () {
+			return macro->run(*this, user, args);
+		}));
+	std::future<string> result = task->get_future();
+	if (!this->executor.submit([task] () { (*task)(); })) {
+		RS_WARN("reply", "Object " + name + " turned away: too many slow macros waiting");
+		return RS_ERR_BUSY;
+	}
+	if (result.wait_for(std::chrono::milliseconds(macro->timeoutMs)) != std::future_status::ready) {
+		RS_WARN("reply", "Object " + name + " took longer than " + std::to_string(macro->timeoutMs) + " ms");
+		return RS_ERR_SLOW;
+	}
+	return result.get();
+}
+
+vector<string> RiveScript::_macroArgs (const string &text) {
+	// Split on spaces, except inside "double quotes".
+	vector<string> args;
+	string arg;
+	bool quoted = false;
+	bool any = false;
+	for (size_t i = 0; i < text.length(); i++) {
+		char c = text[i];
+		if (c == '"') {
+			quoted = !quoted;
+			any = true;
+		}
+		else if (isspace((unsigned char)c) && !quoted) {
+			if (any) {
+				args.push_back(arg);
+			}
+			arg.clear();
+			any = false;
+		}
+		else {
+			arg += c;
+			any = true;
+		}
+	}
+	if (any) {
+		args.push_back(arg);
+	}
+	return args;
+}
+
+string RiveScript::_stringFormat (const string &format, const string &text) {
+	string out (text);
+	if (format == "uppercase") {
+		for (size_t i = 0; i < out.length(); i++) {
+			out[i] = toupper((unsigned char)out[i]);
+		}
+	}
+	else if (format == "lowercase" || format == "sentence") {
+		// Sentence case: the first letter capitalized, the rest lowercase.
+		for (size_t i = 0; i < out.length(); i++) {
+			out[i] = tolower((unsigned char)out[i]);
+		}
+		if (format == "sentence" && out.length() > 0) {
+			out[0] = toupper((unsigned char)out[0]);
+		}
+	}
+	else if (format == "formal") {
+		// Every word capitalized, separated by single spaces.
+		out.clear();
+		bool start = true;
+		for (size_t i = 0; i < text.length(); i++) {
+			unsigned char c = text[i];
+			if (isspace(c)) {
+				start = true;
+				continue;
+			}
+			if (start && out.length() > 0) {
+				out += ' ';
+			}
+			out += start ? toupper(c) : tolower(c);
+			start = false;
+		}
+	}
+	return out;
+}
+
+string RiveScript::_history (const vector<string> &history, unsigned int index) {
+	// Numbered from 1, most recent first.
+	return index >= 1 && index <= history.size() ? history[index - 1] : "undefined";
+}
+
+string RiveScript::_history (const rs_ring<9> &history, unsigned int index) {
+	return index >= 1 && index <= history.size() ? history[index - 1] : "undefined";
+}
+
+string RiveScript::_uservar (const rs_session &user, const string &name) {
+	map<string, string>::const_iterator it = user.vars.find(name);
+	return it != user.vars.end() ? it->second : "undefined";
+}
+
+/******************************************************************************
+ * Object Macro Methods                                                       *
+ ******************************************************************************/
+
+void RiveScript::setSubroutine (const string &name, rs_subroutine subroutine) {
+	std::shared_ptr<rs_macro> macro;
+	if (subroutine) {
+		macro.reset(new rs_macro());
+		macro->run       = subroutine;
+		macro->async     = false;
+		macro->timeoutMs = 0;
+	}
+	this->macros.slot(name)->set(macro);
+}
+
+void RiveScript::setAsyncSubroutine (const string &name, rs_subroutine subroutine, unsigned int timeoutMs) {
+	std::shared_ptr<rs_macro> macro;
+	if (subroutine) {
+		macro.reset(new rs_macro());
+		macro->run       = subroutine;
+		macro->async     = true;
+		macro->timeoutMs = timeoutMs;
+	}
+	this->macros.slot(name)->set(macro);
+}
+
+void RiveScript::setHandler (const string &lang, rs_handler handler) {
+	this->macros.setHandler(lang, handler);
+
+	// Build the objects in that language that are already loaded.
+	rs_rcu<rs_brain>::reader brain (this->live);
+	_buildObjects(*brain);
+}
+
+rs_executor &RiveScript::macroExecutor () {
+	return this->executor;
+}
+
+void RiveScript::_buildObjects (const rs_brain &brain) {
+	// Turn the object code into macros, for the languages there's a handler
+	// for. A subroutine that was set from C++ takes precedence, and code
+	// that hasn't changed isn't built again.
+	for (map<string, rs_object>::const_iterator it = brain.objects.begin(); it != brain.objects.end(); ++it) {
+		rs_handler handler = this->macros.handler(it->second.lang);
+		if (!handler) {
+			RS_SAY("sort", "No handler for object " + it->first + " in language " + it->second.lang);
+			continue;
+		}
+
+		rs_macro_slot *slot = this->macros.slot(it->first);
+		std::shared_ptr<const rs_macro> current = slot->get();
+		if (current && (current->source.length() == 0 || current->source == it->second.code)) {
+			continue;
+		}
+
+		rs_subroutine subroutine = handler(it->first, it->second.code);
+		if (!subroutine) {
+			RS_WARN("sort", "Couldn't load object " + it->first + " in language " + it->second.lang);
+			continue;
+		}
+		std::shared_ptr<rs_macro> macro (new rs_macro());
+		macro->run       = subroutine;
+		macro->async     = false;
+		macro->timeoutMs = 0;
+		macro->source    = it->second.code;
+		slot->set(macro);
+	}
+}
+
+void RiveScript::_bindMacros (rs_brain &brain) {
+	_buildObjects(brain);
+
+	// Bind every macro name that's defined or called (by name, not through
+	// another tag) to its slot, and every compiled <call> to its macro's.
+	brain.macroNames.clear();
+	brain.macroSlots.clear();
+	vector<string_view> names;
+	for (map<string, rs_object>::const_iterator it = brain.objects.begin(); it != brain.objects.end(); ++it) {
+		names.push_back(it->first);
+	}
+
+	vector<rs_dict<rs_trigger>*> lists;
+	for (rs_dict<rs_topic>::iterator it = brain.topics.begin(); it != brain.topics.end(); ++it) {
+		lists.push_back(&it->second.trigger);
+	}
+	for (rs_dict<rs_that_topic>::iterator it = brain.thats.begin(); it != brain.thats.end(); ++it) {
+		for (rs_dict<rs_that>::iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+			lists.push_back(&that->second.trigger);
+		}
+	}
+	vector<rs_segment*> sites;
+	for (unsigned int l = 0; l < lists.size(); l++) {
+		for (rs_dict<rs_trigger>::iterator trig = lists[l]->begin(); trig != lists[l]->end(); ++trig) {
+			// Compiled replies have their calls as segments; the rest (and
+			// the conditions, whose operands can have calls) are searched.
+			vector<rs_reply*> replies;
+			vector<string_view> texts;
+			for (unsigned int i = 0; i < trig->second.reply.size(); i++) {
+				replies.push_back(&trig->second.reply[i]);
+			}
+			for (unsigned int i = 0; i < trig->second.condition.size(); i++) {
+				replies.push_back(&trig->second.condition[i].reply);
+				texts.push_back(trig->second.condition[i].source);
+			}
+			for (unsigned int i = 0; i < replies.size(); i++) {
+				if (!replies[i]->compiled) {
+					texts.push_back(replies[i]->source);
+					continue;
+				}
+				for (unsigned int j = 0; j < replies[i]->segments.size(); j++) {
+					rs_segment &segment = replies[i]->segments[j];
+					segment.macro = NULL;
+					if (segment.kind == RS_SEGMENT_CALL && segment.text.length() > 0) {
+						names.push_back(segment.text);
+						sites.push_back(&segment);
+					}
+				}
+			}
+
+			for (unsigned int i = 0; i < texts.size(); i++) {
+				string_view text = texts[i];
+				for (size_t pos = text.find("<call>"); pos != string_view::npos; pos = text.find("<call>", pos)) {
+					pos += 6;
+					while (pos < text.length() && isspace((unsigned char)text[pos])) {
+						pos++;
+					}
+					size_t end = pos;
+					while (end < text.length() && !isspace((unsigned char)text[end]) && text[end] != '<' && text[end] != '{') {
+						end++;
+					}
+					bool literal = end == text.length() || isspace((unsigned char)text[end]) || text.compare(end, 7, "</call>") == 0;
+					if (end > pos && literal) {
+						names.push_back(text.substr(pos, end - pos));
+					}
+				}
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < names.size(); i++) {
+		if (brain.macroNames.intern(names[i]) == brain.macroSlots.size()) {
+			brain.macroSlots.push_back(this->macros.slot(names[i]));
+		}
+	}
+	for (unsigned int i = 0; i < sites.size(); i++) {
+		sites[i]->macro = brain.macroSlots[brain.macroNames.find(sites[i]->text)];
+	}
+}
+
+/******************************************************************************
+ * Substitution Methods                                                       *
+ ******************************************************************************/
+
+void RiveScript::_compileSubs (rs_brain &brain) {
+	brain.subst.build(brain.subs);
+	brain.personSubst.build(brain.person);
+}
+
+string RiveScript::_substitute (const rs_brain &brain, string_view message, bool person) {
+	string result;
+	(person ? brain.personSubst : brain.subst).apply(message, result);
+	return result;
+}
+
+/******************************************************************************
+ * Sorting and Indexing Methods                                               *
+ ******************************************************************************/
+
+// Trigger categories, in the order they get matched.
+enum {
+	RS_SORT_ATOMIC = 0, // No wildcards at all
+	RS_SORT_OPTION,     // Has [optionals]
+	RS_SORT_ALPHA,      // Has _ wildcards
+	RS_SORT_NUMBER,     // Has # wildcards
+	RS_SORT_WILD,       // Has * wildcards
+	RS_SORT_UNDER,      // Only _ wildcards and no words
+	RS_SORT_POUND,      // Only # wildcards and no words
+	RS_SORT_STAR        // Only * wildcards and no words
+};
+
+// Precedence order for sorted triggers; the keys were computed by _sortKeys().
+bool RiveScript::_sortBefore (const rs_brain &brain, const rs_sorted &a, const rs_sorted &b) {
+	if (a.weight != b.weight) {
+		return a.weight > b.weight;
+	}
+	if (a.inherits != b.inherits) {
+		return a.inherits < b.inherits;
+	}
+	if (a.category != b.category) {
+		return a.category < b.category;
+	}
+	if (a.words != b.words) {
+		return a.words > b.words;
+	}
+	if (a.length != b.length) {
+		return a.length > b.length;
+	}
+	if (a.trigger != b.trigger) {
+		return brain.texts.name(a.trigger) < brain.texts.name(b.trigger);
+	}
+	if (a.that == rs_symbols::none || b.that == rs_symbols::none) {
+		return a.that == rs_symbols::none && b.that != rs_symbols::none;
+	}
+	return brain.texts.name(a.that) < brain.texts.name(b.that);
+}
+
+void RiveScript::sortReplies () {
+	sortReplies(rs_pool::defaultSize());
+}
+
+void RiveScript::sortReplies (unsigned int threads) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	RS_SAY("sort", "Sorting triggers.");
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "sort", "sortReplies");
+
+	// Finish off anything that was being streamed in.
+	endStream();
+	rs_brain &brain = _stage();
+
+	// Intern the names first; the sorting tasks only look them up. Arrays
+	// that haven't changed keep the live brain's compiled copy.
+	{
+		rs_rcu<rs_brain>::reader live (this->live);
+		_compileTables(brain, live.get());
+	}
+
+	// Topics don't depend on one another, so sort them all in parallel. Each
+	// task only reads the brain and writes its own slot.
+	vector<rs_sorted_topic> results (brain.topicNames.size());
+	{
+		rs_pool pool (std::min<size_t>(threads, std::max<size_t>(results.size(), 1)));
+		for (uint32_t i = 0; i < results.size(); i++) {
+			pool.submit([this, &brain, &results, i] () {
+				_sortTopic(brain, i, results[i]);
+			});
+		}
+		pool.wait();
+	}
+
+	_compileSubs(brain);
+	_bindMacros(brain);
+
+	brain.sorted.swap(results);
+	for (uint32_t i = 0; i < brain.sorted.size(); i++) {
+		RS_SAY("sort", "Sorted " + std::to_string(brain.sorted[i].trigger.size()) + " triggers and "
+			+ std::to_string(brain.sorted[i].that.size()) + " %Previous triggers in topic " + brain.topicNames.name(i));
+	}
+
+	// Publish the new brain. Replies already under way finish on the old one.
+	this->live.publish(this->staging.release());
+}
+
+void RiveScript::_compileTables (rs_brain &brain, const rs_brain *previous) {
+	// (Re)build the symbol tables and the flat lookup tables from the
+	// brain's maps.
+	brain.topicNames.clear();
+	brain.texts.clear();
+	brain.words.clear();
+	_internTopics(brain);
+	_compileVariables(brain, previous);
+}
+
+void RiveScript::_internTopics (rs_brain &brain) {
+	// Intern every topic name and trigger text. Names that are already in
+	// the tables keep their IDs.
+	const rs_dict<rs_topic> &topics = brain.topics;
+	const rs_dict<rs_that_topic> &thats = brain.thats;
+	for (rs_dict<rs_topic>::const_iterator it = topics.begin(); it != topics.end(); ++it) {
+		brain.topicNames.intern(it->first);
+		for (unsigned int i = 0; i < it->second.includes.size(); i++) {
+			brain.topicNames.intern(it->second.includes[i]);
+		}
+		for (unsigned int i = 0; i < it->second.inherits.size(); i++) {
+			brain.topicNames.intern(it->second.inherits[i]);
+		}
+		for (rs_dict<rs_trigger>::const_iterator trig = it->second.trigger.begin(); trig != it->second.trigger.end(); ++trig) {
+			brain.texts.intern(trig->first);
+		}
+	}
+	for (rs_dict<rs_that_topic>::const_iterator it = thats.begin(); it != thats.end(); ++it) {
+		brain.topicNames.intern(it->first);
+		for (rs_dict<rs_that>::const_iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+			brain.texts.intern(that->first);
+			for (rs_dict<rs_trigger>::const_iterator trig = that->second.trigger.begin(); trig != that->second.trigger.end(); ++trig) {
+				brain.texts.intern(trig->first);
+			}
+		}
+	}
+
+}
+
+void RiveScript::_compileVariables (rs_brain &brain, const rs_brain *previous) {
+	brain.varNames.clear();
+	brain.arrayNames.clear();
+	brain.globalVars.clear();
+	brain.botVars.clear();
+	brain.arrayTries.clear();
+
+	for (map<string, string>::const_iterator it = brain.globals.begin(); it != brain.globals.end(); ++it) {
+		brain.globalVars[brain.varNames.intern(it->first)] = it->second;
+	}
+	for (map<string, string>::const_iterator it = brain.bot.begin(); it != brain.bot.end(); ++it) {
+		brain.botVars[brain.varNames.intern(it->first)] = it->second;
+	}
+	for (map<string, vector<string> >::const_iterator it = brain.arrays.begin(); it != brain.arrays.end(); ++it) {
+		brain.arrayNames.intern(it->first);
+
+		// Each array is compiled once, however many triggers use it, and
+		// carried over to later brains for as long as it stays the same.
+		if (previous != NULL) {
+			map<string, vector<string> >::const_iterator old = previous->arrays.find(it->first);
+			uint32_t id = previous->arrayNames.find(it->first);
+			if (old != previous->arrays.end() && old->second == it->second && id < previous->arrayTries.size()) {
+				brain.arrayTries.push_back(previous->arrayTries[id]);
+				continue;
+			}
+		}
+		// Folded like the messages they'll be matched against.
+		vector<string> items (it->second.size());
+		for (unsigned int i = 0; i < items.size(); i++) {
+			rs_casefold(it->second[i], items[i]);
+		}
+		std::shared_ptr<rs_trie> trie (new rs_trie());
+		trie->build(items);
+		brain.arrayTries.push_back(trie);
+	}
+
+	_bindReplies(brain);
+}
+
+void RiveScript::_bindReplies (rs_brain &brain) {
+	// Build every trigger's alias table, and point the <bot> and <env> tags in
+	// every reply at their variables' IDs.
+	vector<rs_dict<rs_trigger>*> lists;
+	for (rs_dict<rs_topic>::iterator it = brain.topics.begin(); it != brain.topics.end(); ++it) {
+		lists.push_back(&it->second.trigger);
+	}
+	for (rs_dict<rs_that_topic>::iterator it = brain.thats.begin(); it != brain.thats.end(); ++it) {
+		for (rs_dict<rs_that>::iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+			lists.push_back(&that->second.trigger);
+		}
+	}
+
+	vector<rs_reply*> replies;
+	for (unsigned int l = 0; l < lists.size(); l++) {
+		for (rs_dict<rs_trigger>::iterator trig = lists[l]->begin(); trig != lists[l]->end(); ++trig) {
+			_buildAlias(trig->second);
+			for (unsigned int i = 0; i < trig->second.reply.size(); i++) {
+				replies.push_back(&trig->second.reply[i]);
+			}
+			for (unsigned int i = 0; i < trig->second.condition.size(); i++) {
+				replies.push_back(&trig->second.condition[i].reply);
+			}
+		}
+	}
+	for (unsigned int r = 0; r < replies.size(); r++) {
+		rs_list<rs_segment> &segments = replies[r]->segments;
+		for (unsigned int i = 0; i < segments.size(); i++) {
+			if (segments[i].kind == RS_SEGMENT_BOT || segments[i].kind == RS_SEGMENT_ENV) {
+				segments[i].var = brain.varNames.find(segments[i].text);
+			}
+		}
+	}
+}
+
+void RiveScript::_sortTouched (rs_brain &brain, const vector<string> &touched, unsigned int threads) {
+	// Sort only the topics whose triggers changed, after reloadFile(), and
+	// publish the result. The rest of the sorted buffers are carried over
+	// from the live brain.
+	RS_SAY("sort", "Sorting triggers in " + std::to_string(touched.size()) + " changed topics.");
+	RS_TRACE_SCOPE(this->trace, RS_TRACE_INFO, "sort", "sortTouched");
+
+	vector<rs_sorted_topic> results;
+	vector<char> dirty;
+	{
+		rs_rcu<rs_brain>::reader live (this->live);
+
+		// Keep the live brain's IDs, which its sorted buffers refer to. New
+		// names go on the end.
+		brain.topicNames.assign(live->topicNames);
+		brain.texts.assign(live->texts);
+		brain.words.assign(live->words);
+		_internTopics(brain);
+		_compileVariables(brain, live.get());
+
+		// A topic has to be sorted again if it was touched, if it's new, or
+		// if it includes or inherits (at any distance) one that has to be.
+		results.resize(brain.topicNames.size());
+		dirty.assign(results.size(), 0);
+		for (unsigned int i = 0; i < touched.size(); i++) {
+			uint32_t id = brain.topicNames.find(touched[i]);
+			if (id != rs_symbols::none) {
+				dirty[id] = 1;
+			}
+		}
+		for (uint32_t id = live->sorted.size(); id < dirty.size(); id++) {
+			dirty[id] = 1;
+		}
+		for (bool changed = true; changed; ) {
+			changed = false;
+			for (rs_dict<rs_topic>::const_iterator it = brain.topics.begin(); it != brain.topics.end(); ++it) {
+				uint32_t id = brain.topicNames.find(it->first);
+				const rs_list<rs_text> *lists[] = { &it->second.includes, &it->second.inherits };
+				for (unsigned int l = 0; l < 2 && !dirty[id]; l++) {
+					for (unsigned int i = 0; i < lists[l]->size(); i++) {
+						if (dirty[brain.topicNames.find((*lists[l])[i])]) {
+							dirty[id] = 1;
+							changed = true;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		// The rest are the same as before, but have to point at this
+		// generation's copy of their triggers.
+		for (uint32_t id = 0; id < live->sorted.size(); id++) {
+			if (dirty[id]) {
+				continue;
+			}
+			results[id] = live->sorted[id];
+			vector<rs_sorted> *lists[] = { &results[id].trigger, &results[id].that };
+			for (unsigned int l = 0; l < 2 && !dirty[id]; l++) {
+				for (unsigned int i = 0; i < lists[l]->size(); i++) {
+					if (!_rebind(brain, (*lists[l])[i])) {
+						dirty[id] = 1;
+						results[id] = rs_sorted_topic();
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	{
+		rs_pool pool (std::min<size_t>(threads, std::max<size_t>(results.size(), 1)));
+		for (uint32_t i = 0; i < results.size(); i++) {
+			if (dirty[i]) {
+				pool.submit([this, &brain, &results, i] () {
+					_sortTopic(brain, i, results[i]);
+				});
+			}
+		}
+		pool.wait();
+	}
+
+	_compileSubs(brain);
+	_bindMacros(brain);
+
+	brain.sorted.swap(results);
+	for (uint32_t i = 0; i < brain.sorted.size(); i++) {
+		if (dirty[i]) {
+			RS_SAY("sort", "Sorted " + std::to_string(brain.sorted[i].trigger.size()) + " triggers and "
+				+ std::to_string(brain.sorted[i].that.size()) + " %Previous triggers in topic " + brain.topicNames.name(i));
+		}
+	}
+
+	this->live.publish(this->staging.release());
+}
+
+bool RiveScript::_rebind (const rs_brain &brain, rs_sorted &entry) {
+	// Point a sorted entry at its trigger in this brain. False if it isn't
+	// there any more.
+	string_view topic = brain.topicNames.name(entry.topic);
+	const rs_dict<rs_trigger> *triggers = NULL;
+	if (entry.that == rs_symbols::none) {
+		rs_dict<rs_topic>::const_iterator it = brain.topics.find(topic);
+		if (it != brain.topics.end()) {
+			triggers = &it->second.trigger;
+		}
+	}
+	else {
+		rs_dict<rs_that_topic>::const_iterator it = brain.thats.find(topic);
+		if (it != brain.thats.end()) {
+			rs_dict<rs_that>::const_iterator that = it->second.that.find(string_view(brain.texts.name(entry.that)));
+			if (that != it->second.that.end()) {
+				triggers = &that->second.trigger;
+			}
+		}
+	}
+	if (triggers == NULL) {
+		return false;
+	}
+
+	rs_dict<rs_trigger>::const_iterator trigger = triggers->find(string_view(brain.texts.name(entry.trigger)));
+	if (trigger == triggers->end()) {
+		return false;
+	}
+	entry.data = &trigger->second;
+	return true;
+}
+
+const RiveScript::rs_sorted_topic *RiveScript::_sortedTopic (const rs_brain &brain, string_view name) {
+	uint32_t id = brain.topicNames.find(name);
+	return id < brain.sorted.size() ? &brain.sorted[id] : NULL;
+}
+
+const string *RiveScript::_botVar (const rs_brain &brain, string_view name) {
+	uint32_t id = brain.varNames.find(name);
+	return id == rs_symbols::none ? NULL : brain.botVars.find(id);
+}
+
+const string *RiveScript::_globalVar (const rs_brain &brain, string_view name) {
+	uint32_t id = brain.varNames.find(name);
+	return id == rs_symbols::none ? NULL : brain.globalVars.find(id);
+}
+
+const rs_trie *RiveScript::_array (const rs_brain &brain, string_view name) {
+	uint32_t id = brain.arrayNames.find(name);
+	return id < brain.arrayTries.size() ? brain.arrayTries[id].get() : NULL;
+}
+
+void RiveScript::_sortTopic (rs_brain &brain, uint32_t topic, rs_sorted_topic &out) {
+	vector<uint32_t> seen;
+	_topicTriggers(brain, topic, 0, out.trigger, out.that, seen);
+
+	std::function<bool(const rs_sorted&, const rs_sorted&)> before = [this, &brain] (const rs_sorted &a, const rs_sorted &b) {
+		return _sortBefore(brain, a, b);
+	};
+	std::sort(out.trigger.begin(), out.trigger.end(), before);
+	std::sort(out.that.begin(), out.that.end(), before);
+
+	_buildIndex(brain, out);
+	_compileTopic(brain, out);
+}
+
+void RiveScript::_compileTopic (const rs_brain &brain, rs_sorted_topic &topic) {
+	// Resolve every trigger (and %Previous) to a compiled regex up front, so
+	// matching never has to build one. Triggers that depend on the user's
+	// variables or history can't be compiled until we know who's asking.
+	vector<rs_sorted> *lists[] = { &topic.trigger, &topic.that };
+	for (unsigned int l = 0; l < 2; l++) {
+		for (unsigned int i = 0; i < lists[l]->size(); i++) {
+			rs_sorted &entry = (*lists[l])[i];
+
+			bool dynamic;
+			string pattern = _triggerRegexp(brain, brain.texts.name(entry.trigger), dynamic);
+			if (dynamic) {
+				entry.pattern = pattern;
+			}
+			else {
+				entry.regex = this->regexes.get(pattern);
+			}
+
+			if (entry.that != rs_symbols::none) {
+				pattern = _triggerRegexp(brain, brain.texts.name(entry.that), dynamic);
+				if (dynamic) {
+					entry.thatPattern = pattern;
+				}
+				else {
+					entry.thatRegex = this->regexes.get(pattern);
+				}
+			}
+		}
+	}
+}
+
+string RiveScript::_triggerRegexp (const rs_brain &brain, const string &trigger, bool &dynamic) {
+	dynamic = false;
+	return "^" + _triggerRegexp(brain, trigger, 0, trigger.length(), true, dynamic) + "$";
+}
+
+string RiveScript::_triggerRegexp (const rs_brain &brain, const string &trigger, size_t from, size_t to, bool capture, bool &dynamic) {
+	// Turn (part of) a trigger into a regular expression:
+	//   *, #, _  => wildcards (non-capturing inside an [optional])
+	//   (a|b)    => an alternation, which is captured like a wildcard
+	//   [a|b]    => an optional, which may or may not be there
+	//   @array   => an alternation of the array's items (see rs_trie)
+	//   <bot x>  => the bot variable's value
+	// <get>, <input> and <reply> tags are left for the caller to fill in.
+	string out;
+	for (size_t i = from; i < to; i++) {
+		char c = trigger[i];
+
+		if (c == '*') {
+			out += capture ? "(.+?)" : "(?:.+?)";
+		}
+		else if (c == '#') {
+			out += capture ? "(\\d+?)" : "(?:\\d+?)";
+		}
+		else if (c == '_') {
+			out += capture ? "([^\\s\\d]+?)" : "(?:[^\\s\\d]+?)";
+		}
+		else if (c == '{') {
+			// Drop the {weight} tag.
+			size_t end = trigger.find('}', i);
+			if (end == string::npos || end > to) {
+				out += "\\{";
+				continue;
+			}
+			i = end;
+		}
+		else if (c == '(') {
+			size_t end = _closeBracket(trigger, i, to);
+			out += capture ? "(" : "(?:";
+			out += _triggerRegexp(brain, trigger, i + 1, end, false, dynamic);
+			out += ")";
+			i = end;
+		}
+		else if (c == '[') {
+			// An optional eats the whitespace around it; each of its parts
+			// needs whitespace (or a word boundary) on both sides.
+			size_t end = _closeBracket(trigger, i, to);
+			while (out.length() > 0 && out[out.length() - 1] == ' ') {
+				out.erase(out.length() - 1);
+			}
+
+			out += "(?:";
+			size_t part = i + 1;
+			for (size_t j = i + 1; j <= end; j++) {
+				if (j == end || (trigger[j] == '|' && _closeBracket(trigger, part, j) == j)) {
+					size_t a = part, b = j;
+					while (a < b && trigger[a] == ' ') a++;
+					while (b > a && trigger[b - 1] == ' ') b--;
+					out += "(?:\\s|\\b)+" + _triggerRegexp(brain, trigger, a, b, false, dynamic) + "(?:\\s|\\b)+|";
+					part = j + 1;
+				}
+				else if (trigger[j] == '(' || trigger[j] == '[') {
+					j = _closeBracket(trigger, j, end);
+				}
+			}
+			out += "(?:\\s|\\b))";
+
+			i = end;
+			while (i + 1 < to && trigger[i + 1] == ' ') {
+				i++;
+			}
+		}
+		else if (c == '@') {
+			size_t end = i + 1;
+			while (end < to && (isalnum((unsigned char)trigger[end]) || trigger[end] == '_')) {
+				end++;
+			}
+			string name = trigger.substr(i + 1, end - i - 1);
+
+			const rs_trie *array = _array(brain, name);
+			if (array != NULL) {
+				out += array->pattern();
+			}
+			i = end - 1;
+		}
+		else if (c == '<') {
+			size_t end = trigger.find('>', i);
+			if (end == string::npos || end > to) {
+				out += c;
+				continue;
+			}
+			string tag = trigger.substr(i + 1, end - i - 1);
+
+			if (tag.compare(0, 4, "bot ") == 0) {
+				const string *var = _botVar(brain, tag.substr(4));
+				string value;
+				rs_casefold(var != NULL ? *var : "undefined", value);
+				out += _quoteRegexp(value);
+			}
+			else {
+				// <get>, <input>, <reply>: depends on the user.
+				dynamic = true;
+				out += trigger.substr(i, end - i + 1);
+			}
+			i = end;
+		}
+		else if (c == '|' || c == ' ') {
+			out += c;
+		}
+		else {
+			// A run of literal text, case-folded the same way messages are.
+			size_t end = i + 1;
+			while (end < to && strchr("*#_{([@<| ", trigger[end]) == NULL) {
+				end++;
+			}
+			string literal;
+			rs_casefold(string_view(trigger).substr(i, end - i), literal);
+			out += _quoteRegexp(literal);
+			i = end - 1;
+		}
+	}
+
+	return out;
+}
+
+size_t RiveScript::_closeBracket (const string &text, size_t open, size_t to) {
+	// Find the bracket that closes the one at "open", allowing for nesting.
+	int depth = 0;
+	for (size_t i = open; i < to; i++) {
+		if (text[i] == '(' || text[i] == '[') {
+			depth++;
+		}
+		else if (text[i] == ')' || text[i] == ']') {
+			depth--;
+			if (depth == 0) {
+				return i;
+			}
+		}
 	}
+	return to;
 }
-void RiveScript::warn (string line) {
-	if (this->debug == true) {
-		cout << "RS-WARNING: " << line << endl;
-	}
-	else {
-		cout << "RS: " << line << endl;
+
+string RiveScript::_quoteRegexp (const string &text) {
+	string out;
+	for (size_t i = 0; i < text.length(); i++) {
+		if (strchr("\\^$.|?*+()[]{}/", text[i]) != NULL) {
+			out += '\\';
+		}
+		out += text[i];
 	}
+	return out;
 }
-void RiveScript::warn (string line, string file, int lineno) {
-	if (this->debug == true) {
-		cout << "RS-WARNING: " << line;
+
+bool RiveScript::_matchRegexp (const rs_regex &regex, const string &message, vector<string> &stars) {
+	boost::smatch match;
+	if (!regex || !boost::regex_match(message, match, *regex)) {
+		return false;
 	}
-	else {
-		cout << "RS: " << line;
+
+	stars.clear();
+	for (size_t i = 1; i < match.size(); i++) {
+		stars.push_back(match[i].str());
 	}
-	cout << " at " << file << " line " << lineno << ".\n";
+	return true;
 }
 
-bool RiveScript::loadDirectory (string folder) {
-	say("Loading directory " + folder);
-
-	// Vector to hold file names.
-	vector<string> files = vector<string>();
-
-	// Directory handles.
-	DIR *dp;
-	struct dirent *dirp;
-	if ((dp = opendir(folder.c_str())) == NULL) {
-		cout << "Error (" << errno << ") opening " << folder << endl;
-		return false;
+void RiveScript::_topicTriggers (const rs_brain &brain, uint32_t id, int inherits, vector<rs_sorted> &out, vector<rs_sorted> &that, vector<uint32_t> &seen) {
+	// Don't visit a topic twice (includes and inherits may form a loop).
+	if (id == rs_symbols::none || std::find(seen.begin(), seen.end(), id) != seen.end() || (int)seen.size() > this->depth) {
+		return;
 	}
+	seen.push_back(id);
+	string_view name = brain.topicNames.name(id);
+	const rs_dict<rs_topic> &topics = brain.topics;
+	const rs_dict<rs_that_topic> &thats = brain.thats;
 
-	// Read files.
-	while ((dirp = readdir(dp)) != NULL) {
-		string file = string(dirp->d_name);
-		if (indexOf(file, ".") == 0) {
-			continue;
-		}
-		else if (file == "begin.rs") { // TODO be case insensitive
-			// A begin.rs must always be first to be loaded
-			vector<string>::iterator it;
-			it = files.begin();
-			it = files.insert(it, file);
-		}
-		else {
-			files.push_back(file);
+	rs_dict<rs_topic>::const_iterator topic = topics.find(name);
+	if (topic != topics.end()) {
+		rs_dict<rs_trigger>::const_iterator trig_iter;
+		for (trig_iter = topic->second.trigger.begin(); trig_iter != topic->second.trigger.end(); ++trig_iter) {
+			rs_sorted entry;
+			entry.trigger  = brain.texts.find(trig_iter->first);
+			entry.that     = rs_symbols::none;
+			entry.topic    = id;
+			entry.data     = &trig_iter->second;
+			entry.inherits = inherits;
+			_sortKeys(brain, entry);
+			out.push_back(entry);
 		}
 	}
 
-	// Close the folder.
-	closedir(dp);
-
-	// Debug the files.
-	for (unsigned int i = 0; i < files.size(); i++) {
-		//cout << files[i] << endl;
-		if (!loadFile(folder + "/" + files[i])) {
-			warn("Couldn't load file " + folder + "/" + files[i]);
-			return false;
+	rs_dict<rs_that_topic>::const_iterator thatTopic = thats.find(name);
+	if (thatTopic != thats.end()) {
+		rs_dict<rs_that>::const_iterator that_iter;
+		for (that_iter = thatTopic->second.that.begin(); that_iter != thatTopic->second.that.end(); ++that_iter) {
+			rs_dict<rs_trigger>::const_iterator trig_iter;
+			for (trig_iter = that_iter->second.trigger.begin(); trig_iter != that_iter->second.trigger.end(); ++trig_iter) {
+				rs_sorted entry;
+				entry.trigger  = brain.texts.find(trig_iter->first);
+				entry.that     = brain.texts.find(that_iter->first);
+				entry.topic    = id;
+				entry.data     = &trig_iter->second;
+				entry.inherits = inherits;
+				_sortKeys(brain, entry);
+				that.push_back(entry);
+			}
 		}
 	}
 
-	return true;
-}
+	if (topic == topics.end()) {
+		return;
+	}
 
-bool RiveScript::loadFile (string file) {
-	say("Loading RiveScript document " + file);
+	// Included topics' triggers are on equal footing with our own; inherited
+	// ones come after all of ours.
+	for (unsigned int i = 0; i < topic->second.includes.size(); i++) {
+		_topicTriggers(brain, brain.topicNames.find(topic->second.includes[i]), inherits, out, that, seen);
+	}
+	for (unsigned int i = 0; i < topic->second.inherits.size(); i++) {
+		_topicTriggers(brain, brain.topicNames.find(topic->second.inherits[i]), inherits + 1, out, that, seen);
+	}
+}
 
-	// Open the file for reading.
-	std::ifstream fh (file.c_str());
-	if (fh.is_open()) {
-		say("Opening of " + file + " was successful.");
+void RiveScript::_sortKeys (const rs_brain &brain, rs_sorted &entry) {
+	const string &trigger = brain.texts.name(entry.trigger);
+	entry.weight = 1;
+	entry.length = trigger.length();
+	entry.words  = 0;
 
-		// Read lines from the file and add to a vector.
-		vector<string> lines = vector<string>();
-		string line;
-		while (! fh.eof() ) {
-			getline (fh, line);
-			lines.push_back(line);
+	// Pull out the {weight} and count the words that aren't wildcards.
+	string pattern;
+	for (size_t i = 0; i < trigger.length(); i++) {
+		if (trigger[i] == '{') {
+			size_t end = trigger.find('}', i);
+			if (end != string::npos) {
+				string tag = trigger.substr(i + 1, end - i - 1);
+				if (tag.compare(0, 7, "weight=") == 0) {
+					entry.weight = atoi(tag.c_str() + 7);
+				}
+				i = end;
+				continue;
+			}
 		}
+		pattern += trigger[i];
+	}
 
-		// Close it when we're done.
-		fh.close();
-
-		// Parse it.
-		if (!parse(file, lines)) {
-			warn("Failed to parse " + file);
-			return false;
+	bool inWord = false;
+	for (size_t i = 0; i < pattern.length(); i++) {
+		char c = pattern[i];
+		if (c == ' ' || c == '\t' || c == '*' || c == '#' || c == '_') {
+			inWord = false;
 		}
+		else if (!inWord) {
+			inWord = true;
+			entry.words++;
+		}
+	}
+
+	if (pattern.find('_') != string::npos) {
+		entry.category = entry.words > 0 ? RS_SORT_ALPHA : RS_SORT_UNDER;
+	}
+	else if (pattern.find('#') != string::npos) {
+		entry.category = entry.words > 0 ? RS_SORT_NUMBER : RS_SORT_POUND;
+	}
+	else if (pattern.find('*') != string::npos) {
+		entry.category = entry.words > 0 ? RS_SORT_WILD : RS_SORT_STAR;
+	}
+	else if (pattern.find('[') != string::npos) {
+		entry.category = RS_SORT_OPTION;
 	}
 	else {
-		warn("Unable to open file " + file + " for reading!");
-		return false;
+		entry.category = RS_SORT_ATOMIC;
 	}
+}
 
-	return true;
+void RiveScript::_buildIndex (rs_brain &brain, rs_sorted_topic &topic) {
+	// Index the sorted triggers by the words in the message they need, and
+	// the %Previous triggers by the words in our last reply they need.
+	_indexList(brain, topic.trigger, false, topic.index);
+	_indexList(brain, topic.that, true, topic.thatIndex);
 }
 
-bool RiveScript::parse (string file, vector<string> code) {
-	say("Called upon to parse " + file);
-
-	// State variables.
-	string topic   = "random"; // Default topic = random
-	int    lineno  = 0;        // Keep track of line numbers for error reporting
-	bool   comment = false;    // When we're in a multi-line comment
-	bool   inobj   = false;    // When we're in an object block
-	string objname = "";       // Name of the object we're in
-	string objlang = "";       // Language of the object we're in
-	string objbuf  = "";       // Code buffer of the object we're in
-	string ontrig  = "";       // Current +Trigger text we're working with
-	int    repcnt  = 0;        // Reply counter
-	int    concnt  = 0;        // Condition counter
-	string lastcmd = "";       // Last command symbol
-	string isThat  = "";       // Is a %Previous trigger.
-
-	// Start parsing lines.
-	int lp;
-	for (lp = 0; lp < code.size(); lp++) {
-		string line = code[lp];
-		lineno++;
-
-		// Chomp this line down to size.
-		line = trim(line);
-
-		// Skip a blank line.
-		if (line.length() == 0) {
-			continue;
-		}
+void RiveScript::_indexList (rs_brain &brain, const vector<rs_sorted> &list, bool that, rs_index &idx) {
+	// Index a sorted list by rank.
+	for (unsigned int rank = 0; rank < list.size(); rank++) {
+		vector<string> words = _literalWords(brain.texts.name(that ? list[rank].that : list[rank].trigger));
 
-		// Look for comments.
-		if (line.substr(0,2) == "//") { // Single line comment.
-			continue;
-		}
-		else if (line.substr(0,2) == "/*") { // Multi-line comment START
-			comment = true;
-			continue;
-		}
-		else if (indexOf(line, "*/") > -1) {
-			comment = false;
-			continue;
-		}
-		else if (comment) {
+		idx.required.push_back(words.size());
+		if (words.size() == 0) {
+			idx.wildcard.push_back(rank);
 			continue;
 		}
 
-		// The left-most character is the command code. Get it and chop any
-		// spaces off the front of what's left.
-		string cmd = line.substr (0,1);
-		line = line.substr(1);
-		line = trim(line);
-
-		// Strip off in-line comments if there's a space before and after a "//"
-		int inlineComment = indexOf(line, " // ");
-		if (inlineComment > -1) {
-			say("This line has an inline comment!");
-			line.erase(inlineComment); // Erase from there to the end
-			line = trim(line);
+		for (unsigned int i = 0; i < words.size(); i++) {
+			idx.words[brain.words.intern(words[i])].push_back(rank);
 		}
+	}
+}
 
-		say("Cmd [" + cmd + "] Line: " + line + " (Topic: " + topic + ")");
-
-		// TODO: syntax check this line
+vector<string> RiveScript::_literalWords (const string &trigger) {
+	// Find the words a message must contain for this trigger to match it. Only
+	// plain words outside of any (alternation), [optional] or <tag> count.
+	vector<string> words;
+	string word;
+	int depth = 0; // How deep inside brackets we are
 
-		// Reset the %Previous state if this is a new +Trigger.
-		if (cmd == "+") {
-			isThat = "";
-		}
+	for (size_t i = 0; i <= trigger.length(); i++) {
+		char c = i < trigger.length() ? trigger[i] : ' ';
 
-		// Do a look-ahead for ^Continue and %Previous commands.
-		for (int i = (lp + 1); i < code.size(); i++) {
-			string lookahead = code[i];
-			lookahead = trim(lookahead);
-			if (lookahead.length() == 0) {
+		// Skip over {weight=N} and the like.
+		if (c == '{' && depth == 0) {
+			size_t end = trigger.find('}', i);
+			if (end != string::npos) {
+				i = end;
 				continue;
 			}
+		}
 
-			// Get the look-ahead command and args.
-			string lookCmd = lookahead.substr (0,1);
-			lookahead = trim(lookahead.substr (1));
+		if (c == '(' || c == '[' || c == '<') {
+			depth++;
+		}
+		else if ((c == ')' || c == ']' || c == '>') && depth > 0) {
+			depth--;
+			word += c;
+			continue;
+		}
 
-			// Only continue if there's any data.
-			if (lookahead.length() > 0) {
-				// The lookahead command has to be either a % or a ^.
-				if (lookCmd != "^" && lookCmd != "%") {
-					break;
-				}
+		if (depth == 0 && (c == ' ' || c == '\t')) {
+			// End of a word. Keep it if it's a plain literal.
+			if (word.length() > 0 && word.find_first_of("*#_@()[]<>{}|\\") == string::npos) {
+				string folded;
+				rs_casefold(word, folded);
+				word.swap(folded);
 
-				// If the current command is a +, see if the following command
-				// is a %Previous.
-				if (cmd == "+") {
-					if (lookCmd == "%") {
-						say("This line has a %Previous (" + lookahead + ")");
-						isThat = lookahead;
+				// Only count each distinct word once.
+				bool seen = false;
+				for (unsigned int j = 0; j < words.size(); j++) {
+					if (words[j] == word) {
+						seen = true;
 						break;
 					}
-					else {
-						isThat = "";
-					}
-				}
-
-				// If the current command is a ! and the next command(s) are
-				// ^, we'll tack each extension on as a line break (which is
-				// useful information for arrays; everything else is gonna ditch
-				// this info).
-				if (cmd == "!") {
-					if (lookCmd == "^") {
-						line += "<crlf>" + lookahead;
-						say("^ Line: " + line);
-					}
-					continue;
 				}
-
-				// If the current line is not a ^ and the line after is
-				// not a %, but the line after IS a ^, then tack it onto
-				// the end of the current line (this is fine for every other
-				// type of command that doesn't require special treatment).
-				if (cmd != "^" && lookCmd != "%") {
-					if (lookCmd == "^") {
-						line += lookahead;
-					}
-					else {
-						break;
-					}
+				if (!seen) {
+					words.push_back(word);
 				}
 			}
+			word.clear();
+			continue;
 		}
 
-		if (cmd == "!") {
-			// ! DEFINE
-			vector<string> halves = split(line, "=", 2);
-			string what = trim(halves[0]);
-			string is   = trim(halves[1]);
-			say("! DEFINE: " + what + " => " + is);
-
-			// Is this a !version declaration?
-			if (what == "version") {
-				say("Using RiveScript Version " + is);
-
-				// Cast it to a double to validate the version.
-				double version = strtod (is.c_str(), NULL);
-				if (version > this->rs_version) {
-					cout << version << " > " << this->rs_version << endl;
-					//warn("Unsupported RiveScript version " + version + "; refusing to parse file!");
-					return false;
-				}
-			}
-			else if (indexOf(what," ") > -1) {
-				// This is a type of definition.
-				vector<string> halves = split(what, " ", 2);
-				string type = trim(halves[0]);
-				string name = trim(halves[1]);
-				say("Definition type=" + type + " name=" + name);
+		word += c;
+	}
 
-				// If setting to <undef>, we delete the field.
-				bool undef = false;
-				if (is == "<undef>") {
-					undef = true;
-				}
+	return words;
+}
 
-				// Handle the types.
-				if (type == "global") {
-					// Setting a global variable.
-					if (undef) {
-						this->globals.erase(name);
-					}
-					else {
-						this->globals[name] = is;
-					}
-					say("Set global " + name + " => " + is);
-				}
-				else if (type == "var") {
-					// Setting a bot variable.
-					if (undef) {
-						this->bot.erase(name);
-					}
-					else {
-						this->bot[name] = is;
-					}
-				}
-				else if (type == "array") {
-					// Setting an array.
-					vector<string> parts = split("<crlf>", is);
-					vector<string> fields;
-
-					// An array can be defined over many lines via the ^CONTINUE,
-					// and each line ("parts" here) can separate its array elements
-					// by a pipe symbol "|" or by spaces. First we go over the "parts"
-					// and then look at the elements defined on each part.
-					for (unsigned int i = 0; i < parts.size(); i++) {
-						string part = parts[i];
-
-						// Is it pipe-separated or space separated?
-						if (indexOf(part, "|") > -1) {
-							vector<string> pieces = split(part,"|");
-							for (unsigned int j = 0; j < pieces.size(); j++) {
-								fields.push_back(pieces[j]);
-							}
-						}
-						else {
-							vector<string> pieces = split(part," ");
-							for (unsigned int j = 0; j < pieces.size(); j++) {
-								if (pieces[j].length() == 0) {
-									// Skip blank pieces (in case of multiple spaces to separate)
-									continue;
-								}
-								fields.push_back(pieces[j]);
-							}
-						}
-					}
+vector<const RiveScript::rs_sorted*> RiveScript::_candidates (const rs_brain &brain, const string &topic, const string &message) {
+	const rs_sorted_topic *found = _sortedTopic(brain, topic);
+	if (found == NULL) {
+		return vector<const rs_sorted*>();
+	}
+	return _candidates(brain, found->index, found->trigger, message);
+}
 
-					// Convert escape code \s into a space
-					for (unsigned int i = 0; i < fields.size(); i++) {
-						fields[i] = replace(fields[i], "\\s", " ");
-					}
+vector<const RiveScript::rs_sorted*> RiveScript::_candidates (const rs_brain &brain, const rs_index &idx, const vector<rs_sorted> &list, const string &text) {
+	// The entries in a sorted list whose indexed words all appear in the
+	// text, plus the ones with no words to go on, in rank order.
+	vector<const rs_sorted*> result;
 
-					// Store the array.
-					this->arrays[name] = fields;
-				}
-				else if (type == "sub") {
-					// Setting a substitution variable.
-					if (undef) {
-						this->subs.erase(name);
-					}
-					else {
-						this->subs[name] = is;
-					}
-				}
-				else if (type == "person") {
-					// Setting a substitution variable.
-					if (undef) {
-						this->person.erase(name);
-					}
-					else {
-						this->person[name] = is;
+	// Split the text into its distinct words. (It's been through
+	// _formatMessage(), so it's case-folded already.)
+	vector<string> words;
+	string word;
+	for (size_t i = 0; i <= text.length(); i++) {
+		char c = i < text.length() ? text[i] : ' ';
+		if (c == ' ' || c == '\t') {
+			if (word.length() > 0) {
+				bool seen = false;
+				for (unsigned int j = 0; j < words.size(); j++) {
+					if (words[j] == word) {
+						seen = true;
+						break;
 					}
 				}
-				else {
-					warn("Unknown definition type \"" + type + "\"", file, lineno);
-				}
-			}
-		}
-		else if (cmd == ">") {
-			// > LABEL
-			vector<string> parts = split(line, " ");
-			string type  = parts[0];
-			string name  = parts.size() >= 2 ? parts[1] : "";
-
-			// Handle the label types.
-			if (type == "begin") {
-				say("Found the BEGIN Statement.");
-				type = "topic";
-				name = "__begin__";
-			}
-			if (type == "topic") {
-				say("Set topic to " + name);
-				ontrig = "";
-				topic  = name;
-
-				// TODO look for inherits and includes keywords
-				if (parts.size() >= 3) {
-					string mode = ""; // inherits or includes
-					for (unsigned int i = 2; i < parts.size(); i++) {
-						string text = parts[i];
-						if (text == "inherits" || text == "includes") {
-							mode = text;
-						}
-						else {
-							if (mode == "inherits") {
-								topics[topic].inherits.push_back(text);
-							}
-							else if (mode == "includes") {
-								topics[topic].includes.push_back(text);
-							}
-						}
-					}
+				if (!seen) {
+					words.push_back(word);
 				}
+				word.clear();
 			}
-			if (type == "object") {
-				// If an extra field was provided, it should be the programming language.
-				string lang = parts.size() >= 3 ? parts[2] : "";
-				lang = trim(lang);
-				say("Found an object definition named " + name + " of language " + lang);
-				// TODO: handle this
-			}
+			continue;
 		}
-		else if (cmd == "<") {
-			// < LABEL
-			string type = line;
+		word += c;
+	}
 
-			if (type == "begin" || type == "topic") {
-				say("End " + type + " label.");
-				topic = "random";
-			}
-			else if (type == "object") {
-				say("End object label.");
-				inobj = false;
-			}
+	// Gather the ranks posted under the text's words. Since each word is only
+	// posted once per rank, a rank that turns up as many times as it has
+	// literal words has all of them; sorting puts each rank's hits together
+	// and in rank order, without a node per hit.
+	vector<unsigned int> hits;
+	for (unsigned int i = 0; i < words.size(); i++) {
+		uint32_t id = brain.words.find(words[i]);
+		const vector<unsigned int> *posting = id == rs_symbols::none ? NULL : idx.words.find(id);
+		if (posting != NULL) {
+			hits.insert(hits.end(), posting->begin(), posting->end());
 		}
-		else if (cmd == "+") {
-			// + TRIGGER
-			say("Trigger pattern: " + line);
-//				// Initialize the rs_trigger object. (DON'T NEED TO! YAY!)
-//				rs_trigger trigger;
-//				topics[topic].trigger[line] = trigger;
-			ontrig = line;
-		}
-		else if (cmd == "-") {
-			// - REPLY
-			say("Reply: " + line);
-			if (ontrig.length() == 0) {
-				warn("Reply found before a trigger!");
-				continue;
-			}
+	}
+	std::sort(hits.begin(), hits.end());
 
-			// Is this a %Previous?
-			if (isThat.length() > 0) {
-				thats[topic].that[isThat].trigger[ontrig].reply.push_back(line);
-			}
-			else {
-				// Add the reply to this trigger.
-				topics[topic].trigger[ontrig].reply.push_back(line);
+	// Merge the fully satisfied triggers with the wildcard-only ones.
+	size_t h = 0;
+	unsigned int w = 0;
+	while (h < hits.size() || w < idx.wildcard.size()) {
+		if (h < hits.size()) {
+			size_t run = h;
+			while (run < hits.size() && hits[run] == hits[h]) {
+				run++;
 			}
-		}
-		else if (cmd == "%") {
-			// % PREVIOUS
-			say("%Previous pattern: " + line);
-			// This was handled above.
-		}
-		else if (cmd == "^") {
-			// ^ CONTINUE
-			// This was handled above.
-		}
-		else if (cmd == "@") {
-			// @ REDIRECT
-			say("Redirect: " + line);
-			if (ontrig.length() == 0) {
-				warn("Redirect found before a trigger!");
+			if (run - h < idx.required[hits[h]]) {
+				h = run;
 				continue;
 			}
-
-			// Set the redirect for this trigger.
-			if (isThat.length() > 0) {
-				thats[topic].that[isThat].trigger[ontrig].redirect = line;
-			}
-			else {
-				topics[topic].trigger[ontrig].redirect = line;
-			}
 		}
-		else if (cmd == "*") {
-			// * CONDITION
-			say("Condition: " + line);
-			if (isThat.length() > 0) {
-				thats[topic].that[isThat].trigger[ontrig].condition.push_back(line);
-			}
-			else {
-				topics[topic].trigger[ontrig].condition.push_back(line);
-			}
+
+		if (h == hits.size() || (w < idx.wildcard.size() && idx.wildcard[w] < hits[h])) {
+			result.push_back(&list[idx.wildcard[w]]);
+			w++;
 		}
 		else {
-			warn("Unrecognized command \"" + cmd + "\"", file, lineno);
+			unsigned int rank = hits[h];
+			result.push_back(&list[rank]);
+			while (h < hits.size() && hits[h] == rank) {
+				h++;
+			}
 		}
 	}
 
-	return true;
+	return result;
 }
 
-void RiveScript::_dumpDefinitions (string name, map<string, string> hash) {
+void RiveScript::_dumpDefinitions (const string &name, const map<string, string> &hash) {
 	// Loop over the globals.
-	say("<<< " + name + " >>>");
+	RS_SAY("dump", "<<< " + name + " >>>");
 	map<string, string>::const_iterator iter;
 	for (iter = hash.begin(); iter != hash.end(); ++iter) {
-		say(iter->first + " => " + iter->second);
+		RS_SAY("dump", iter->first + " => " + iter->second);
 	}
-	say("\n\n");
+	RS_SAY("dump", "\n\n");
 }
 
 void RiveScript::_dumpDefinitions () {
 	// Dump all the definitions.
-	_dumpDefinitions("Global Variable Dump", this->globals);
-	_dumpDefinitions("Bot Variable Dump", this->bot);
-	_dumpDefinitions("Substitutions Dump", this->subs);
-	_dumpDefinitions("Person Substitutions Dump", this->person);
+	rs_rcu<rs_brain>::reader brain (this->live);
+	_dumpDefinitions("Global Variable Dump", brain->globals);
+	_dumpDefinitions("Bot Variable Dump", brain->bot);
+	_dumpDefinitions("Substitutions Dump", brain->subs);
+	_dumpDefinitions("Person Substitutions Dump", brain->person);
 }
 
 void RiveScript::_dumpTopics () {
 	// Dump all the topic/trigger/reply data.
-	say("topics = {");
+	RS_SAY("dump", "topics = {");
+	rs_rcu<rs_brain>::reader brain (this->live);
 
 	// Loop through the topic keys.
-	map<string, rs_topic>::const_iterator topic_iter;
-	for (topic_iter = topics.begin(); topic_iter != topics.end(); ++topic_iter) {
-		rs_topic topic = topics[topic_iter->first];
-		say("\t'" + topic_iter->first + "' => {");
+	rs_dict<rs_topic>::const_iterator topic_iter;
+	for (topic_iter = brain->topics.begin(); topic_iter != brain->topics.end(); ++topic_iter) {
+		const rs_topic &topic = topic_iter->second;
+		RS_SAY("dump", "\t'" + string(topic_iter->first) + "' => {");
 
 		// Loop through the topic's triggers.
-		map<string, rs_trigger>::const_iterator trig_iter;
+		rs_dict<rs_trigger>::const_iterator trig_iter;
 		for (trig_iter = topic.trigger.begin(); trig_iter != topic.trigger.end(); ++trig_iter) {
-			string trig_text = trig_iter->first;
-			rs_trigger trigger = topic.trigger[trig_iter->first];
-			say("\t\t'" + trig_text + "' => {");
+			string trig_text (trig_iter->first);
+			const rs_trigger &trigger = trig_iter->second;
+			RS_SAY("dump", "\t\t'" + trig_text + "' => {");
 
 			// Dump the replies.
 			if (trigger.reply.size() > 0) {
-				say("\t\t\t'reply' => [");
-				for (int i = 0; i < trigger.reply.size(); i++) {
-					say("\t\t\t\t'" + trigger.reply[i] + "',");
+				RS_SAY("dump", "\t\t\t'reply' => [");
+				for (unsigned int i = 0; i < trigger.reply.size(); i++) {
+					RS_SAY("dump", "\t\t\t\t'" + string(trigger.reply[i].source) + "',");
 				}
-				say("\t\t\t],");
+				RS_SAY("dump", "\t\t\t],");
 			}
 
 			// Dump the conditions.
 			if (trigger.condition.size() > 0) {
-				say("\t\t\t'condition' => [");
-				for (int i = 0; i < trigger.condition.size(); i++) {
-					say("\t\t\t\t'" + trigger.condition[i] + "',");
+				RS_SAY("dump", "\t\t\t'condition' => [");
+				for (unsigned int i = 0; i < trigger.condition.size(); i++) {
+					RS_SAY("dump", "\t\t\t\t'" + string(trigger.condition[i].source) + "',");
 				}
-				say("\t\t\t],");
+				RS_SAY("dump", "\t\t\t],");
 			}
 
 			// Dump the redirect.
 			if (trigger.redirect.size() > 0) {
-				say("\t\t\t'redirect' => '" + trigger.redirect + "',");
+				RS_SAY("dump", "\t\t\t'redirect' => '" + string(trigger.redirect) + "',");
 			}
 
-			say("\t\t},");
+			RS_SAY("dump", "\t\t},");
 		}
 
 		if (topic.includes.size() > 0) {
-			say("\t\t\'includes\' => [");
+			RS_SAY("dump", "\t\t\'includes\' => [");
 			for (unsigned int i = 0; i < topic.includes.size(); i++) {
-				say("\t\t\t\'" + topic.includes[i] + "\',");
+				RS_SAY("dump", "\t\t\t\'" + string(topic.includes[i]) + "\',");
 			}
-			say("\t\t],");
+			RS_SAY("dump", "\t\t],");
 		}
 
 		if (topic.inherits.size() > 0) {
-			say("\t\t\'inherits\' => [");
+			RS_SAY("dump", "\t\t\'inherits\' => [");
 			for (unsigned int i = 0; i < topic.inherits.size(); i++) {
-				say("\t\t\t\'" + topic.inherits[i] + "\',");
+				RS_SAY("dump", "\t\t\t\'" + string(topic.inherits[i]) + "\',");
 			}
-			say("\t\t],");
+			RS_SAY("dump", "\t\t],");
 		}
 
-		say("\t},");
+		RS_SAY("dump", "\t},");
 	}
 
-	say("};\n\n");
+	RS_SAY("dump", "};\n\n");
 }
 
-/*******************************************************************************
- * Utility Functions (trim, split, etc. not directly related to RiveScript     *
+/******************************************************************************
+ * Memory Accounting Methods                                                  *
  ******************************************************************************/
 
-string RiveScript::trim (const string &t) {
-	string s = t;
-	s = trim(s, " \t\x0A\x0D");
-	return s;
+rs_memory_stats RiveScript::memoryStats () {
+	rs_rcu<rs_brain>::reader brain (this->live);
+	rs_memory_stats stats;
+	_memoryStats(*brain, stats);
+	return stats;
 }
 
-string RiveScript::trim (const string &t, const string &ws) {
-	string s = t;
-	size_t found;
+void RiveScript::setMemoryBudget (size_t bytes) {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	this->budget = bytes;
+}
+
+size_t RiveScript::memoryBudget () {
+	std::lock_guard<std::recursive_mutex> guard (this->loading);
+	return this->budget;
+}
+
+void RiveScript::_memoryStats (const rs_brain &brain, rs_memory_stats &stats) {
+	// Everything's read in place. The topics and %Previous triggers are in
+	// the arena, so it's the arena's size that goes into the total for them;
+	// everything else is on the heap and goes in as it's counted.
+	stats.arenaUsed     = brain.arena.used();
+	stats.arenaReserved = brain.arena.reserved();
 
-	// Trim off the end
-	found = s.find_last_not_of(ws);
-	if (found != string::npos) {
-		s.erase(found+1);
+	for (rs_dict<rs_topic>::const_iterator it = brain.topics.begin(); it != brain.topics.end(); ++it) {
+		rs_memory topic = _topicMemory(it->second);
+		topic.bytes += rs_node_bytes<rs_dict<rs_topic> >() + rs_string_bytes(it->first);
+		stats.topics[string(it->first)] += topic;
+		stats.structures["topics"] += topic;
 	}
-	else {
-		s.clear();
+	for (rs_dict<rs_that_topic>::const_iterator it = brain.thats.begin(); it != brain.thats.end(); ++it) {
+		rs_memory topic;
+		topic.bytes = rs_node_bytes<rs_dict<rs_that_topic> >() + rs_string_bytes(it->first);
+		for (rs_dict<rs_that>::const_iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+			topic.bytes += rs_node_bytes<rs_dict<rs_that> >() + rs_string_bytes(that->first);
+			topic += _triggerMemory(that->second.trigger);
+		}
+		stats.topics[string(it->first)] += topic;
+		stats.structures["thats"] += topic;
 	}
 
-	// Trim off the front
-	found = s.find_first_not_of(ws);
-	if (found != string::npos) {
-		s.erase(0, found);
+	// Variables: as loaded, and their tables by ID.
+	rs_memory &globals = stats.structures["globals"];
+	globals.bytes   = rs_string_map_bytes(brain.globals) + _flatMapBytes(brain.globalVars);
+	globals.objects = brain.globals.size();
+	rs_memory &bot = stats.structures["bot"];
+	bot.bytes   = rs_string_map_bytes(brain.bot) + _flatMapBytes(brain.botVars);
+	bot.objects = brain.bot.size();
+
+	// Arrays, with the tries compiled from them. (A trie that's carried over
+	// from an earlier brain is counted in full by each brain that has it.)
+	rs_memory &arrays = stats.structures["arrays"];
+	for (map<string, vector<string> >::const_iterator it = brain.arrays.begin(); it != brain.arrays.end(); ++it) {
+		arrays.bytes += rs_node_bytes<map<string, vector<string> > >() + rs_string_bytes(it->first) + rs_vector_bytes(it->second);
+		for (unsigned int i = 0; i < it->second.size(); i++) {
+			arrays.bytes += rs_string_bytes(it->second[i]);
+		}
+		arrays.objects += it->second.size();
 	}
-	else {
-		s.clear();
+	arrays.bytes += rs_vector_bytes(brain.arrayTries);
+	for (unsigned int i = 0; i < brain.arrayTries.size(); i++) {
+		arrays.bytes += brain.arrayTries[i] ? sizeof(rs_trie) + brain.arrayTries[i]->bytes() : 0;
+	}
+
+	// Substitutions, and the matchers compiled from them.
+	rs_memory &subs = stats.structures["subs"];
+	subs.bytes   = rs_string_map_bytes(brain.subs) + brain.subst.bytes();
+	subs.objects = brain.subs.size();
+	rs_memory &person = stats.structures["person"];
+	person.bytes   = rs_string_map_bytes(brain.person) + brain.personSubst.bytes();
+	person.objects = brain.person.size();
+
+	rs_memory &objects = stats.structures["objects"];
+	for (map<string, rs_object>::const_iterator it = brain.objects.begin(); it != brain.objects.end(); ++it) {
+		objects.bytes += rs_node_bytes<map<string, rs_object> >() + rs_string_bytes(it->first) +
+			rs_string_bytes(it->second.lang) + rs_string_bytes(it->second.code);
+	}
+	objects.bytes  += rs_vector_bytes(brain.macroSlots);
+	objects.objects = brain.objects.size();
+
+	// The interned names.
+	const rs_symbols *symbols[] = { &brain.topicNames, &brain.texts, &brain.words, &brain.varNames, &brain.arrayNames, &brain.macroNames };
+	rs_memory &names = stats.structures["symbols"];
+	for (unsigned int i = 0; i < 6; i++) {
+		names.bytes   += symbols[i]->bytes();
+		names.objects += symbols[i]->size();
+	}
+
+	// The sorted buffers and their indexes. (Compiled regexes belong to the
+	// regex cache, which is shared by every brain, so they aren't counted.)
+	rs_memory &sorted = stats.structures["sorted"];
+	sorted.bytes = rs_vector_bytes(brain.sorted);
+	for (unsigned int i = 0; i < brain.sorted.size(); i++) {
+		const rs_sorted_topic &topic = brain.sorted[i];
+		const vector<rs_sorted> *lists[] = { &topic.trigger, &topic.that };
+		for (unsigned int j = 0; j < 2; j++) {
+			sorted.bytes   += rs_vector_bytes(*lists[j]);
+			sorted.objects += lists[j]->size();
+			for (unsigned int k = 0; k < lists[j]->size(); k++) {
+				sorted.bytes += rs_string_bytes((*lists[j])[k].pattern) + rs_string_bytes((*lists[j])[k].thatPattern);
+			}
+		}
+		const rs_index *indexes[] = { &topic.index, &topic.thatIndex };
+		for (unsigned int j = 0; j < 2; j++) {
+			sorted.bytes += rs_vector_bytes(indexes[j]->required) + rs_vector_bytes(indexes[j]->wildcard) + _flatMapBytes(indexes[j]->words);
+		}
+	}
+
+	// The documents that were merged in, by the file they came from. They're
+	// shared with the brains before and after this one.
+	rs_memory &documents = stats.structures["documents"];
+	documents.bytes = rs_vector_bytes(brain.documents) + rs_vector_bytes(brain.sources) + rs_vector_bytes(brain.hashes);
+	for (unsigned int i = 0; i < brain.sources.size(); i++) {
+		documents.bytes += rs_string_bytes(brain.sources[i]);
+	}
+	for (unsigned int i = 0; i < brain.documents.size(); i++) {
+		const rs_document &doc = *brain.documents[i].second;
+		rs_memory file;
+		file.bytes = sizeof(rs_document) + _documentBytes(doc);
+		for (rs_dict<rs_topic>::const_iterator it = doc.topics.begin(); it != doc.topics.end(); ++it) {
+			file.objects += it->second.trigger.size();
+		}
+		for (rs_dict<rs_that_topic>::const_iterator it = doc.thats.begin(); it != doc.thats.end(); ++it) {
+			for (rs_dict<rs_that>::const_iterator that = it->second.that.begin(); that != it->second.that.end(); ++that) {
+				file.objects += that->second.trigger.size();
+			}
+		}
+		stats.files[brain.documents[i].first] += file;
+		documents += file;
 	}
 
-	return s;
+	stats.total = sizeof(rs_brain) + stats.arenaReserved;
+	for (map<string, rs_memory>::const_iterator it = stats.structures.begin(); it != stats.structures.end(); ++it) {
+		if (it->first != "topics" && it->first != "thats") {
+			stats.total += it->second.bytes;
+		}
+	}
 }
 
-int RiveScript::indexOf (string s, string match) {
-	string::size_type loc = s.find(match, 0);
-	if (loc != string::npos) {
-		return loc;
+rs_memory RiveScript::_topicMemory (const rs_topic &topic) {
+	rs_memory memory = _triggerMemory(topic.trigger);
+	memory.bytes += rs_vector_bytes(topic.includes) + rs_vector_bytes(topic.inherits);
+	for (unsigned int i = 0; i < topic.includes.size(); i++) {
+		memory.bytes += rs_string_bytes(topic.includes[i]);
 	}
-	else {
-		return -1;
+	for (unsigned int i = 0; i < topic.inherits.size(); i++) {
+		memory.bytes += rs_string_bytes(topic.inherits[i]);
 	}
+	return memory;
 }
 
-vector<string> RiveScript::split (string s, string delim, unsigned int pieces) {
-	vector<string> result = vector<string>();
+rs_memory RiveScript::_triggerMemory (const rs_dict<rs_trigger> &triggers) {
+	// The triggers, one object each, with their replies and conditions.
+	rs_memory memory;
+	for (rs_dict<rs_trigger>::const_iterator it = triggers.begin(); it != triggers.end(); ++it) {
+		const rs_trigger &trigger = it->second;
+		memory.bytes += rs_node_bytes<rs_dict<rs_trigger> >() + rs_string_bytes(it->first) + rs_string_bytes(trigger.redirect);
+		memory.bytes += rs_vector_bytes(trigger.reply) + rs_vector_bytes(trigger.condition);
+		memory.bytes += rs_vector_bytes(trigger.cutoff) + rs_vector_bytes(trigger.alias);
+		for (unsigned int i = 0; i < trigger.reply.size(); i++) {
+			memory.bytes += _replyBytes(trigger.reply[i]);
+		}
+		for (unsigned int i = 0; i < trigger.condition.size(); i++) {
+			const rs_condition &condition = trigger.condition[i];
+			memory.bytes += rs_string_bytes(condition.source) + rs_string_bytes(condition.left.text) +
+				rs_string_bytes(condition.right.text) + _replyBytes(condition.reply);
+		}
+		memory.objects++;
+	}
+	return memory;
+}
 
-	// See if the string even contains the delimiter in the first place.
-	if (indexOf(s, delim) == -1) {
-		// It doesn't. Just add the whole string to the first element.
-		result.push_back(s);
+size_t RiveScript::_replyBytes (const rs_reply &reply) {
+	// What a reply points to (it's counted itself by whatever holds it).
+	size_t bytes = rs_string_bytes(reply.source) + rs_vector_bytes(reply.segments);
+	for (unsigned int i = 0; i < reply.segments.size(); i++) {
+		const rs_segment &segment = reply.segments[i];
+		bytes += rs_string_bytes(segment.text) + rs_string_bytes(segment.value) + rs_vector_bytes(segment.choices);
+		for (unsigned int j = 0; j < segment.choices.size(); j++) {
+			bytes += rs_string_bytes(segment.choices[j]);
+		}
 	}
+	return bytes;
+}
 
-	// Do a loop of: look for the delimeter, substr the two sides of it, add them
-	// to the result and continue until the result is as big as we wanted it.
-	while (indexOf(s, delim) > -1 && result.size() < pieces) {
-		int pos = indexOf(s, delim);
-		if (pos == -1) {
-			// No more matches!
-			break;
+size_t RiveScript::_flatMapBytes (const rs_flat_map<std::string> &table) {
+	size_t bytes = table.capacity() * (sizeof(uint32_t) + sizeof(string));
+	for (size_t i = 0; i < table.capacity(); i++) {
+		if (table.used(i)) {
+			bytes += rs_string_bytes(table.value(i));
 		}
-		else {
-			// Substr that!
-			string left = s.substr(0, pos);
-			string right = s.substr(pos + delim.length());
-			s = right;
-			result.push_back(left);
+	}
+	return bytes;
+}
+
+size_t RiveScript::_flatMapBytes (const rs_flat_map<std::vector<unsigned int> > &table) {
+	size_t bytes = table.capacity() * (sizeof(uint32_t) + sizeof(vector<unsigned int>));
+	for (size_t i = 0; i < table.capacity(); i++) {
+		if (table.used(i)) {
+			bytes += rs_vector_bytes(table.value(i));
+		}
+	}
+	return bytes;
+}
+
+size_t RiveScript::_documentBytes (const rs_document &doc) {
+	// Its arena (topics and %Previous triggers), plus its definitions.
+	size_t bytes = doc.arena.reserved();
+	const map<string, rs_definition> *defs[] = { &doc.globals, &doc.bot, &doc.subs, &doc.person };
+	for (unsigned int i = 0; i < 4; i++) {
+		map<string, rs_definition>::const_iterator it;
+		for (it = defs[i]->begin(); it != defs[i]->end(); ++it) {
+			bytes += rs_node_bytes<map<string, rs_definition> >() + rs_string_bytes(it->first) + rs_string_bytes(it->second.value);
 		}
 	}
+	return bytes + _definitionBytes(doc.arrays, doc.objects);
+}
+
+size_t RiveScript::_loadingBytes (const rs_document &doc) {
+	// What loading a document adds: the document itself, which is kept, and
+	// the copy of its topics that merging it puts in the brain's arena.
+	return sizeof(rs_document) + _documentBytes(doc) + doc.arena.used();
+}
+
+size_t RiveScript::_definitionBytes (const map<string, vector<string> > &arrays, const map<string, rs_object> &objects) {
+	size_t bytes = 0;
+	for (map<string, vector<string> >::const_iterator it = arrays.begin(); it != arrays.end(); ++it) {
+		bytes += rs_node_bytes<map<string, vector<string> > >() + rs_string_bytes(it->first) + rs_vector_bytes(it->second);
+		for (unsigned int i = 0; i < it->second.size(); i++) {
+			bytes += rs_string_bytes(it->second[i]);
+		}
+	}
+	for (map<string, rs_object>::const_iterator it = objects.begin(); it != objects.end(); ++it) {
+		bytes += rs_node_bytes<map<string, rs_object> >() + rs_string_bytes(it->first) +
+			rs_string_bytes(it->second.lang) + rs_string_bytes(it->second.code);
+	}
+	return bytes;
+}
+
+size_t RiveScript::_loadedBytes (const rs_brain &brain) {
+	// What the budget covers: everything that's been loaded, but not what's
+	// compiled from it (which sortReplies() puts back together anyway).
+	size_t bytes = sizeof(rs_brain) + brain.arena.reserved();
+	bytes += rs_string_map_bytes(brain.globals) + rs_string_map_bytes(brain.bot);
+	bytes += rs_string_map_bytes(brain.subs) + rs_string_map_bytes(brain.person);
+	bytes += _definitionBytes(brain.arrays, brain.objects);
+	for (unsigned int i = 0; i < brain.documents.size(); i++) {
+		bytes += sizeof(rs_document) + _documentBytes(*brain.documents[i].second);
+	}
+	return bytes;
+}
+
+size_t RiveScript::_budgetLeft (size_t freed) {
+	// How much more can be loaded, once "freed" bytes of what's loaded now
+	// are let go; 0 if the budget's already spent (or if there isn't one,
+	// which _parseBudgeted() checks first).
+	size_t used;
+	if (this->staging) {
+		used = _loadedBytes(*this->staging);
+	}
+	else {
+		rs_rcu<rs_brain>::reader live (this->live);
+		used = _loadedBytes(*live);
+	}
+	used -= std::min(used, freed);
+	return used < this->budget ? this->budget - used : 0;
+}
+
+bool RiveScript::_parseBudgeted (const string &file, const vector<string_view> &code, rs_document &doc, bool &ok, size_t freed) {
+	// Parse a document, provided it fits in what's left of the memory
+	// budget (counting "freed" bytes that it replaces as left). Its arena is
+	// capped at that, so a file that's far too big stops being parsed as
+	// soon as it goes over.
+	ok = false;
+	if (this->budget == 0) {
+		ok = _parse(file, code, doc);
+		return true;
+	}
+
+	size_t left = _budgetLeft(freed);
+	if (left == 0) {
+		RS_WARN("load", "Not loading " + file + ": the memory budget of " + std::to_string(this->budget) + " bytes is already used up");
+		return false;
+	}
+	doc.arena.setLimit(left);
+	try {
+		ok = _parse(file, code, doc);
+	}
+	catch (const std::bad_alloc &) {
+		RS_WARN("load", "Not loading " + file + ": it would go over the memory budget of " + std::to_string(this->budget) + " bytes");
+		return false;
+	}
+	if (_loadingBytes(doc) > left) {
+		RS_WARN("load", "Not loading " + file + ": it would go over the memory budget of " + std::to_string(this->budget) + " bytes");
+		return false;
+	}
+	return true;
+}
+
+/*******************************************************************************
+ * Utility Functions (trim, split, etc. not directly related to RiveScript     *
+ ******************************************************************************/
+
+string RiveScript::trim (const string &t) {
+	return string(rs_trim(t));
+}
+
+string RiveScript::trim (const string &t, const string &ws) {
+	string_view s = t;
+	size_t first = s.find_first_not_of(ws);
+	if (first == string_view::npos) {
+		return string();
+	}
+	size_t last = s.find_last_not_of(ws);
+	return string(s.substr(first, last - first + 1));
+}
+
+int RiveScript::indexOf (string_view s, string_view match) {
+	size_t loc = s.find(match);
+	return loc != string_view::npos ? (int)loc : -1;
+}
+
+vector<string> RiveScript::split (string_view s, string_view delim, unsigned int pieces) {
+	vector<string> result;
+
+	// Cut pieces off the front until there's only room for one more, which
+	// gets the rest. Nothing is copied but the pieces themselves.
+	size_t pos;
+	while (result.size() + 1 < pieces && delim.length() > 0 && (pos = s.find(delim)) != string_view::npos) {
+		result.emplace_back(s.substr(0, pos));
+		s = s.substr(pos + delim.length());
+	}
 
-	if (s.size() > 0) {
-		result.push_back(s);
+	if (s.size() > 0 || result.empty()) {
+		result.emplace_back(s);
 	}
 
 	// Pad the extra entries with empty space if they're not defined.
@@ -684,40 +4368,32 @@ vector<string> RiveScript::split (string s, string delim, unsigned int pieces) {
 	return result;
 }
 
-vector<string> RiveScript::split (string s, string delim) {
+vector<string> RiveScript::split (string_view s, string_view delim) {
 	vector<string> result;
 
-	// Doesn't contain the delim?
-	if (indexOf(s, delim) == -1) {
-		result.push_back(s);
-		return result;
-	}
-
-	// Keep splitting.
-	while (indexOf(s, delim) > -1) {
-		int pos = indexOf(s, delim);
-		if (pos == -1) {
-			break;
-		}
-		else {
-			string left = s.substr(0, pos);
-			string right = s.substr(pos + delim.length());
-			s = right;
-			result.push_back(left);
-		}
+	size_t pos;
+	while (delim.length() > 0 && (pos = s.find(delim)) != string_view::npos) {
+		result.emplace_back(s.substr(0, pos));
+		s = s.substr(pos + delim.length());
 	}
 
-	if (s.size() > 0) {
-		result.push_back(s);
+	// A trailing delimiter doesn't leave an empty piece behind (unless
+	// that's all there is).
+	if (s.size() > 0 || result.empty()) {
+		result.emplace_back(s);
 	}
 
 	return result;
 }
 
-string RiveScript::replace (string source, string search, string replace) {
-	boost::regex pattern (search, boost::regex_constants::icase | boost::regex_constants::perl);
+string RiveScript::replace (const string &source, const string &search, const string &replace) {
+	rs_regex pattern = this->regexes.get(search, boost::regex_constants::icase | boost::regex_constants::perl);
+	if (!pattern) {
+		RS_WARN("reply", "Invalid regular expression: " + search);
+		return source;
+	}
 	string output;
-	output = boost::regex_replace (source, pattern, replace);
+	output = boost::regex_replace (source, *pattern, replace);
 	return output;
 
 	// A replace w/o regexes
@@ -737,3 +4413,7 @@ string RiveScript::replace (string source, string search, string replace) {
 
 	return result;
 }
+
+rs_regex_cache &RiveScript::regexCache () {
+	return this->regexes;
+}
@@ -4,6 +4,29 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+#include "rs_arena.h"
+#include "rs_substituter.h"
+#include "rs_regex_cache.h"
+#include "rs_symbols.h"
+#include "rs_flat_map.h"
+#include "rs_rcu.h"
+#include "rs_sessions.h"
+#include "rs_trace.h"
+#include "rs_watcher.h"
+#include "rs_pool.h"
+#include "rs_macros.h"
+#include "rs_trie.h"
+#include "rs_memory.h"
+
+class rs_snapshot_writer;
+class rs_snapshot_reader;
 
 class RiveScript {
 	private:
@@ -11,36 +34,344 @@ class RiveScript {
 		bool   debug;      // Debug mode (defaults to false)
 		int    depth;      // Recursion depth limit (defaults to 50)
 		double rs_version; // Version of the RiveScript syntax we support (2.0)
+		rs_tracer trace;   // Where say() and warn() (and everything else) go
+		size_t budget;     // Memory budget for loading, in bytes (0 for none)
+
+		// Topic/Trigger/Reply structure. These live in an arena (see rs_brain);
+		// the allocator is handed down to every string and container inside.
+		typedef std::pmr::polymorphic_allocator<char> rs_allocator;
 
-		// Private hash std::maps.
-		std::map<std::string, std::string> globals;         // ! global  global variables
-		std::map<std::string, std::string> bot;             // ! var     bot variables
-		std::map<std::string, std::vector<std::string> > arrays; // ! array   arrays
-		std::map<std::string, std::string> subs;            // ! sub     substitutions
-		std::map<std::string, std::string> person;          // ! person  person substitutions
+		// One side of a *Condition, sorted out when it's parsed. The common
+		// shapes (a constant, a star, a variable) are looked up directly when
+		// the condition is checked; anything else goes through the tags.
+		enum rs_operand_kind {
+			RS_OPERAND_TEXT,     // A constant
+			RS_OPERAND_STAR,     // <starN>, "index" is N
+			RS_OPERAND_BOTSTAR,  // <botstarN>
+			RS_OPERAND_INPUT,    // <inputN>
+			RS_OPERAND_REPLY,    // <replyN>
+			RS_OPERAND_GET,      // <get name>
+			RS_OPERAND_BOT,      // <bot name>
+			RS_OPERAND_ENV,      // <env name>
+			RS_OPERAND_ID,       // <id>
+			RS_OPERAND_TEMPLATE  // Anything else, run through _processTags()
+		};
+		struct rs_operand {
+			typedef rs_allocator allocator_type;
+			rs_operand_kind kind;
+			unsigned int index; // Which star or history entry
+			rs_text text;       // The constant, variable name or template
+			bool numeric;       // A constant that's an integer...
+			long number;        // ...and its value
+			rs_operand (const rs_allocator &alloc = rs_allocator())
+				: kind(RS_OPERAND_TEXT), index(0), text(alloc), numeric(false), number(0) {}
+			rs_operand (const rs_operand &from, const rs_allocator &alloc)
+				: kind(from.kind), index(from.index), text(from.text, alloc), numeric(from.numeric), number(from.number) {}
+		};
+
+		// A piece of a compiled reply. Replies are cut up into literal text and
+		// the tags in between when they're parsed, so rendering one is a
+		// single pass that appends each piece in turn.
+		enum rs_segment_kind {
+			RS_SEGMENT_TEXT,    // Literal text, escapes already applied
+			RS_SEGMENT_STAR,    // <starN>, "index" is N
+			RS_SEGMENT_BOTSTAR, // <botstarN>
+			RS_SEGMENT_INPUT,   // <inputN>
+			RS_SEGMENT_REPLY,   // <replyN>
+			RS_SEGMENT_ID,      // <id>
+			RS_SEGMENT_GET,     // <get name>
+			RS_SEGMENT_BOT,     // <bot name>, "var" is its ID once sorted
+			RS_SEGMENT_ENV,     // <env name>, likewise
+			RS_SEGMENT_SET,     // <set name=value>
+			RS_SEGMENT_MATH,    // <add|sub|mult|div name=value>, "index" says which
+			RS_SEGMENT_RANDOM,  // {random}a|b{/random}
+			RS_SEGMENT_FORMAT,  // {person}, {formal}, etc., "index" says which, around the next "length" segments
+			RS_SEGMENT_CALL     // <call>name args</call>, the arguments in "choices", "macro" once sorted
+		};
+		struct rs_segment {
+			typedef rs_allocator allocator_type;
+			rs_segment_kind kind;
+			unsigned int index;
+			unsigned int length;
+			uint32_t var;
+			rs_text text;  // The literal text or variable name
+			rs_text value; // What <set> and the math tags use
+			rs_list<rs_text> choices; // {random}'s, or <call>'s arguments
+			rs_macro_slot *macro;     // <call>'s macro
+			rs_segment (const rs_allocator &alloc = rs_allocator())
+				: kind(RS_SEGMENT_TEXT), index(0), length(0), var(rs_symbols::none), text(alloc), value(alloc), choices(alloc), macro(NULL) {}
+			rs_segment (const rs_segment &from, const rs_allocator &alloc)
+				: kind(from.kind), index(from.index), length(from.length), var(from.var),
+				  text(from.text, alloc), value(from.value, alloc), choices(from.choices, alloc), macro(from.macro) {}
+		};
+		struct rs_reply {
+			// A -Reply (or a *Condition's reply), compiled by _compileReply().
+			typedef rs_allocator allocator_type;
+			rs_text source;               // As written
+			rs_list<rs_segment> segments;
+			int weight;                   // Its {weight}, or 1
+			bool compiled;                // False if it has to go through _processTags()
+			bool finish;                  // Has {topic} or {@} tags for _finishTags()
+			rs_reply (const rs_allocator &alloc = rs_allocator())
+				: source(alloc), segments(alloc), weight(1), compiled(false), finish(false) {}
+			rs_reply (const rs_reply &from, const rs_allocator &alloc)
+				: source(from.source, alloc), segments(from.segments, alloc), weight(from.weight),
+				  compiled(from.compiled), finish(from.finish) {}
+		};
+		struct rs_condition {
+			// * left op right => reply, compiled by _compileCondition().
+			typedef rs_allocator allocator_type;
+			rs_text source;     // The line as written
+			rs_operand left;
+			rs_operand right;
+			char op;            // '=', '!', '<', 'l' (<=), '>', 'g' (>=), or 0 if it's malformed
+			rs_reply reply;
+			rs_condition (const rs_allocator &alloc = rs_allocator())
+				: source(alloc), left(alloc), right(alloc), op(0), reply(alloc) {}
+			rs_condition (const rs_condition &from, const rs_allocator &alloc)
+				: source(from.source, alloc), left(from.left, alloc), right(from.right, alloc), op(from.op), reply(from.reply, alloc) {}
+		};
 
-		// Topic/Trigger/Reply structure
 		struct rs_trigger {
 			// A trigger is the parent of everything that comes after it.
-			std::string redirect;          // @Redirection std::string
-			std::vector<std::string> reply;     // List of -Replies
-			std::vector<std::string> condition; // List of *Conditions
+			typedef rs_allocator allocator_type;
+			rs_text redirect;          // @Redirection std::string
+			rs_list<rs_reply> reply;    // List of -Replies
+			rs_list<rs_condition> condition; // List of *Conditions
+
+			// Walker alias table over the replies' {weight}s, built when the
+			// replies are sorted (see _pickReply()).
+			rs_list<uint64_t> cutoff;  // Out of "total": below it, the column's own reply
+			rs_list<uint32_t> alias;   // Otherwise this one
+			uint64_t total;            // Sum of the weights
+
+			rs_trigger (const rs_allocator &alloc = rs_allocator())
+				: redirect(alloc), reply(alloc), condition(alloc), cutoff(alloc), alias(alloc), total(0) {}
+			rs_trigger (const rs_trigger &from, const rs_allocator &alloc)
+				: redirect(from.redirect, alloc), reply(from.reply, alloc), condition(from.condition, alloc),
+				  cutoff(from.cutoff, alloc), alias(from.alias, alloc), total(from.total) {}
 		};
 		struct rs_topic {
 			// A topic is the parent of many triggers.
-			std::map<std::string,rs_trigger> trigger; // Hash std::map of triggers
-			std::vector<std::string> includes;
-			std::vector<std::string> inherits;
+			typedef rs_allocator allocator_type;
+			rs_dict<rs_trigger> trigger; // Hash std::map of triggers
+			rs_list<rs_text> includes;
+			rs_list<rs_text> inherits;
+			rs_topic (const rs_allocator &alloc = rs_allocator()) : trigger(alloc), includes(alloc), inherits(alloc) {}
+			rs_topic (const rs_topic &from, const rs_allocator &alloc)
+				: trigger(from.trigger, alloc), includes(from.includes, alloc), inherits(from.inherits, alloc) {}
 		};
 		struct rs_that {
-			std::map<std::string,rs_trigger> trigger;
+			typedef rs_allocator allocator_type;
+			rs_dict<rs_trigger> trigger;
+			rs_that (const rs_allocator &alloc = rs_allocator()) : trigger(alloc) {}
+			rs_that (const rs_that &from, const rs_allocator &alloc) : trigger(from.trigger, alloc) {}
 		};
 		struct rs_that_topic {
 			// A %Previous topic contains an rs_that between it and the trigger(s).
-			std::map<std::string,rs_that> that;
+			typedef rs_allocator allocator_type;
+			rs_dict<rs_that> that;
+			rs_that_topic (const rs_allocator &alloc = rs_allocator()) : that(alloc) {}
+			rs_that_topic (const rs_that_topic &from, const rs_allocator &alloc) : that(from.that, alloc) {}
+		};
+
+		// What a single document defines. Each file is parsed into one of
+		// these on its own, and then merged into the brain in load order.
+		struct rs_definition {
+			bool undef;        // Set to <undef> (delete the field)
+			std::string value; // The value otherwise
+			rs_definition () : undef(false) {}
+			rs_definition (bool undef, const std::string &value) : undef(undef), value(value) {}
+			bool operator== (const rs_definition &other) const { return undef == other.undef && value == other.value; }
+		};
+		struct rs_object {
+			std::string lang; // Programming language
+			std::string code; // Its source, line for line
+			bool operator== (const rs_object &other) const { return lang == other.lang && code == other.code; }
+		};
+		struct rs_document {
+			std::map<std::string, rs_definition> globals; // Last definition in the file wins
+			std::map<std::string, rs_definition> bot;
+			std::map<std::string, rs_definition> subs;
+			std::map<std::string, rs_definition> person;
+			std::map<std::string, std::vector<std::string> > arrays;
+			std::map<std::string, rs_object> objects;
+			rs_arena arena; // The topics as parsed (a copy is merged into the brain)
+			rs_dict<rs_topic> topics;
+			rs_dict<rs_that_topic> thats;
+			uint64_t hash;  // Of the file's contents as they were parsed
+			rs_document () : topics(&arena), thats(&arena), hash(0) {}
+		};
+
+		// Where a parse is up to: parse() keeps one for the length of a
+		// document, stream() from one chunk to the next.
+		struct rs_parser {
+			std::string file;
+			std::string topic;  // Current topic
+			int lineno;         // For error reporting
+			bool comment;       // In a multi-line comment
+			bool inobj;         // In an object block
+			std::string objName; // Its name,
+			std::string objLang; // language,
+			std::string objBuf;  // and the code so far
+			std::string ontrig; // Current +Trigger text
+			std::string isThat; // Its %Previous, if it has one
+			rs_parser (const std::string &file)
+				: file(file), topic("random"), lineno(0), comment(false), inobj(false) {}
+		};
+
+		// One line of a document, classified: its command character ('\0'
+		// for a blank line) and the data after it, both trimmed. Views into
+		// the line.
+		struct rs_token {
+			std::string_view raw;  // The line as it was
+			std::string_view text; // The whole line, trimmed
+			char cmd;
+			std::string_view data;
+		};
+
+		// A streamed command that's still looking ahead for ^Continue and
+		// %Previous lines. It's run once the next command shows up.
+		struct rs_pending {
+			char cmd;
+			std::string line;   // With any ^Continues tacked on
+			std::string that;   // Its %Previous, if it's a +Trigger with one
+			int lineno;
+			bool open;          // Whether it's still looking ahead
+		};
+		struct rs_stream {
+			rs_parser parser;
+			std::unique_ptr<rs_document> doc; // What's been parsed since the last trigger was merged
+			std::shared_ptr<rs_document> all; // Everything merged so far, folded together
+			std::deque<rs_pending> pending;
+			std::string partial;              // An unfinished line from the end of the last chunk
+			bool failed;
+			rs_stream () : parser("stream()"), doc(new rs_document()), all(new rs_document()), failed(false) {}
+		};
+		std::unique_ptr<rs_stream> streaming; // The stream() in progress, if there is one
+
+		// Sorted trigger buffers, built by sortReplies(). Each topic gets a flat
+		// array of its triggers in match precedence order, with the sort keys
+		// worked out once up front.
+		struct rs_sorted {
+			uint32_t trigger;       // +Trigger text (in "texts")
+			uint32_t that;          // %Previous text (in "texts"), or rs_symbols::none
+			uint32_t topic;         // Topic the trigger was defined in (in "topicNames")
+			const rs_trigger *data; // Points into the brain's topics (or thats)
+			int weight;             // {weight=N}, default 1
+			int inherits;           // How many "inherits" hops away the trigger came from
+			int category;           // Atomic, optional, wildcard kind etc. (see _sortKeys())
+			int words;              // Number of non-wildcard words
+			int length;             // Length of the trigger text
+			std::string pattern;     // The trigger as a regexp, if it depends on the user
+			rs_regex regex;          // Compiled pattern otherwise
+			std::string thatPattern; // Same again for the %Previous
+			rs_regex thatRegex;
+		};
+
+		// Literal-word prefilter index. Triggers are referred to by their rank
+		// in the topic's sorted buffer, so candidates come back in sort order.
+		struct rs_index {
+			std::vector<unsigned int> required; // Number of distinct literal words, by rank
+			std::vector<unsigned int> wildcard; // Ranks of triggers with no literal words
+			rs_flat_map< std::vector<unsigned int> > words; // Literal word (in "words") => ranks
 		};
-		std::map<std::string, rs_topic> topics; // std::map of topic names
-		std::map<std::string, rs_that_topic> thats;  // std::map of %Previous triggers
+
+		struct rs_sorted_topic {
+			std::vector<rs_sorted> trigger; // Normal triggers, in precedence order
+			std::vector<rs_sorted> that;    // %Previous triggers, in precedence order
+			rs_index index;                 // Prefilter index over "trigger"
+			rs_index thatIndex;             // And over the %Previous texts in "that"
+		};
+
+		// One generation of the brain: everything that's been loaded and,
+		// once sortReplies() has run, everything compiled from it. A
+		// generation is read-only from the moment it's published, so any
+		// number of threads can reply from it at once without locking.
+		//
+		// Its topics, %Previous triggers and all of their text are allocated
+		// out of its arena, so throwing a generation away is a single release
+		// of the arena rather than a free per trigger, reply and string.
+		struct rs_brain {
+			rs_arena arena;
+
+			// What's been loaded.
+			std::map<std::string, std::string> globals;         // ! global  global variables
+			std::map<std::string, std::string> bot;             // ! var     bot variables
+			std::map<std::string, std::vector<std::string> > arrays; // ! array   arrays
+			std::map<std::string, std::string> subs;            // ! sub     substitutions
+			std::map<std::string, std::string> person;          // ! person  person substitutions
+			std::map<std::string, rs_object> objects;           // > object  object macros
+			rs_dict<rs_topic> topics;         // std::map of topic names
+			rs_dict<rs_that_topic> thats;     // std::map of %Previous triggers
+			std::vector<std::string> sources; // Documents loaded so far, in load order
+			std::vector<uint64_t> hashes;     // What each one's contents hashed to when it was parsed
+
+			// Every document that was merged in, in merge order, under the
+			// file it came from. Documents are never changed once merged, so
+			// generations share them. reloadFile() swaps one file's out and
+			// re-merges just the topics it touched. The price is that what's
+			// loaded is held twice: here, and merged into "topics".
+			std::vector<std::pair<std::string, std::shared_ptr<const rs_document> > > documents;
+
+			// The lookup side of the brain. Names are interned into dense IDs
+			// when the replies are sorted, and everything that's looked up
+			// while replying is stored in flat tables or vectors indexed by
+			// those IDs.
+			rs_substituter subst;       // "subs" compiled for matching
+			rs_substituter personSubst; // "person" compiled for matching
+			rs_symbols topicNames; // Topic names
+			rs_symbols texts;      // Trigger and %Previous texts
+			rs_symbols words;      // Literal words in the trigger index
+			rs_symbols varNames;   // Global and bot variable names
+			rs_symbols arrayNames; // Array names
+			rs_symbols macroNames; // Object macros that are called or defined
+			std::vector<rs_sorted_topic> sorted;        // By topic ID
+			rs_flat_map<std::string> globalVars;        // By variable ID
+			rs_flat_map<std::string> botVars;           // By variable ID
+			std::vector<std::shared_ptr<const rs_trie> > arrayTries; // By array ID
+			std::vector<rs_macro_slot*> macroSlots;     // By macro ID
+
+			rs_brain () : arena(64 * 1024), topics(&arena), thats(&arena) {}
+
+			// Copies what was loaded (into the new arena), but not what was
+			// compiled from it.
+			rs_brain (const rs_brain &from)
+				: arena(64 * 1024), globals(from.globals), bot(from.bot), arrays(from.arrays),
+				  subs(from.subs), person(from.person), objects(from.objects), topics(from.topics, &arena),
+				  thats(from.thats, &arena), sources(from.sources), hashes(from.hashes),
+				  documents(from.documents) {}
+		};
+		rs_rcu<rs_brain> live;             // The published brain that replies come from
+		std::unique_ptr<rs_brain> staging; // Where loading happens; a copy of the live one
+		std::recursive_mutex loading;      // One loader at a time
+
+		rs_sessions users; // What we know about each user
+
+		// Workers for replyBatch(), started by the first batch.
+		std::unique_ptr<rs_pool> workers;
+		std::once_flag workersStarted;
+
+		// What one call to reply() is working with: the brain it pinned, and
+		// its own copy of the user's state.
+		struct rs_call {
+			const rs_brain &brain;
+			const std::string &id;
+			rs_session &user;
+			std::string lastReply;  // Our last reply to them, formatted, once it's needed
+			bool haveLastReply;
+			rs_call (const rs_brain &brain, const std::string &id, rs_session &user)
+				: brain(brain), id(id), user(user), haveLastReply(false) {}
+		};
+
+		rs_regex_cache regexes; // Every regex the engine uses comes from here
+
+		rs_macros macros;     // Object macros and language handlers
+		rs_executor executor; // Where async macros run
+
+		// Reloads files in the watched directory as they change. Declared
+		// last, so it's stopped before anything it calls into is destroyed.
+		std::unique_ptr<rs_watcher> watcher;
 
 		// Notes: structure of the "topics" std::map is:
 		// topics = std::map<std::string, std::map..>{
@@ -62,27 +393,151 @@ class RiveScript {
 		void init (bool debug, int depth);
 
 		// Debug methods
-		void say (std::string line);
-		void warn (std::string line);
-		void warn (std::string line, std::string file, int lineno);
+		void say (const std::string &line);
+		void warn (const std::string &line);
+		void warn (const std::string &line, const std::string &file, int lineno);
+		rs_tracer &tracer ();
 
 		// Reply loading methods
 		bool loadDirectory (std::string folder);
 		bool loadFile (std::string file);
 		bool parse (std::string file,std::vector<std::string> code);
+		bool parse (const std::string &file, const std::vector<std::string_view> &code);
+		bool stream (std::string_view code);
+		bool endStream ();
+		bool _parse (const std::string &file, const std::vector<std::string_view> &code, rs_document &doc);
+		static rs_token _tokenize (std::string_view raw);
+		bool _parseLine (rs_parser &parser, const rs_token &token, char &cmd, std::string_view &line);
+		bool _parseCommand (rs_parser &parser, rs_document &doc, char cmd, std::string_view line);
+		void _streamLine (rs_stream &stream, std::string_view raw);
+		void _streamCommands (rs_stream &stream);
+		bool reloadFile (const std::string &file);
+		bool watchDirectory (const std::string &folder);
+		void unwatch ();
+		rs_brain &_stage ();
+		void _merge (const std::string &file, const std::shared_ptr<rs_document> &doc);
+		void _mergeDocument (rs_brain &brain, const rs_document &doc);
+		void _mergeDefinitions (rs_brain &brain, const rs_document &doc);
+		void _mergeTopic (const rs_document &doc, std::string_view name, rs_dict<rs_topic> &topics, rs_dict<rs_that_topic> &thats);
+		void _fold (const rs_document &from, rs_document &into);
+		static void _touched (const rs_document &doc, std::vector<std::string> &topics);
+		static bool _sameDefinitions (const rs_document *a, const rs_document *b);
+		bool _rebuild (const std::string &file, const std::shared_ptr<rs_document> &doc);
+		void _mergeTriggers (const rs_dict<rs_trigger> &from, rs_dict<rs_trigger> &into);
+		static bool _loadBefore (const std::string &a, const std::string &b);
+
+		// Snapshot methods
+		bool saveSnapshot (const std::string &path);
+		bool loadSnapshot (const std::string &path);
+		static uint64_t _sourceHash (const std::vector<std::string> &files, const std::vector<uint64_t> &hashes);
+		static void _writeTriggers (rs_snapshot_writer &out, const rs_dict<rs_trigger> &triggers);
+		bool _readTriggers (rs_snapshot_reader &in, rs_dict<rs_trigger> &triggers);
+
+		// Reply methods
+		typedef std::pair<std::string, std::string> rs_message; // User ID and message
+		std::string reply (const std::string &user, const std::string &message);
+		std::vector<std::string> replyBatch (const std::vector<rs_message> &messages);
+		std::vector<std::string> replyBatch (const rs_message *messages, size_t count);
+		static void seedRandom (uint64_t seed);
+		std::string _reply (const rs_brain &brain, const std::string &user, const std::string &message);
+		rs_pool &_workers ();
+		std::string getUservar (const std::string &user, const std::string &name);
+		void setUservar (const std::string &user, const std::string &name, const std::string &value);
+		rs_sessions &sessions ();
+		std::string _getReply (rs_call &call, const std::string &message, bool begin, int step);
+		std::string _formatMessage (const rs_brain &brain, const std::string &message);
+		bool _matchTrigger (rs_call &call, const rs_regex &regex, const std::string &pattern, const std::string &message, std::vector<std::string> &stars);
+		void _compileCondition (std::string_view line, rs_condition &condition);
+		void _compileOperand (const std::string &text, rs_operand &operand);
+		bool _checkCondition (rs_call &call, const rs_condition &condition, const std::vector<std::string> &stars, const std::vector<std::string> &botstars, int step);
+		std::string _operand (rs_call &call, const rs_operand &operand, const std::vector<std::string> &stars, const std::vector<std::string> &botstars, int step);
+		const rs_reply *_pickReply (const rs_trigger &trigger);
+		void _buildAlias (rs_trigger &trigger);
+		void _compileReply (std::string_view text, rs_reply &reply);
+		void _bindReplies (rs_brain &brain);
+		std::string _renderReply (rs_call &call, const rs_reply &reply, const std::vector<std::string> &stars, const std::vector<std::string> &botstars, int step);
+		std::string _processTags (rs_call &call, const std::string &reply, const std::vector<std::string> &stars, const std::vector<std::string> &botstars, int step);
+		void _finishTags (rs_call &call, std::string &reply, int step, bool calls);
+		static std::string _mathTag (rs_session &user, const std::string &tag, const std::string &name, const std::string &value);
+		std::string _callMacro (rs_call &call, const std::string &name, const std::vector<std::string> &args);
+		std::string _runMacro (rs_call &call, rs_macro_slot *slot, const std::string &name, const std::vector<std::string> &args);
+		static std::vector<std::string> _macroArgs (const std::string &text);
+		static std::string _stringFormat (const std::string &format, const std::string &text);
+		static std::string _history (const std::vector<std::string> &history, unsigned int index);
+		static std::string _history (const rs_ring<9> &history, unsigned int index);
+		static std::string _uservar (const rs_session &user, const std::string &name);
+
+		// Object macro methods
+		void setSubroutine (const std::string &name, rs_subroutine subroutine);
+		void setAsyncSubroutine (const std::string &name, rs_subroutine subroutine, unsigned int timeoutMs = 1000);
+		void setHandler (const std::string &lang, rs_handler handler);
+		rs_executor &macroExecutor ();
+		void _buildObjects (const rs_brain &brain);
+		void _bindMacros (rs_brain &brain);
+
+		// Substitution methods
+		void _compileSubs (rs_brain &brain);
+		std::string _substitute (const rs_brain &brain, std::string_view message, bool person);
+
+		// Sorting and indexing methods
+		void sortReplies ();
+		void sortReplies (unsigned int threads);
+		void _compileTables (rs_brain &brain, const rs_brain *previous);
+		void _internTopics (rs_brain &brain);
+		void _compileVariables (rs_brain &brain, const rs_brain *previous);
+		void _sortTouched (rs_brain &brain, const std::vector<std::string> &touched, unsigned int threads);
+		bool _rebind (const rs_brain &brain, rs_sorted &entry);
+		const rs_sorted_topic *_sortedTopic (const rs_brain &brain, std::string_view name);
+		const std::string *_botVar (const rs_brain &brain, std::string_view name);
+		const std::string *_globalVar (const rs_brain &brain, std::string_view name);
+		const rs_trie *_array (const rs_brain &brain, std::string_view name);
+		void _sortTopic (rs_brain &brain, uint32_t topic, rs_sorted_topic &out);
+		void _topicTriggers (const rs_brain &brain, uint32_t topic, int inherits, std::vector<rs_sorted> &out, std::vector<rs_sorted> &that, std::vector<uint32_t> &seen);
+		void _sortKeys (const rs_brain &brain, rs_sorted &entry);
+		bool _sortBefore (const rs_brain &brain, const rs_sorted &a, const rs_sorted &b);
+		void _buildIndex (rs_brain &brain, rs_sorted_topic &topic);
+		void _indexList (rs_brain &brain, const std::vector<rs_sorted> &list, bool that, rs_index &idx);
+		void _compileTopic (const rs_brain &brain, rs_sorted_topic &topic);
+		std::string _triggerRegexp (const rs_brain &brain, const std::string &trigger, bool &dynamic);
+		std::string _triggerRegexp (const rs_brain &brain, const std::string &trigger, size_t from, size_t to, bool capture, bool &dynamic);
+		static size_t _closeBracket (const std::string &text, size_t open, size_t to);
+		static std::string _quoteRegexp (const std::string &text);
+		static bool _matchRegexp (const rs_regex &regex, const std::string &message, std::vector<std::string> &stars);
+		rs_regex_cache &regexCache ();
+		std::vector<std::string> _literalWords (const std::string &trigger);
+		std::vector<const rs_sorted*> _candidates (const rs_brain &brain, const std::string &topic, const std::string &message);
+		std::vector<const rs_sorted*> _candidates (const rs_brain &brain, const rs_index &idx, const std::vector<rs_sorted> &list, const std::string &text);
+		const std::string &_lastReply (rs_call &call);
+
+		// Memory accounting methods
+		rs_memory_stats memoryStats ();
+		void setMemoryBudget (size_t bytes);
+		size_t memoryBudget ();
+		static void _memoryStats (const rs_brain &brain, rs_memory_stats &stats);
+		static rs_memory _topicMemory (const rs_topic &topic);
+		static rs_memory _triggerMemory (const rs_dict<rs_trigger> &triggers);
+		static size_t _replyBytes (const rs_reply &reply);
+		static size_t _flatMapBytes (const rs_flat_map<std::string> &table);
+		static size_t _flatMapBytes (const rs_flat_map<std::vector<unsigned int> > &table);
+		static size_t _documentBytes (const rs_document &doc);
+		static size_t _loadingBytes (const rs_document &doc);
+		static size_t _definitionBytes (const std::map<std::string, std::vector<std::string> > &arrays, const std::map<std::string, rs_object> &objects);
+		static size_t _loadedBytes (const rs_brain &brain);
+		size_t _budgetLeft (size_t freed);
+		bool _parseBudgeted (const std::string &file, const std::vector<std::string_view> &code, rs_document &doc, bool &ok, size_t freed);
 
 		// Debugging methods
 		void _dumpDefinitions ();
-		void _dumpDefinitions (std::string name, std::map<std::string, std::string> hash);
+		void _dumpDefinitions (const std::string &name, const std::map<std::string, std::string> &hash);
 		void _dumpTopics ();
 
 		// Util methods
 		std::string trim (const std::string &t);
 		std::string trim (const std::string &t, const std::string &ws);
-		int indexOf (std::string s, std::string match);
-		std::vector<std::string> split (std::string s, std::string delim, unsigned int pieces);
-		std::vector<std::string> split (std::string s, std::string delim);
-		std::string replace (std::string source, std::string search, std::string replace);
+		int indexOf (std::string_view s, std::string_view match);
+		std::vector<std::string> split (std::string_view s, std::string_view delim, unsigned int pieces);
+		std::vector<std::string> split (std::string_view s, std::string_view delim);
+		std::string replace (const std::string &source, const std::string &search, const std::string &replace);
 };
 
 /*************** POD Documentation for RiveScript.cpp **************************
@@ -130,6 +585,11 @@ Create a new instance of a RiveScript interpreter. Params:
 Load an entire directory full of RiveScript documents. Returns C<true> on
 success and C<false> on failure.
 
+The files are parsed concurrently, each into a document of its own, and then
+merged into the brain in a fixed order: C<begin.rive> (or C<begin.rs>) first,
+then the rest sorted by file name. The result is the same as loading them one
+at a time in that order, including C<E<lt>undefE<gt>> deletions.
+
   std::string path: Directory pathname where RS docs can be found.
 
 =item bool loadFile (std::string path)
@@ -139,32 +599,462 @@ failure.
 
   std::string path: Directory and file name of an RS document.
 
-=item bool stream (std::string code)
+The topics, triggers, replies and conditions that get loaded are all
+allocated out of a single arena owned by the current generation of the brain,
+and each document is parsed into an arena of its own before it's merged in.
+Replacing the brain (e.g. with C<loadSnapshot()>) frees the old generation's
+arena in one go. The parsed document is kept as well, for C<reloadFile()>
+(see below).
+
+=item bool reloadFile (std::string path)
+
+Load a new version of a document that was already loaded, without reloading
+the rest. Returns C<false> if the file can't be read or doesn't parse, in
+which case the version that was loaded before is kept and the live brain
+isn't touched. A file that wasn't loaded before is added, and one
+that no longer exists has everything it contributed taken out.
+
+Every document that's loaded is kept, parsed, under the name of the file it
+came from, and topics that several files add triggers to are put back
+together from all of them in load order. That costs memory: every trigger,
+reply and condition is held twice for as long as the brain is loaded, once
+in the document and once in the brain (C<memoryStats()> counts both, under
+C<documents> and C<topics>, and so does the memory budget). Generations
+share the documents, so it doesn't grow with each reload. So only the topics the old or new
+version of the file adds to are merged again, and only those (and any topics
+that include or inherit them) are sorted again; the rest of the sorted
+buffers carry over from the live brain. If the file's definitions (globals,
+bot variables, substitutions or arrays) changed, everything is sorted again,
+since those can end up in any trigger. A brain from C<loadSnapshot()> hasn't
+got its documents, so the first reload after one loads all of its sources
+again; if any of them won't load, nothing changes and C<false> is returned.
+
+=item bool watchDirectory (std::string path)
+
+=item void unwatch ()
+
+Watch a directory given to C<loadDirectory()> and C<reloadFile()> each file
+in it as it's written, moved in, moved out or deleted (hidden files and
+editor backups ending in C<~> are skipped). Changes are collected for a
+tenth of a second first, so saving a file counts once. Reloads happen on a
+thread of the watcher's own; replies carry on from the old brain until each
+one is done. Returns C<false> if the directory can't be watched; this needs
+inotify, so it always does on systems other than Linux. C<unwatch()> (or
+destroying the interpreter) stops watching.
+
+=item bool stream (std::string_view code)
 
 Stream some RiveScript code directly in from your C++ code. Returns C<true> on
 success and C<false> on failure.
 
-  std::string code: RiveScript code to parse.
+  std::string_view code: RiveScript code to parse.
+
+The code can come in any size of chunk, like reads from a socket: lines can
+be split across chunks, and a command and the ^Continue or %Previous lines
+that go with it can arrive separately. Only the unfinished line at the end of
+a chunk and the commands still waiting to see what follows them are kept
+between calls; each trigger goes into the brain as soon as the next one
+starts. Everything streamed in counts as one document, as if it had been
+loaded from a file.
+
+=item bool endStream ()
+
+Finish the stream: the last line needn't end in a newline, and whatever was
+still waiting goes into the brain. Returns C<false> if any of the stream
+failed to parse. C<sortReplies()> does this for you, so streaming in a brain
+and then sorting it is all it takes; a new C<stream()> after that starts a
+new document (back in the "random" topic).
 
 =item private bool parse (std::string[] code)
 
-Parse the lines of RiveScript code and make some sense out of them.
+=item private bool parse (std::string_view[] code)
+
+Parse the lines of RiveScript code and make some sense out of them. The
+C<string_view> variant parses the lines in place; text is only copied when it
+gets stored in the brain. C<loadFile()> memory-maps the document and uses
+this, so a file is never read into a second buffer first.
 
   std::string[] code: Array of lines of code.
 
 =back
 
+=head2 REGULAR EXPRESSIONS
+
+=over 4
+
+=item rs_regex_cache &regexCache ()
+
+The cache that every regular expression the interpreter uses is compiled
+through. It's bounded (1024 patterns by default; see C<setCapacity()>),
+thread-safe, keyed by pattern text and flags, and keeps C<hits()>,
+C<misses()> and C<evictions()> counters.
+
+Triggers and %Previous patterns are converted to regexps and compiled when the
+replies are sorted, and each sorted trigger holds on to its compiled pattern.
+The only ones that aren't are triggers containing C<E<lt>getE<gt>>,
+C<E<lt>inputE<gt>> or C<E<lt>replyE<gt>> tags, which depend on the user;
+those are looked up in the cache once the tags are filled in.
+
+An C<(@array)>, C<[@array]> or bare C<@array> in a trigger stands for any one
+of the array's items. Each array is compiled once per sort into a trie
+(C<rs_trie>) and spelled out as a regex with the items' shared prefixes
+factored out, so the engine only follows the items that agree with the
+message so far rather than trying all of them. Every trigger that uses the
+array shares it, and an array that hasn't changed is carried over to the next
+brain as it is.
+
+=back
+
+=head2 SNAPSHOTS
+
+=over 4
+
+=item bool saveSnapshot (std::string path)
+
+Write everything that has been loaded to a compact binary file: the topics,
+%Previous triggers, arrays, substitutions, globals, bot variables, objects,
+includes and inherits, and the sorted trigger buffers and index. Returns C<true> on
+success and C<false> on failure.
+
+The snapshot records the list of documents that were loaded along with a hash
+of their contents, and a checksum of the snapshot itself. The contents are
+hashed as each document is parsed, so a document that has changed on disk
+since it was loaded makes the snapshot stale straight away.
+
+=item bool loadSnapshot (std::string path)
+
+Replace the loaded brain with a snapshot written by C<saveSnapshot()>. The file
+is memory-mapped and read in a single pass; strings are copied straight out of
+the mapping and the sorted buffers are restored as-is, so no RiveScript code is
+parsed and nothing is re-sorted.
+
+Returns C<false> and leaves the current brain alone if the snapshot is
+corrupt, was written by a different snapshot version, or is stale (any of its
+source documents is missing or has changed since the snapshot was taken).
+
+=back
+
+=head2 SORTING
+
+=over 4
+
+=item void sortReplies ()
+
+=item void sortReplies (unsigned int threads)
+
+Sort the loaded triggers into match precedence order and build the trigger
+index. C<loadFile()> and C<loadDirectory()> call this for you once all of the
+documents are parsed; call it yourself if you C<parse()> code directly.
+
+Every topic (including C<__begin__>) gets a flat array of its triggers, along
+with those of the topics it includes or inherits, and a second array of its
+%Previous triggers. The order is:
+
+  1. Higher {weight} first.
+  2. Fewer "inherits" hops first (a topic's own triggers beat inherited ones).
+  3. Atomic (no wildcards), then [optionals], then _alpha, #number and
+     *wildcard triggers. Within each, more words first, then longer first.
+  4. Lone _, #, and * triggers last, in that order.
+
+Topics don't depend on each other, so they're sorted in parallel on a pool of
+C<threads> workers (default: one per CPU).
+
+Sorting also builds the lookup side of the brain: topic names, trigger texts,
+index words, variable names and array names are interned into dense integer
+IDs, and the sorted buffers, bot and global variables and arrays are stored in
+vectors and open-addressing tables keyed by those IDs. The C<std::map>s filled
+in by the parser stay around as the source of truth for merging and
+snapshots.
+
+Loading never changes the brain that replies come from. Documents are merged
+into a private copy of it, and C<sortReplies()> publishes that copy in one
+step once it's sorted; until then, C<reply()> carries on with the old brain.
+
+=item private std::vector<rs_sorted*> _candidates (rs_brain brain, std::string topic, std::string message)
+
+Return the sorted triggers in a topic that could possibly match the message:
+the ones whose literal words all appear in it, plus the purely wildcard ones,
+in precedence order. A literal word is a plain word that isn't inside an
+(alternation), an [optional] or a E<lt>tagE<gt> and isn't part of a wildcard.
+The message should already be normalized (lowercased, substitutions applied).
+
+=item private std::vector<rs_sorted*> _candidates (rs_brain brain, rs_index idx, std::vector<rs_sorted> list, std::string text)
+
+The same, for any sorted list and its index. Each topic's %Previous triggers
+have an index of their own, over the literal words of their %Previous text,
+and C<reply()> looks them up with the bot's last reply (formatted once per
+message). Only the candidates are tried, and a %Previous pattern that failed
+to match is not tried again for the rest of the message.
+
+=back
+
+=head2 REPLYING
+
+=over 4
+
+=item std::string reply (std::string user, std::string message)
+
+Get the bot's reply to a user's message. This covers the C<begin> block (and
+its C<{ok}>), topics with their includes and inherits, %Previous, @redirects,
+*conditions, weighted random replies, and the reply tags: the stars,
+C<E<lt>inputE<gt>>/C<E<lt>replyE<gt>> history, C<E<lt>idE<gt>>,
+C<E<lt>botE<gt>>, C<E<lt>envE<gt>>, C<E<lt>getE<gt>>, C<E<lt>setE<gt>>, the
+math tags, C<{random}>, C<{topic}>, C<{@}> and the person and string
+formatting tags, and C<E<lt>callE<gt>> for object macros (see below).
+
+C<reply()> may be called from any number of threads at once, including while
+another thread is loading. Each call pins the brain that's live when it
+starts and uses it to the end without taking any locks. A newly published
+brain takes over from the next call, and the old one is freed once the last
+reply still using it is done. Since the brain is shared and read-only, bot
+variables and globals can't be changed from within a reply (a
+C<E<lt>bot name=valueE<gt>> or C<E<lt>env name=valueE<gt>> tag is ignored
+with a warning).
+
+An object macro may load code and publish a new brain (say, with
+C<stream()> and C<sortReplies()>, or C<loadFile()> or C<reloadFile()>) while
+its reply is running. The new brain takes over straight away for everyone
+else, but the reply that called the macro carries on with the one it
+started with; the old brain is freed once its last reply ends, rather than
+being waited for (which would never end).
+
+Messages are normalized before they're matched: case-folded, run through the
+substitutions, then cut down to words (letters and digits) separated by
+single spaces. This understands UTF-8, so accented Latin, Greek, Cyrillic
+and Armenian capitals fold to lowercase, and letters in any script are kept
+while punctuation, symbols and Unicode spaces are not. Trigger text, arrays,
+substitutions and the values filled in for C<E<lt>botE<gt>> and
+C<E<lt>getE<gt>> are folded the same way. Plain ASCII is handled 16 or 32
+bytes at a time with SSE2 or AVX2, whichever the compiler targets.
+
+*Conditions are compiled when they're parsed: the operator is picked out, an
+operand that's a constant (converted to a number up front if it is one), a
+star, a history tag, C<E<lt>idE<gt>> or a single C<E<lt>getE<gt>>,
+C<E<lt>botE<gt>> or C<E<lt>envE<gt>> is looked up directly, and only other
+operands are run through the tags when the condition is checked.
+
+Replies are compiled when they're parsed too, into literal text and the tags
+in between: stars and history, C<E<lt>idE<gt>>, C<E<lt>getE<gt>>,
+C<E<lt>setE<gt>>, C<E<lt>botE<gt>> and C<E<lt>envE<gt>> (bound to their
+variables' IDs when the replies are sorted), the math tags, C<{random}> and
+the person and string formats, and C<E<lt>callE<gt>> (see below). Rendering one is a single pass that appends
+each piece to a buffer of the thread's own. A reply with tags nested inside
+tags, or a value that has tags of its own in it, is expanded by
+C<_processTags()> instead, as before.
+
+Each reply works on a copy of the user's variables and history and saves it
+when it's done. If two replies for the same user overlap, the last one to
+finish wins.
+
+=item std::vector<std::string> replyBatch (std::vector<rs_message> messages)
+
+=item std::vector<std::string> replyBatch (rs_message *messages, size_t count)
+
+Reply to a batch of messages at once, e.g. one read off a queue. Each
+C<rs_message> is a pair of user ID and message, and the replies come back in
+the same order. (The pointer variant stands in for a C<std::span>.)
+
+The whole batch is answered from the same brain, and is spread over a pool of
+workers (one per CPU) that the interpreter keeps for batches: first every
+message is formatted and substituted, in even slices, and then each user's
+messages are answered in the order they appear in the batch, while different
+users' are answered side by side. The pool is work-stealing, so a user with
+many messages doesn't hold up the rest of the workers. It's started by the
+first batch, and several threads may send batches at once.
+
+=item static void seedRandom (uint64_t seed)
+
+Seed the random choices (weighted replies and C<{random}>) for repeatable
+replays. Every thread draws from a generator of its own, which is seeded
+from C<std::random_device> at first and picks up the new seed the next time
+it's used. Each thread mixes in a turn number, counted from 0 in the order
+the threads make their first draw after the call, so their sequences differ
+from one another. A single thread that sends the same messages after each
+call gets the same replies; with several (C<replyBatch()>'s workers, say),
+who gets which turn depends on scheduling, so a replay is only exact if the
+threads make their first draws in a fixed order. The seed is shared by all
+interpreters in the process.
+
+A trigger's replies are chosen with a Walker alias table over their
+C<{weight}>s, built when the replies are sorted: one draw, whatever the
+weights add up to.
+
+=item std::string getUservar (std::string user, std::string name)
+
+=item void setUservar (std::string user, std::string name, std::string value)
+
+Get or set one of a user's variables. C<getUservar()> returns C<undefined> if
+the variable (or the user) isn't there.
+
+=item rs_sessions &sessions ()
+
+The store that users' variables and history are kept in. It's split into 64
+shards by a hash of the user ID, each with its own lock, so replies to
+different users don't wait on each other. A user's last 9 messages and
+replies are kept in fixed rings inside their session rather than in growing
+lists.
+
+By default it grows without bound. C<setLimit(bytes)> caps roughly how much
+memory it may use, and C<setIdle(seconds)> how long a user may go unheard
+from; each shard evicts its least recently used users to stay within them.
+Idle users are evicted as their shard is used, or all at once by
+C<expire()>. C<onEvict(handler)> is called with each evicted user's ID and
+session (outside the store's locks), e.g. to spill them to a database, and
+C<size()>, C<bytes()> and C<evictions()> count what's there.
+
+=back
+
+=head2 OBJECT MACROS
+
+=over 4
+
+=item void setSubroutine (std::string name, rs_subroutine subroutine)
+
+Define an object macro in C++. An C<rs_subroutine> is called with the
+interpreter, the ID of the user being replied to and the arguments from the
+C<E<lt>callE<gt>> tag (split on spaces, except inside "double quotes"), and
+returns the text that replaces the tag:
+
+  rs.setSubroutine("reverse", [] (RiveScript &rs, const std::string &user,
+          const std::vector<std::string> &args) {
+      std::string text = args.size() > 0 ? args[0] : "";
+      return std::string(text.rbegin(), text.rend());
+  });
+
+  + reverse *
+  - <call>reverse "<star>"</call>
+
+It takes effect straight away, even for a brain that's already loaded, and
+replaces any macro of the same name. An empty C<subroutine> removes it.
+
+=item void setAsyncSubroutine (std::string name, rs_subroutine subroutine, unsigned int timeoutMs = 1000)
+
+The same, for a macro that does slow work (like a network call). It runs on a
+bounded executor rather than on the thread that's replying, which waits at
+most C<timeoutMs> for it and otherwise uses C<[ERR: Object Timed Out]> (the
+macro still finishes, but its result is thrown away). If the executor's
+queue is full the call is turned away with C<[ERR: Object Busy]>, so slow
+macros can't pile up behind each other or tie up the threads replies run on.
+
+=item rs_executor &macroExecutor ()
+
+The executor that async macros run on: 4 threads and room for 64 more calls
+waiting, by default. C<setLimits(threads, capacity)> changes that before the
+first async call, and C<rejected()> counts the calls that were turned away.
+
+=item void setHandler (std::string lang, rs_handler handler)
+
+Give object code in a programming language a way to run. The code between
+C<E<gt> object name lang> and C<E<lt> object> is kept as-is, and when the
+replies are sorted, the handler for its language is called with its name and
+code and returns the C<rs_subroutine> to run for it (or an empty one if it
+can't). Objects in a language without a handler give C<[ERR: Object Not
+Found]>. A subroutine set with C<setSubroutine()> takes precedence over object
+code with the same name.
+
+A C<E<lt>callE<gt>> whose name and arguments are written out in the reply is
+compiled along with the rest of it: the arguments are split once, and the
+call is bound to its macro's slot when the replies are sorted, so calling it
+goes straight to the macro. Calls still run last, after C<{topic}> and
+C<{@}>, in the order they're written. Only a name or arguments that come
+from another tag, like C<E<lt>callE<gt>E<lt>starE<gt>E<lt>/callE<gt>>, are
+split and looked up by name when the reply is given.
+
+=back
+
+=head2 MEMORY
+
+=over 4
+
+=item rs_memory_stats memoryStats ()
+
+Report how much memory the live brain takes, read in place (nothing is
+copied). Each figure is an C<rs_memory>: C<bytes>, which counts the objects
+and everything they point to, and C<objects>, which counts what they're made
+of (triggers, array items, variables and so on). The figures are broken down
+three ways:
+
+  structures: "topics", "thats", "arrays", "subs", "person", "globals",
+              "bot", "objects", "symbols", "sorted" and "documents"
+  topics:     by topic name, with the topic's %Previous triggers included
+  files:      by file, for the document it was parsed into
+
+C<total> adds up the whole brain. The topics and %Previous triggers are
+counted at the size of the arena they live in (C<arenaReserved>, with
+C<arenaUsed> of it handed out), and everything else at its own size. Sizes
+are estimates: the heap's own bookkeeping isn't counted, and neither are the
+compiled regexes, since the regex cache shares them between brains. A brain
+from C<loadSnapshot()> has no documents, so its C<files> are empty.
+
+=item void setMemoryBudget (size_t bytes)
+
+=item size_t memoryBudget ()
+
+Cap how big the loaded brain may get (0, the default, for no cap). Loading
+that would take it over the budget fails: C<loadFile()>, C<loadDirectory()>,
+C<reloadFile()> and C<parse()> return C<false> with a warning, and nothing is
+merged from the file (or, for C<loadDirectory()>, from any of the directory's
+files). A reloaded file may use what the version it replaces did; when a
+reload has to load every source again, they all have to fit.
+Each document's arena is capped at what's left of the budget while it's
+parsed, so an oversized file fails part way through instead of using up the
+machine's memory. The budget covers what's loaded (the brain's arena, its
+definitions and the documents it keeps) and not what C<sortReplies()>
+compiles from it.
+
+=back
+
+=head2 TRACING
+
+=over 4
+
+=item rs_tracer &tracer ()
+
+Everything the interpreter has to say goes through its tracer as an event
+with a level (C<RS_TRACE_WARN>, C<RS_TRACE_INFO> or C<RS_TRACE_DEBUG>), the
+source file and line it came from, a phase (C<load>, C<parse>, C<sort>,
+C<snapshot> or C<reply>), and its message. Loading, sorting, snapshots and
+replies are each also recorded as one C<RS_TRACE_INFO> event with how long
+they took.
+
+C<setLevel()> picks how much is traced; it's C<RS_TRACE_WARN> to start with,
+or C<RS_TRACE_DEBUG> in debug mode. A trace point whose level isn't enabled
+costs one atomic load: its message isn't even built. Building with
+C<-DRS_NO_TRACE> compiles the trace points out altogether.
+
+Events are kept in a bounded, lock-free ring buffer (1024 events), which
+C<drain(event)> takes them out of one at a time, oldest first; it's safe to
+call from another thread while replies are going on, e.g. to feed them to a
+logging pipeline. Tracing never waits: when the ring is full new events are
+dropped, and C<dropped()> counts them. C<setEcho()> also prints events up to a
+level to the terminal as they happen, which by default is the same as the
+tracing level.
+
+=back
+
 =head2 PRIVATE METHODS
 
 =over 4
 
+=item std::string _substitute (std::string_view message, bool person)
+
+Run the C<! sub> substitutions (or the C<! person> ones, if C<person> is true)
+over a message. Substitutions only match whole words, ones with more words and
+then longer ones win over shorter ones, and text that was substituted in is
+never substituted again.
+
+Both sets are compiled into a multi-pattern matcher by C<_compileSubs()>
+whenever the brain is loaded, so all of the substitutions are applied in a
+single pass over the message.
+
 =item void say (std::string line)
 
 =item void warn (std::string line)
 
-Debug methods. C<say()> prints a line of verbose debug text to the terminal when
-debug mode is active; C<warn()> prints a line to the terminal when a warning
-pops up whether or not debug mode is active.
+Debug methods. C<say()> traces a line of verbose debug text (at
+C<RS_TRACE_DEBUG>), and C<warn()> a warning (at C<RS_TRACE_WARN>). Inside the
+interpreter, use the C<RS_SAY> and C<RS_WARN> macros instead, so the message is
+only put together if it's going to be traced.
 
 =back
 
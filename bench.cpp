@@ -0,0 +1,556 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include "RiveScript.h"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+
+// RiveScript benchmarks. Loads the demo brains and a range of generated ones,
+// and reports how long loading takes, how many allocations it makes, peak
+// memory, and reply latency at a range of thread counts.
+//
+// Usage: bench [options]
+//   --triggers=1000,10000,100000  Sizes of generated brain to run
+//   --threads=1,2,4,8             Thread counts to time replies at
+//   --replies=20000               Replies per thread count
+//   --batch=256                   Messages per replyBatch() call (0 to skip)
+//   --wildcards=0.3               Share of triggers with a wildcard
+//   --arrays=0.05                 Share of triggers with an array
+//   --previous=0.05               Share of triggers with a %Previous
+//   --conditions=0.05             Share of triggers with conditions
+//   --topics=10                   Topics to spread the triggers over
+//   --seed=1                      For the generator and the messages
+//   --keep                        Leave the generated brains in /tmp
+//   --fixtures-only               Skip the generated brains
+
+/******************************************************************************
+ * Allocation Counting                                                        *
+ ******************************************************************************/
+
+static std::atomic<unsigned long> allocations (0);
+static std::atomic<unsigned long> allocated (0);
+
+static void *counted (size_t size, size_t alignment) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated.fetch_add(size, std::memory_order_relaxed);
+	void *p;
+	if (alignment > alignof(std::max_align_t)) {
+		p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	}
+	else {
+		p = malloc(size > 0 ? size : 1);
+	}
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new (size_t size) { return counted(size, 0); }
+void *operator new[] (size_t size) { return counted(size, 0); }
+void *operator new (size_t size, std::align_val_t align) { return counted(size, (size_t)align); }
+void *operator new[] (size_t size, std::align_val_t align) { return counted(size, (size_t)align); }
+void operator delete (void *p) noexcept { free(p); }
+void operator delete[] (void *p) noexcept { free(p); }
+void operator delete (void *p, size_t) noexcept { free(p); }
+void operator delete[] (void *p, size_t) noexcept { free(p); }
+void operator delete (void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[] (void *p, std::align_val_t) noexcept { free(p); }
+void operator delete (void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[] (void *p, size_t, std::align_val_t) noexcept { free(p); }
+
+/******************************************************************************
+ * Options                                                                    *
+ ******************************************************************************/
+
+struct options {
+	vector<unsigned long> triggers;
+	vector<unsigned int> threads;
+	unsigned long replies;
+	unsigned long batch;
+	double wildcards;
+	double arrays;
+	double previous;
+	double conditions;
+	unsigned int topics;
+	unsigned int seed;
+	bool keep;
+	bool fixturesOnly;
+};
+
+static vector<unsigned long> numbers (const string &list) {
+	vector<unsigned long> out;
+	std::stringstream in (list);
+	string item;
+	while (getline(in, item, ',')) {
+		out.push_back(strtoul(item.c_str(), NULL, 10));
+	}
+	return out;
+}
+
+static bool parseOptions (int argc, char **argv, options &opts) {
+	opts.triggers     = vector<unsigned long>({ 1000, 10000, 100000 });
+	opts.threads      = vector<unsigned int>({ 1, 2, 4, 8 });
+	opts.replies      = 20000;
+	opts.batch        = 256;
+	opts.wildcards    = 0.3;
+	opts.arrays       = 0.05;
+	opts.previous     = 0.05;
+	opts.conditions   = 0.05;
+	opts.topics       = 10;
+	opts.seed         = 1;
+	opts.keep         = false;
+	opts.fixturesOnly = false;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string name = arg.substr(0, eq);
+		string value = eq != string::npos ? arg.substr(eq + 1) : "";
+		if (name == "--triggers") {
+			opts.triggers = numbers(value);
+		}
+		else if (name == "--threads") {
+			vector<unsigned long> list = numbers(value);
+			opts.threads.assign(list.begin(), list.end());
+		}
+		else if (name == "--replies") {
+			opts.replies = strtoul(value.c_str(), NULL, 10);
+		}
+		else if (name == "--wildcards") {
+			opts.wildcards = strtod(value.c_str(), NULL);
+		}
+		else if (name == "--arrays") {
+			opts.arrays = strtod(value.c_str(), NULL);
+		}
+		else if (name == "--previous") {
+			opts.previous = strtod(value.c_str(), NULL);
+		}
+		else if (name == "--conditions") {
+			opts.conditions = strtod(value.c_str(), NULL);
+		}
+		else if (name == "--topics") {
+			opts.topics = std::max(1ul, strtoul(value.c_str(), NULL, 10));
+		}
+		else if (name == "--batch") {
+			opts.batch = strtoul(value.c_str(), NULL, 10);
+		}
+		else if (name == "--seed") {
+			opts.seed = strtoul(value.c_str(), NULL, 10);
+		}
+		else if (name == "--keep") {
+			opts.keep = true;
+		}
+		else if (name == "--fixtures-only") {
+			opts.fixturesOnly = true;
+		}
+		else {
+			std::cerr << "Unknown option " << arg << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+/******************************************************************************
+ * Synthetic Brains                                                           *
+ ******************************************************************************/
+
+// A word that's unique to trigger "n".
+static string keyword (unsigned long n) {
+	string word = "k";
+	do {
+		word += "abcdefghijklmnopqrstuvwxyz"[n % 26];
+		n /= 26;
+	} while (n > 0);
+	return word;
+}
+
+// Write a brain of "count" triggers into "dir", 10,000 triggers to a file.
+// Every trigger has a word of its own, so a message can be made to match
+// any one of them.
+static void generate (const string &dir, unsigned long count, const options &opts) {
+	std::mt19937 rng (opts.seed);
+	std::uniform_real_distribution<double> roll (0.0, 1.0);
+	const unsigned int arrays = 20;
+	const unsigned long perFile = 10000;
+
+	for (unsigned long first = 0; first < count; first += perFile) {
+		std::ofstream out (dir + "/brain" + std::to_string(first / perFile) + ".rive");
+		if (first == 0) {
+			out << "! version = 2.0\n\n";
+			out << "! var name = Bench\n";
+			for (unsigned int a = 0; a < arrays; a++) {
+				out << "! array colors" << a << " = red blue green yellow light" << a << " dark" << a << "\n";
+			}
+			out << "\n+ *\n- I don't follow.\n\n";
+		}
+
+		unsigned long last = std::min(count, first + perFile);
+		for (unsigned long i = first; i < last; i++) {
+			string word = keyword(i);
+			unsigned int topic = i % opts.topics;
+			bool inTopic = topic > 0;
+			if (inTopic) {
+				out << "> topic t" << topic << " includes random\n";
+			}
+
+			double kind = roll(rng);
+			if (kind < opts.wildcards) {
+				out << "+ tell me about " << word << " *\n";
+				out << "- You want to know about <star> and " << word << ".\n";
+				out << "- <star> is a fine thing to ask about.\n";
+			}
+			else if (kind < opts.wildcards + opts.arrays) {
+				out << "+ " << word << " is (@colors" << i % arrays << ")\n";
+				out << "- So " << word << " is <star>?\n";
+			}
+			else if (kind < opts.wildcards + opts.arrays + opts.previous) {
+				out << "+ ask me about " << word << "\n";
+				out << "- Do you like " << word << "?\n\n";
+				out << "+ yes\n";
+				out << "% do you like " << word << "\n";
+				out << "- I thought so.\n";
+			}
+			else if (kind < opts.wildcards + opts.arrays + opts.previous + opts.conditions) {
+				out << "+ what about " << word << "\n";
+				out << "* <get mood> == happy => Good for " << word << "!\n";
+				out << "* <get mood> == sad => Sorry about " << word << ".\n";
+				out << "- <set mood=happy>Let's talk about " << word << ".\n";
+			}
+			else {
+				out << "+ what is " << word << "\n";
+				out << "- " << word << " is number " << i << ".\n";
+			}
+
+			if (inTopic) {
+				out << "< topic\n";
+			}
+			out << "\n";
+		}
+	}
+}
+
+static void removeDirectory (const string &dir) {
+	DIR *dp = opendir(dir.c_str());
+	if (dp != NULL) {
+		struct dirent *entry;
+		while ((entry = readdir(dp)) != NULL) {
+			string name = entry->d_name;
+			if (name != "." && name != "..") {
+				unlink((dir + "/" + name).c_str());
+			}
+		}
+		closedir(dp);
+	}
+	rmdir(dir.c_str());
+}
+
+/******************************************************************************
+ * Messages                                                                   *
+ ******************************************************************************/
+
+// Turn a trigger into a message that should match it, or "" for triggers
+// with tags in them.
+static string sample (const string &trigger) {
+	string out;
+	for (size_t i = 0; i < trigger.length(); i++) {
+		char c = trigger[i];
+		if (c == '*') {
+			out += "something";
+		}
+		else if (c == '#') {
+			out += "42";
+		}
+		else if (c == '_') {
+			out += "word";
+		}
+		else if (c == '[') {
+			// Leave optionals out.
+			size_t end = trigger.find(']', i);
+			if (end == string::npos) {
+				return "";
+			}
+			i = end;
+		}
+		else if (c == '(') {
+			// Take the first alternative. For arrays, "red" is in every
+			// generated one (and in plenty of real ones).
+			size_t end = trigger.find(')', i);
+			if (end == string::npos) {
+				return "";
+			}
+			string group = trigger.substr(i + 1, end - i - 1);
+			out += group[0] == '@' ? "red" : group.substr(0, group.find('|'));
+			i = end;
+		}
+		else if (c == '<' || c == '{' || c == '@') {
+			return "";
+		}
+		else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+// Messages for a brain: one for every trigger in "files" that can be filled
+// in, plus a tenth as many again that won't match anything.
+static vector<string> messages (const vector<string> &files, unsigned int seed) {
+	vector<string> out;
+	for (size_t f = 0; f < files.size(); f++) {
+		std::ifstream in (files[f]);
+		string line;
+		vector<string> pending; // The last trigger's message, until we know it has no %Previous
+		while (getline(in, line)) {
+			size_t start = line.find_first_not_of(" \t");
+			if (start == string::npos) {
+				continue;
+			}
+			line = line.substr(start);
+			if (line[0] == '+') {
+				for (size_t i = 0; i < pending.size(); i++) {
+					out.push_back(pending[i]);
+				}
+				pending.clear();
+				string message = sample(line.substr(line.find_first_not_of(" \t", 1)));
+				if (message.length() > 0) {
+					pending.push_back(message);
+				}
+			}
+			else if (line[0] == '%') {
+				pending.clear();
+			}
+		}
+		out.insert(out.end(), pending.begin(), pending.end());
+	}
+
+	std::mt19937 rng (seed);
+	std::shuffle(out.begin(), out.end(), rng);
+	size_t misses = out.size() / 10 + 1;
+	for (size_t i = 0; i < misses; i++) {
+		out.push_back("this sentence matches nothing in particular " + std::to_string(i));
+	}
+	std::shuffle(out.begin(), out.end(), rng);
+	return out;
+}
+
+static vector<string> riveFiles (const string &dir) {
+	vector<string> files;
+	DIR *dp = opendir(dir.c_str());
+	if (dp == NULL) {
+		return files;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dp)) != NULL) {
+		string name = entry->d_name;
+		if (name.length() > 5 && name.substr(name.length() - 5) == ".rive") {
+			files.push_back(dir + "/" + name);
+		}
+	}
+	closedir(dp);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+static unsigned long countLines (const vector<string> &files) {
+	unsigned long lines = 0;
+	for (size_t f = 0; f < files.size(); f++) {
+		std::ifstream in (files[f]);
+		string line;
+		while (getline(in, line)) {
+			lines++;
+		}
+	}
+	return lines;
+}
+
+/******************************************************************************
+ * Benchmarks                                                                 *
+ ******************************************************************************/
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds (bench_clock::duration d) {
+	return std::chrono::duration<double>(d).count();
+}
+
+static long peakRss () {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss; // KiB on Linux
+}
+
+static double percentile (const vector<double> &sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Load a brain (from a directory, or a single file), and time replies to
+// messages made from its triggers.
+static void run (const string &path, bool directory, const string &name, const options &opts) {
+	vector<string> files = directory ? riveFiles(path) : vector<string>({ path });
+	vector<string> msgs = messages(files, opts.seed);
+	unsigned long lines = countLines(files);
+
+	// The sort happens inside the load, so it's timed by the tracer.
+	RiveScript rs (false, 50);
+	rs.tracer().setEcho(RS_TRACE_NONE);
+	rs.tracer().setLevel(RS_TRACE_INFO);
+
+	unsigned long allocs = allocations.load();
+	unsigned long bytes = allocated.load();
+	bench_clock::time_point start = bench_clock::now();
+	if (directory) {
+		rs.loadDirectory(path);
+	}
+	else {
+		rs.loadFile(path);
+	}
+	double loadTime = seconds(bench_clock::now() - start);
+	allocs = allocations.load() - allocs;
+	bytes = allocated.load() - bytes;
+
+	double sortTime = 0;
+	rs_trace_event event;
+	while (rs.tracer().drain(event)) {
+		if (strcmp(event.phase, "sort") == 0 && event.duration > 0) {
+			sortTime += event.duration / 1e9;
+		}
+	}
+	rs.tracer().setLevel(RS_TRACE_WARN);
+
+	double parseTime = loadTime - sortTime;
+	printf("== %s: %zu files, %lu lines, %zu messages\n", name.c_str(), files.size(), lines, msgs.size());
+	printf("  load   %10.2f ms parse + %.2f ms sort = %.2f ms\n",
+		parseTime * 1000, sortTime * 1000, loadTime * 1000);
+	printf("  parse  %10.0f lines/sec\n", parseTime > 0 ? lines / parseTime : 0);
+	printf("  allocs %10lu (%lu bytes) to load and sort\n", allocs, bytes);
+	printf("  rss    %10ld KiB peak so far\n", peakRss());
+
+	printf("  %7s %12s %10s %10s %10s %12s\n", "threads", "replies/sec", "p50 us", "p99 us", "p999 us", "allocs/reply");
+	for (size_t t = 0; t < opts.threads.size(); t++) {
+		unsigned int threads = std::max(1u, opts.threads[t]);
+		unsigned long each = std::max(1ul, opts.replies / threads);
+		vector< vector<double> > latencies (threads);
+
+		allocs = allocations.load();
+		start = bench_clock::now();
+		vector<std::thread> workers;
+		for (unsigned int w = 0; w < threads; w++) {
+			workers.emplace_back([&, w]() {
+				vector<double> &mine = latencies[w];
+				mine.reserve(each);
+				for (unsigned long i = 0; i < each; i++) {
+					// Spread each thread over its own users and the topics.
+					string user = "t" + std::to_string(w) + "u" + std::to_string(i % 100);
+					const string &msg = msgs[(w * 7919 + i) % msgs.size()];
+					if (i < 100 && i % opts.topics > 0) {
+						rs.setUservar(user, "topic", "t" + std::to_string(i % opts.topics));
+					}
+					bench_clock::time_point before = bench_clock::now();
+					rs.reply(user, msg);
+					mine.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - before).count());
+				}
+			});
+		}
+		for (size_t w = 0; w < workers.size(); w++) {
+			workers[w].join();
+		}
+		double elapsed = seconds(bench_clock::now() - start);
+		allocs = allocations.load() - allocs;
+
+		vector<double> all;
+		for (unsigned int w = 0; w < threads; w++) {
+			all.insert(all.end(), latencies[w].begin(), latencies[w].end());
+		}
+		std::sort(all.begin(), all.end());
+		printf("  %7u %12.0f %10.1f %10.1f %10.1f %12.1f\n", threads, all.size() / elapsed,
+			percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999),
+			(double)allocs / all.size());
+	}
+
+	// The same again through replyBatch() from one thread, which spreads each
+	// batch over the interpreter's own workers. Latencies are per batch.
+	if (opts.batch > 0) {
+		vector<RiveScript::rs_message> batch;
+		vector<double> latencies;
+		unsigned long sent = 0;
+		allocs = allocations.load();
+		start = bench_clock::now();
+		for (unsigned long i = 0; i < opts.replies; i++) {
+			batch.push_back(RiveScript::rs_message("b" + std::to_string(i % 400), msgs[(i * 7919) % msgs.size()]));
+			if (batch.size() == opts.batch || i + 1 == opts.replies) {
+				bench_clock::time_point before = bench_clock::now();
+				rs.replyBatch(batch);
+				latencies.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - before).count());
+				sent += batch.size();
+				batch.clear();
+			}
+		}
+		double elapsed = seconds(bench_clock::now() - start);
+		allocs = allocations.load() - allocs;
+
+		std::sort(latencies.begin(), latencies.end());
+		printf("  %7s %12.0f %10.1f %10.1f %10.1f %12.1f  (batches of %lu)\n", "batch", sent / elapsed,
+			percentile(latencies, 0.50), percentile(latencies, 0.99), percentile(latencies, 0.999),
+			(double)allocs / sent, opts.batch);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main (int argc, char **argv) {
+	options opts;
+	if (!parseOptions(argc, argv, opts)) {
+		return 1;
+	}
+
+	// The real-world fixtures.
+	run("demo/testsuite.rive", false, "demo/testsuite.rive", opts);
+	run("demo2", true, "demo2", opts);
+	if (opts.fixturesOnly) {
+		return 0;
+	}
+
+	// Generated brains, smallest first so the peak RSS means something.
+	std::sort(opts.triggers.begin(), opts.triggers.end());
+	for (size_t i = 0; i < opts.triggers.size(); i++) {
+		char dir[] = "/tmp/rsbench.XXXXXX";
+		if (mkdtemp(dir) == NULL) {
+			std::cerr << "Can't make a temporary directory" << endl;
+			return 1;
+		}
+		generate(dir, opts.triggers[i], opts);
+		run(dir, true, "synthetic " + std::to_string(opts.triggers[i]) + " triggers", opts);
+		if (opts.keep) {
+			cout << "Kept the brain in " << dir << endl << endl;
+		}
+		else {
+			removeDirectory(dir);
+		}
+	}
+
+	return 0;
+}
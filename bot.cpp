@@ -33,8 +33,7 @@ int main () {
 			return 0;
 		}
 
-		//string reply = rs.reply("localuser", input);
-		string reply = "To Do";
+		string reply = rs.reply("localuser", input);
 
 		cout << "Bot> " << reply << endl;
 	}
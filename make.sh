@@ -1,3 +1,6 @@
 #!/bin/bash
 
-g++ -Iinclude -lboost_regex -o bot bot.cpp RiveScript.h RiveScript.cpp
+SOURCES="RiveScript.cpp rs_pool.cpp rs_mmap.cpp rs_snapshot.cpp rs_substituter.cpp rs_regex_cache.cpp rs_symbols.cpp rs_arena.cpp rs_sessions.cpp rs_trace.cpp rs_watcher.cpp rs_macros.cpp rs_trie.cpp rs_normalize.cpp"
+
+g++ -std=c++17 -pthread -Iinclude -o bot bot.cpp $SOURCES -lboost_regex
+g++ -std=c++17 -O2 -pthread -Iinclude -o bench bench.cpp $SOURCES -lboost_regex
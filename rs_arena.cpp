@@ -0,0 +1,65 @@
+#include <new>
+
+#include "rs_arena.h"
+
+rs_arena::rs_arena (size_t initial)
+	: buffer(initial, &heap), usedBytes(0) {
+}
+
+void rs_arena::release () {
+	buffer.release();
+	usedBytes = 0;
+}
+
+size_t rs_arena::used () const {
+	return usedBytes;
+}
+
+size_t rs_arena::reserved () const {
+	return heap.bytes;
+}
+
+size_t rs_arena::blocks () const {
+	return heap.blocks;
+}
+
+void rs_arena::setLimit (size_t bytes) {
+	heap.limit = bytes;
+}
+
+void *rs_arena::do_allocate (size_t bytes, size_t alignment) {
+	usedBytes += bytes;
+	return buffer.allocate(bytes, alignment);
+}
+
+void rs_arena::do_deallocate (void * /* p */, size_t /* bytes */, size_t /* alignment */) {
+	// Nothing is freed until the whole arena is.
+}
+
+bool rs_arena::do_is_equal (const std::pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
+
+rs_arena::rs_arena_heap::rs_arena_heap ()
+	: bytes(0), blocks(0), limit(0) {
+}
+
+void *rs_arena::rs_arena_heap::do_allocate (size_t size, size_t alignment) {
+	if (limit > 0 && bytes + size > limit) {
+		throw std::bad_alloc();
+	}
+	void *p = std::pmr::new_delete_resource()->allocate(size, alignment);
+	bytes += size;
+	blocks++;
+	return p;
+}
+
+void rs_arena::rs_arena_heap::do_deallocate (void *p, size_t size, size_t alignment) {
+	std::pmr::new_delete_resource()->deallocate(p, size, alignment);
+	bytes -= size;
+	blocks--;
+}
+
+bool rs_arena::rs_arena_heap::do_is_equal (const std::pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
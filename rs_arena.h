@@ -0,0 +1,78 @@
+#ifndef _rs_arena_h
+#define _rs_arena_h
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory_resource>
+#include <tuple>
+#include <utility>
+
+// Containers for the parsed brain. They allocate through whatever arena the
+// outermost container was built with, so a topic, its triggers and all of
+// their text end up in the same arena.
+typedef std::pmr::string rs_text;
+template <class T> using rs_list = std::pmr::vector<T>;
+template <class T> using rs_dict = std::pmr::map<rs_text, T, std::less<> >;
+
+// A monotonic arena. Memory is taken from the heap in growing blocks and
+// handed out by bumping a pointer; freeing an individual object does
+// nothing, and everything goes back to the heap at once when the arena is
+// destroyed or released. Not thread-safe.
+class rs_arena : public std::pmr::memory_resource {
+	public:
+		rs_arena (size_t initial = 16 * 1024);
+
+		// Give every block back to the heap. Anything still pointing into
+		// the arena is left dangling.
+		void release ();
+
+		// Counters.
+		size_t used () const;     // Bytes handed out
+		size_t reserved () const; // Bytes taken from the heap
+		size_t blocks () const;   // Blocks taken from the heap
+
+		// Cap what the arena may take from the heap (0, the default, for no
+		// cap). An allocation that would need a block past the cap throws
+		// std::bad_alloc, like running out of memory would.
+		void setLimit (size_t bytes);
+
+	private:
+		rs_arena (const rs_arena &);            // Not copyable
+		rs_arena &operator= (const rs_arena &);
+
+		void *do_allocate (size_t bytes, size_t alignment);
+		void do_deallocate (void *p, size_t bytes, size_t alignment);
+		bool do_is_equal (const std::pmr::memory_resource &other) const noexcept;
+
+		// Counts what the arena takes from the heap.
+		class rs_arena_heap : public std::pmr::memory_resource {
+			public:
+				rs_arena_heap ();
+				size_t bytes;
+				size_t blocks;
+				size_t limit;
+			private:
+				void *do_allocate (size_t bytes, size_t alignment);
+				void do_deallocate (void *p, size_t bytes, size_t alignment);
+				bool do_is_equal (const std::pmr::memory_resource &other) const noexcept;
+		};
+
+		rs_arena_heap heap;
+		std::pmr::monotonic_buffer_resource buffer;
+		size_t usedBytes;
+};
+
+// Find "key" in a dictionary, adding a default entry (in the dictionary's
+// arena) if it isn't there yet. The rs_dict version of map::operator[].
+template <class T>
+T &rs_slot (rs_dict<T> &dict, std::string_view key) {
+	typename rs_dict<T>::iterator it = dict.find(key);
+	if (it == dict.end()) {
+		it = dict.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first;
+	}
+	return it->second;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _rs_flat_map_h
+#define _rs_flat_map_h
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+// An open-addressing (linear probing) hash table keyed by symbol IDs (see
+// rs_symbols). Keys and values live in two flat arrays, so a lookup is a hash,
+// a multiply and usually a single cache line.
+template <class V>
+class rs_flat_map {
+	public:
+		static constexpr uint32_t empty = 0xFFFFFFFF;
+
+		rs_flat_map () : keys(8, empty), values(8), count(0) {}
+
+		const V *find (uint32_t key) const {
+			size_t mask = keys.size() - 1;
+			for (size_t i = slot(key); ; i = (i + 1) & mask) {
+				if (keys[i] == key) {
+					return &values[i];
+				}
+				if (keys[i] == empty) {
+					return NULL;
+				}
+			}
+		}
+
+		V *find (uint32_t key) {
+			return const_cast<V*>(static_cast<const rs_flat_map*>(this)->find(key));
+		}
+
+		V &operator[] (uint32_t key) {
+			if ((count + 1) * 4 > keys.size() * 3) {
+				rehash(keys.size() * 2);
+			}
+
+			size_t mask = keys.size() - 1;
+			for (size_t i = slot(key); ; i = (i + 1) & mask) {
+				if (keys[i] == key) {
+					return values[i];
+				}
+				if (keys[i] == empty) {
+					keys[i] = key;
+					count++;
+					return values[i];
+				}
+			}
+		}
+
+		bool erase (uint32_t key) {
+			size_t mask = keys.size() - 1;
+			size_t i = slot(key);
+			while (keys[i] != key) {
+				if (keys[i] == empty) {
+					return false;
+				}
+				i = (i + 1) & mask;
+			}
+
+			// Shift the rest of the cluster back so probing still works.
+			size_t j = i;
+			while (true) {
+				j = (j + 1) & mask;
+				if (keys[j] == empty) {
+					break;
+				}
+				size_t home = slot(keys[j]);
+				if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+					keys[i] = keys[j];
+					values[i] = values[j];
+					i = j;
+				}
+			}
+			keys[i] = empty;
+			values[i] = V();
+			count--;
+			return true;
+		}
+
+		size_t size () const { return count; }
+		void clear () { keys.assign(8, empty); values.assign(8, V()); count = 0; }
+
+		// Walking the table: for (i = 0; i < capacity(); i++) if (used(i)) ...
+		size_t capacity () const { return keys.size(); }
+		bool used (size_t i) const { return keys[i] != empty; }
+		uint32_t key (size_t i) const { return keys[i]; }
+		const V &value (size_t i) const { return values[i]; }
+
+	private:
+		size_t slot (uint32_t key) const {
+			return (uint32_t)(key * 2654435769u) & (keys.size() - 1);
+		}
+
+		void rehash (size_t capacity) {
+			std::vector<uint32_t> oldKeys (capacity, empty);
+			std::vector<V> oldValues (capacity);
+			oldKeys.swap(keys);
+			oldValues.swap(values);
+
+			size_t mask = keys.size() - 1;
+			for (size_t i = 0; i < oldKeys.size(); i++) {
+				if (oldKeys[i] == empty) {
+					continue;
+				}
+				size_t j = slot(oldKeys[i]);
+				while (keys[j] != empty) {
+					j = (j + 1) & mask;
+				}
+				keys[j] = oldKeys[i];
+				std::swap(values[j], oldValues[i]);
+			}
+		}
+
+		std::vector<uint32_t> keys;
+		std::vector<V> values;
+		size_t count;
+};
+
+#endif
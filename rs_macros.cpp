@@ -0,0 +1,109 @@
+#include "rs_macros.h"
+
+using std::string;
+using std::string_view;
+
+rs_macro_slot *rs_macros::slot (string_view name) {
+	std::lock_guard<std::mutex> guard (lock);
+	std::map<string, std::unique_ptr<rs_macro_slot>, std::less<> >::iterator it = slots.find(name);
+	if (it == slots.end()) {
+		it = slots.emplace(string(name), std::unique_ptr<rs_macro_slot>(new rs_macro_slot())).first;
+	}
+	return it->second.get();
+}
+
+rs_macro_slot *rs_macros::find (string_view name) {
+	std::lock_guard<std::mutex> guard (lock);
+	std::map<string, std::unique_ptr<rs_macro_slot>, std::less<> >::iterator it = slots.find(name);
+	return it == slots.end() ? NULL : it->second.get();
+}
+
+void rs_macros::setHandler (const string &lang, rs_handler handler) {
+	std::lock_guard<std::mutex> guard (lock);
+	if (handler) {
+		handlers[lang] = handler;
+	}
+	else {
+		handlers.erase(lang);
+	}
+}
+
+rs_handler rs_macros::handler (const string &lang) {
+	std::lock_guard<std::mutex> guard (lock);
+	std::map<string, rs_handler>::iterator it = handlers.find(lang);
+	return it == handlers.end() ? rs_handler() : it->second;
+}
+
+rs_executor::rs_executor (unsigned int threads, size_t capacity)
+	: size(threads > 0 ? threads : 1), limit(capacity), turnedAway(0), stopping(false) {
+}
+
+rs_executor::~rs_executor () {
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		stopping = true;
+	}
+	ready.notify_all();
+
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+void rs_executor::setLimits (unsigned int threads, size_t capacity) {
+	std::unique_lock<std::mutex> guard (lock);
+	if (workers.empty()) {
+		size  = threads > 0 ? threads : 1;
+		limit = capacity;
+	}
+}
+
+bool rs_executor::submit (std::function<void()> task) {
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		if (queue.size() >= limit) {
+			turnedAway.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		if (workers.empty()) {
+			for (unsigned int i = 0; i < size; i++) {
+				workers.push_back(std::thread(&rs_executor::worker, this));
+			}
+		}
+		queue.push_back(std::move(task));
+	}
+	ready.notify_one();
+	return true;
+}
+
+unsigned int rs_executor::threads () const {
+	return size;
+}
+
+size_t rs_executor::capacity () const {
+	return limit;
+}
+
+unsigned long rs_executor::rejected () const {
+	return turnedAway.load(std::memory_order_relaxed);
+}
+
+void rs_executor::worker () {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> guard (lock);
+			while (queue.empty() && !stopping) {
+				ready.wait(guard);
+			}
+			if (queue.empty()) {
+				return; // Stopping and nothing left to do.
+			}
+
+			task = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		task();
+	}
+}
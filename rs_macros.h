@@ -0,0 +1,105 @@
+#ifndef _rs_macros_h
+#define _rs_macros_h
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class RiveScript;
+
+// An object macro written in C++: given the interpreter, the ID of the user
+// being replied to and the arguments from the <call> tag, it returns the text
+// to put in the tag's place.
+typedef std::function<std::string(RiveScript &rs, const std::string &user,
+	const std::vector<std::string> &args)> rs_subroutine;
+
+// Makes a macro out of the source of a "> object name lang" block, for one
+// language.
+typedef std::function<rs_subroutine(const std::string &name, const std::string &code)> rs_handler;
+
+struct rs_macro {
+	rs_subroutine run;
+	bool async;             // Run on the executor rather than the caller's thread
+	unsigned int timeoutMs; // How long the caller waits for an async one
+	std::string source;     // The object code it was made from, if any
+};
+
+// Everything that's known by one macro name. Slots never move or go away, so
+// <call> tags can be bound to them once when the replies are sorted; set()
+// swaps the macro in place, which takes effect from the next call.
+class rs_macro_slot {
+	public:
+		std::shared_ptr<const rs_macro> get () const {
+			return std::atomic_load(&macro);
+		}
+		void set (std::shared_ptr<const rs_macro> next) {
+			std::atomic_store(&macro, next);
+		}
+
+	private:
+		std::shared_ptr<const rs_macro> macro;
+};
+
+// The macros and language handlers that have been registered. Thread-safe.
+class rs_macros {
+	public:
+		// The slot for a name, made empty on first use.
+		rs_macro_slot *slot (std::string_view name);
+
+		// The slot for a name if there's one, or NULL.
+		rs_macro_slot *find (std::string_view name);
+
+		void setHandler (const std::string &lang, rs_handler handler);
+		rs_handler handler (const std::string &lang);
+
+	private:
+		std::mutex lock;
+		std::map<std::string, std::unique_ptr<rs_macro_slot>, std::less<> > slots;
+		std::map<std::string, rs_handler> handlers;
+};
+
+// A bounded pool for macros that do slow work (network calls and the like),
+// so they can't tie up the threads that replies run on. At most "threads"
+// run at once and at most "capacity" wait their turn; submit() turns away
+// anything beyond that rather than queueing without limit. The threads are
+// started by the first submit().
+class rs_executor {
+	public:
+		rs_executor (unsigned int threads = 4, size_t capacity = 64);
+		~rs_executor ();
+
+		// Change the limits. Only takes effect before the first submit().
+		void setLimits (unsigned int threads, size_t capacity);
+
+		bool submit (std::function<void()> task);
+
+		// Counters.
+		unsigned int threads () const;
+		size_t capacity () const;
+		unsigned long rejected () const; // Tasks turned away because it was full
+
+	private:
+		rs_executor (const rs_executor &);            // Not copyable
+		rs_executor &operator= (const rs_executor &);
+
+		void worker ();
+
+		std::vector<std::thread> workers;
+		std::deque< std::function<void()> > queue;
+		std::mutex lock;
+		std::condition_variable ready;
+		unsigned int size;
+		size_t limit;
+		std::atomic<unsigned long> turnedAway;
+		bool stopping;
+};
+
+#endif
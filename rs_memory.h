@@ -0,0 +1,70 @@
+#ifndef _rs_memory_h
+#define _rs_memory_h
+
+#include <map>
+#include <string>
+#include <utility>
+#include <stddef.h>
+
+// How much memory something takes: the bytes of the objects themselves and
+// everything they point to, and how many of the things it's made of (triggers,
+// array items, variables...) there are.
+struct rs_memory {
+	size_t bytes;
+	size_t objects;
+	rs_memory () : bytes(0), objects(0) {}
+	rs_memory &operator+= (const rs_memory &other) {
+		bytes   += other.bytes;
+		objects += other.objects;
+		return *this;
+	}
+};
+
+// A breakdown of a brain's memory, as returned by RiveScript::memoryStats().
+struct rs_memory_stats {
+	size_t total;         // Everything that's counted, in bytes
+	size_t arenaUsed;     // Bytes handed out by the brain's arena...
+	size_t arenaReserved; // ...and taken from the heap for it
+	std::map<std::string, rs_memory> structures; // By structure ("topics", "arrays", ...)
+	std::map<std::string, rs_memory> topics;     // By topic, its %Previous triggers included
+	std::map<std::string, rs_memory> files;      // By file, for what it was parsed into
+	rs_memory_stats () : total(0), arenaUsed(0), arenaReserved(0) {}
+};
+
+// Estimates of what the standard containers take beyond their own size.
+// They're close for libstdc++ and libc++, but not exact: the heap's own
+// bookkeeping isn't counted.
+
+// A string's characters, unless they fit inside the string itself.
+template <class S>
+size_t rs_string_bytes (const S &s) {
+	const char *self = (const char*)&s;
+	if (s.data() >= self && s.data() < self + sizeof(s)) {
+		return 0;
+	}
+	return s.capacity() + 1;
+}
+
+// A vector's elements (but not what they point to).
+template <class V>
+size_t rs_vector_bytes (const V &v) {
+	return v.capacity() * sizeof(typename V::value_type);
+}
+
+// One node of a map: the red-black tree links and colour, then the entry.
+template <class M>
+size_t rs_node_bytes () {
+	return 4 * sizeof(void*) + sizeof(typename M::value_type);
+}
+
+// A map of strings to strings, all of it.
+template <class M>
+size_t rs_string_map_bytes (const M &map) {
+	size_t bytes = 0;
+	for (typename M::const_iterator it = map.begin(); it != map.end(); ++it) {
+		bytes += rs_node_bytes<M>() + rs_string_bytes(it->first) + rs_string_bytes(it->second);
+	}
+	return bytes;
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "rs_mmap.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+rs_mmap::rs_mmap () {
+	this->addr   = NULL;
+	this->length = 0;
+}
+
+rs_mmap::~rs_mmap () {
+	close();
+}
+
+bool rs_mmap::open (const string &path) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		::close(fd);
+		return false;
+	}
+
+	// An empty file can't be mapped, but it's still a perfectly good file.
+	if (st.st_size == 0) {
+		::close(fd);
+		return true;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // The mapping keeps its own reference.
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	// We read the file front to back exactly once.
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	this->addr   = (const char*)map;
+	this->length = st.st_size;
+	return true;
+}
+
+void rs_mmap::close () {
+	if (this->addr != NULL) {
+		munmap((void*)this->addr, this->length);
+	}
+	this->addr   = NULL;
+	this->length = 0;
+}
+
+const char *rs_mmap::data () const {
+	return this->addr;
+}
+
+size_t rs_mmap::size () const {
+	return this->length;
+}
+
+string_view rs_mmap::view () const {
+	return string_view(this->addr == NULL ? "" : this->addr, this->length);
+}
+
+vector<string_view> rs_mmap::lines () const {
+	vector<string_view> result;
+	const char *p   = this->addr;
+	const char *end = this->addr + this->length;
+
+	while (p < end) {
+		const char *nl = (const char*)memchr(p, '\n', end - p);
+		const char *eol = nl != NULL ? nl : end;
+
+		size_t len = eol - p;
+		if (len > 0 && p[len - 1] == '\r') {
+			len--;
+		}
+		result.push_back(string_view(p, len));
+
+		p = nl != NULL ? nl + 1 : end;
+	}
+
+	return result;
+}
@@ -0,0 +1,35 @@
+#ifndef _rs_mmap_h
+#define _rs_mmap_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A read-only memory map of a whole file. The views handed out by lines()
+// point straight into the mapping, so they're only good for as long as the
+// rs_mmap is alive.
+class rs_mmap {
+	public:
+		rs_mmap ();
+		~rs_mmap ();
+
+		bool open (const std::string &path);
+		void close ();
+
+		const char *data () const;
+		size_t size () const;
+		std::string_view view () const;
+
+		// Split the file into lines. Line endings ("\n" or "\r\n") aren't
+		// included, and there's no phantom empty line after a final newline.
+		std::vector<std::string_view> lines () const;
+
+	private:
+		rs_mmap (const rs_mmap &);            // Not copyable
+		rs_mmap &operator= (const rs_mmap &);
+
+		const char *addr;
+		size_t length;
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include <string.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#include "rs_normalize.h"
+
+using std::string;
+using std::string_view;
+
+// Decode the UTF-8 character at in[i]. Returns its length in bytes, or 0 if
+// it isn't valid (truncated, overlong, a surrogate or out of range).
+static size_t rs_utf8_decode (string_view in, size_t i, uint32_t &cp) {
+	unsigned char c = in[i];
+	size_t length;
+	uint32_t min;
+	if (c < 0x80) {
+		cp = c;
+		return 1;
+	}
+	else if ((c & 0xE0) == 0xC0) {
+		length = 2;
+		cp  = c & 0x1F;
+		min = 0x80;
+	}
+	else if ((c & 0xF0) == 0xE0) {
+		length = 3;
+		cp  = c & 0x0F;
+		min = 0x800;
+	}
+	else if ((c & 0xF8) == 0xF0) {
+		length = 4;
+		cp  = c & 0x07;
+		min = 0x10000;
+	}
+	else {
+		return 0;
+	}
+
+	if (i + length > in.length()) {
+		return 0;
+	}
+	for (size_t j = 1; j < length; j++) {
+		unsigned char next = in[i + j];
+		if ((next & 0xC0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (next & 0x3F);
+	}
+	if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+		return 0;
+	}
+	return length;
+}
+
+static size_t rs_utf8_encode (uint32_t cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+// The simple lowercase form of a non-ASCII character, for the scripts that
+// have one. None of these take more bytes than the original, so folding
+// never makes the text longer.
+static uint32_t rs_fold_char (uint32_t c) {
+	if ((c >= 0xC0 && c <= 0xDE && c != 0xD7) ||      // Latin-1
+		(c >= 0x391 && c <= 0x3A9 && c != 0x3A2) ||   // Greek
+		(c >= 0x410 && c <= 0x42F) ||                 // Cyrillic
+		(c >= 0xFF21 && c <= 0xFF3A)) {               // Fullwidth Latin
+		return c + 0x20;
+	}
+	if ((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177) ||
+		(c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) ||
+		(c >= 0x1E00 && c <= 0x1E95) || (c >= 0x1EA0 && c <= 0x1EFF)) {
+		return c | 1; // Upper and lower case pairs, upper first
+	}
+	if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) {
+		return (c & 1) ? c + 1 : c; // Likewise, but starting on an odd one
+	}
+	if (c >= 0x400 && c <= 0x40F) {
+		return c + 0x50;
+	}
+	if (c >= 0x531 && c <= 0x556) {
+		return c + 0x30;                              // Armenian
+	}
+	if (c >= 0x388 && c <= 0x38A) {
+		return c + 0x25;
+	}
+	if (c == 0x38E || c == 0x38F) {
+		return c + 0x3F;
+	}
+	switch (c) {
+		case 0x130:  return 'i';   // Capital I with dot
+		case 0x178:  return 0xFF;  // Capital Y with diaeresis
+		case 0x17F:  return 's';   // Long s
+		case 0x386:  return 0x3AC;
+		case 0x38C:  return 0x3CC;
+		case 0x3C2:  return 0x3C3; // Final sigma
+		case 0x1E9E: return 0xDF;  // Capital sharp s
+		case 0x212A: return 'k';   // Kelvin sign
+		case 0x212B: return 0xE5;  // Angstrom sign
+	}
+	return c;
+}
+
+enum rs_char_class {
+	RS_CHAR_DROP,  // Punctuation, symbols, control characters
+	RS_CHAR_SPACE,
+	RS_CHAR_WORD   // Letters, digits and combining marks
+};
+
+static rs_char_class rs_classify (uint32_t c) {
+	if (c < 0x80) {
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+			return RS_CHAR_WORD;
+		}
+		return c == ' ' || (c >= 0x09 && c <= 0x0D) ? RS_CHAR_SPACE : RS_CHAR_DROP;
+	}
+
+	if (c == 0x85 || c == 0xA0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200A) ||
+		c == 0x2028 || c == 0x2029 || c == 0x202F || c == 0x205F || c == 0x3000) {
+		return RS_CHAR_SPACE;
+	}
+	if ((c < 0xC0 && c != 0xAA && c != 0xB5 && c != 0xBA) || c == 0xD7 || c == 0xF7 ||
+		(c >= 0x2000 && c <= 0x206F) ||   // General punctuation
+		(c >= 0x20A0 && c <= 0x20CF) ||   // Currency
+		(c >= 0x2190 && c <= 0x2BFF) ||   // Arrows, maths, shapes, dingbats
+		(c >= 0x3000 && c <= 0x303F) ||   // CJK punctuation
+		(c >= 0xE000 && c <= 0xF8FF) ||   // Private use
+		(c >= 0xFE00 && c <= 0xFE0F) ||   // Variation selectors
+		(c >= 0xFE30 && c <= 0xFE6F) ||   // CJK compatibility and small forms
+		c == 0xFEFF ||
+		(c >= 0xFF01 && c <= 0xFF0F) || (c >= 0xFF1A && c <= 0xFF20) ||
+		(c >= 0xFF3B && c <= 0xFF40) || (c >= 0xFF5B && c <= 0xFF65) ||
+		(c >= 0x1F000 && c <= 0x1FAFF)) { // Emoji and pictographs
+		return RS_CHAR_DROP;
+	}
+	return RS_CHAR_WORD;
+}
+
+// Case-fold one character at in[i].
+static void rs_fold_one (string_view in, size_t &i, char *to, size_t &n) {
+	unsigned char c = in[i];
+	if (c < 0x80) {
+		to[n++] = c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+		i++;
+		return;
+	}
+
+	uint32_t cp;
+	size_t length = rs_utf8_decode(in, i, cp);
+	if (length == 0) {
+		to[n++] = c;
+		i++;
+		return;
+	}
+	uint32_t folded = rs_fold_char(cp);
+	if (folded == cp) {
+		memcpy(to + n, in.data() + i, length);
+		n += length;
+	}
+	else {
+		n += rs_utf8_encode(folded, to + n);
+	}
+	i += length;
+}
+
+// Add one character at in[i] to the words. A space only goes in once the
+// next word starts.
+static void rs_words_one (string_view in, size_t &i, char *to, size_t &n, bool &space) {
+	uint32_t cp = (unsigned char)in[i];
+	size_t length = cp < 0x80 ? 1 : rs_utf8_decode(in, i, cp);
+	if (length == 0) {
+		i++;
+		return;
+	}
+
+	rs_char_class kind = rs_classify(cp);
+	if (kind == RS_CHAR_SPACE) {
+		space = true;
+	}
+	else if (kind == RS_CHAR_WORD) {
+		if (space && n > 0) {
+			to[n++] = ' ';
+		}
+		memcpy(to + n, in.data() + i, length);
+		n += length;
+		space = false;
+	}
+	i += length;
+}
+
+// Add a vector's worth of ASCII to the words, given which of its bytes are
+// letters or digits and which are plain spaces. Only if that's all there is,
+// with no two spaces together, can it be copied as it is; a space at either
+// end is left pending. Otherwise it's left to rs_words_one().
+static bool rs_words_block (const char *from, unsigned int width, uint32_t word, uint32_t spaces,
+	char *to, size_t &n, bool &space) {
+	uint32_t all = width == 32 ? 0xFFFFFFFF : (1u << width) - 1;
+	if ((word | spaces) != all || (spaces & (spaces >> 1)) != 0) {
+		return false;
+	}
+
+	unsigned int lo = spaces & 1;
+	unsigned int hi = (spaces >> (width - 1)) & 1 ? width - 1 : width;
+	if (lo) {
+		space = true;
+	}
+	if (space && n > 0) {
+		to[n++] = ' ';
+	}
+	memcpy(to + n, from + lo, hi - lo);
+	n += hi - lo;
+	space = hi < width;
+	return true;
+}
+
+void rs_casefold (string_view in, string &out) {
+	out.resize(in.length());
+	const char *from = in.data();
+	char *to = &out[0];
+	size_t i = 0, n = 0;
+
+	while (i < in.length()) {
+		size_t stop = in.length(); // How far to go a character at a time
+#if defined(__AVX2__)
+		if (i + 32 <= in.length()) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(from + i));
+			if (_mm256_movemask_epi8(v) == 0) {
+				__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+					_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+				_mm256_storeu_si256((__m256i*)(to + n), _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+				i += 32;
+				n += 32;
+				continue;
+			}
+			stop = i + 32;
+		}
+#elif defined(__SSE2__)
+		if (i + 16 <= in.length()) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(from + i));
+			if (_mm_movemask_epi8(v) == 0) {
+				__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+					_mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+				_mm_storeu_si128((__m128i*)(to + n), _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+				i += 16;
+				n += 16;
+				continue;
+			}
+			stop = i + 16;
+		}
+#endif
+		while (i < stop) {
+			rs_fold_one(in, i, to, n);
+		}
+	}
+
+	out.resize(n);
+}
+
+void rs_words (string_view in, string &out) {
+	out.resize(in.length());
+	const char *from = in.data();
+	char *to = &out[0];
+	size_t i = 0, n = 0;
+	bool space = false;
+
+	while (i < in.length()) {
+		size_t stop = in.length();
+#if defined(__AVX2__)
+		if (i + 32 <= in.length()) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(from + i));
+			if (_mm256_movemask_epi8(v) == 0) {
+				__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+				__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+					_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+				__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+					_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+				uint32_t word   = _mm256_movemask_epi8(_mm256_or_si256(alpha, digit));
+				uint32_t spaces = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+				if (rs_words_block(from + i, 32, word, spaces, to, n, space)) {
+					i += 32;
+					continue;
+				}
+			}
+			stop = i + 32;
+		}
+#elif defined(__SSE2__)
+		if (i + 16 <= in.length()) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(from + i));
+			if (_mm_movemask_epi8(v) == 0) {
+				__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+				__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+					_mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+				__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+					_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+				uint32_t word   = _mm_movemask_epi8(_mm_or_si128(alpha, digit));
+				uint32_t spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+				if (rs_words_block(from + i, 16, word, spaces, to, n, space)) {
+					i += 16;
+					continue;
+				}
+			}
+			stop = i + 16;
+		}
+#endif
+		while (i < stop) {
+			rs_words_one(in, i, to, n, space);
+		}
+	}
+
+	out.resize(n);
+}
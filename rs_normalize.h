@@ -0,0 +1,24 @@
+#ifndef _rs_normalize_h
+#define _rs_normalize_h
+
+#include <string>
+#include <string_view>
+
+// Normalization for messages and trigger text, which has to come out the
+// same for both or they won't match. Both functions write into a buffer the
+// caller provides (replacing what was in it), which mustn't be the input.
+// Plain ASCII is handled a vector at a time (AVX2 or SSE2, if the compiler
+// targets them, or a byte at a time otherwise); only the rest is decoded as
+// UTF-8.
+
+// Case-fold: ASCII letters, and the Latin, Greek, Cyrillic, Armenian and
+// fullwidth letters that have a simple lowercase form, are lowercased.
+// Everything else, invalid UTF-8 included, is copied as it is.
+void rs_casefold (std::string_view in, std::string &out);
+
+// Keep only the words: runs of letters and digits (anything outside ASCII
+// that isn't punctuation, a symbol or a space counts as a letter), separated
+// by single spaces, with none at either end. Invalid UTF-8 is dropped.
+void rs_words (std::string_view in, std::string &out);
+
+#endif
@@ -0,0 +1,131 @@
+#include "rs_pool.h"
+
+// The pool (and worker) the current thread belongs to, if it's a worker.
+static thread_local rs_pool *rs_pool_current = NULL;
+static thread_local unsigned int rs_pool_self = 0;
+
+rs_pool::rs_pool (unsigned int threads)
+	: next(0), queued(0), unfinished(0), stopping(false) {
+	if (threads == 0) {
+		threads = 1;
+	}
+	this->count = threads;
+	this->queues.reset(new rs_pool_queue[threads]);
+	for (unsigned int i = 0; i < threads; i++) {
+		this->threads.push_back(std::thread(&rs_pool::worker, this, i));
+	}
+}
+
+rs_pool::~rs_pool () {
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		stopping = true;
+	}
+	ready.notify_all();
+
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+}
+
+void rs_pool::submit (std::function<void()> task) {
+	// A task's own tasks stay with its worker; others are dealt out in turn.
+	unsigned int target = rs_pool_current == this ? rs_pool_self
+		: next.fetch_add(1, std::memory_order_relaxed) % count;
+
+	unfinished.fetch_add(1);
+	{
+		std::unique_lock<std::mutex> guard (queues[target].lock);
+		queues[target].tasks.push_back(std::move(task));
+	}
+
+	// Counted under the sleep lock, so a worker can't miss it on its way to
+	// sleep.
+	{
+		std::unique_lock<std::mutex> guard (lock);
+		queued.fetch_add(1);
+	}
+	ready.notify_one();
+}
+
+void rs_pool::wait () {
+	std::unique_lock<std::mutex> guard (lock);
+	while (unfinished.load() > 0) {
+		idle.wait(guard);
+	}
+}
+
+unsigned int rs_pool::size () const {
+	return count;
+}
+
+unsigned int rs_pool::defaultSize () {
+	unsigned int n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+bool rs_pool::take (unsigned int self, std::function<void()> &task) {
+	// The oldest of our own tasks, or else the newest of somebody else's.
+	for (unsigned int i = 0; i < count; i++) {
+		rs_pool_queue &queue = queues[(self + i) % count];
+		std::unique_lock<std::mutex> guard (queue.lock);
+		if (queue.tasks.empty()) {
+			continue;
+		}
+
+		if (i == 0) {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		else {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		queued.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+void rs_pool::worker (unsigned int self) {
+	rs_pool_current = this;
+	rs_pool_self    = self;
+
+	while (true) {
+		std::function<void()> task;
+		if (!take(self, task)) {
+			std::unique_lock<std::mutex> guard (lock);
+			while (queued.load() == 0 && !stopping) {
+				ready.wait(guard);
+			}
+			if (queued.load() == 0) {
+				return; // Stopping and nothing left to do.
+			}
+			continue;
+		}
+
+		task();
+
+		if (unfinished.fetch_sub(1) == 1) {
+			std::unique_lock<std::mutex> guard (lock);
+			idle.notify_all();
+		}
+	}
+}
+
+rs_latch::rs_latch (size_t count) : count(count) {
+}
+
+void rs_latch::countDown () {
+	std::unique_lock<std::mutex> guard (lock);
+	if (count > 0 && --count == 0) {
+		zero.notify_all();
+	}
+}
+
+void rs_latch::wait () {
+	std::unique_lock<std::mutex> guard (lock);
+	while (count > 0) {
+		zero.wait(guard);
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef _rs_pool_h
+#define _rs_pool_h
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// A small fixed-size, work-stealing thread pool. Each worker has a queue of
+// its own: tasks submitted from outside the pool are dealt out to them in
+// turn, and tasks submitted by a task go on its worker's queue. A worker runs
+// its own tasks in order, and when it runs out it takes the newest task from
+// another worker's queue. wait() blocks until every task submitted so far is
+// finished.
+class rs_pool {
+	public:
+		rs_pool (unsigned int threads);
+		~rs_pool ();
+
+		void submit (std::function<void()> task);
+		void wait ();
+		unsigned int size () const;
+
+		// A sensible default worker count for this machine.
+		static unsigned int defaultSize ();
+
+	private:
+		rs_pool (const rs_pool &);            // Not copyable
+		rs_pool &operator= (const rs_pool &);
+
+		struct alignas(64) rs_pool_queue {
+			std::mutex lock;
+			std::deque< std::function<void()> > tasks;
+		};
+
+		void worker (unsigned int self);
+		bool take (unsigned int self, std::function<void()> &task);
+
+		std::vector<std::thread> threads;
+		unsigned int count;                       // Workers (fixed before any of them start)
+		std::unique_ptr<rs_pool_queue[]> queues; // One per worker
+		std::atomic<unsigned int> next;   // Which worker gets the next task from outside
+		std::atomic<size_t> queued;       // Tasks waiting in any queue
+		std::atomic<size_t> unfinished;   // Tasks submitted and not yet finished
+		std::mutex lock;                  // For workers going to sleep and waking up
+		std::condition_variable ready;    // Signalled when a task is queued
+		std::condition_variable idle;     // Signalled when the pool runs dry
+		bool stopping;
+};
+
+// Counts down to zero once; wait() blocks until it gets there. For waiting on
+// one group of tasks in a pool that others may be using at the same time.
+class rs_latch {
+	public:
+		rs_latch (size_t count);
+
+		void countDown ();
+		void wait ();
+
+	private:
+		rs_latch (const rs_latch &);            // Not copyable
+		rs_latch &operator= (const rs_latch &);
+
+		std::mutex lock;
+		std::condition_variable zero;
+		size_t count;
+};
+
+#endif
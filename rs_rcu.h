@@ -0,0 +1,161 @@
+#ifndef _rs_rcu_h
+#define _rs_rcu_h
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Publishes a read-only object to any number of reader threads, RCU style.
+// Readers pin whichever version is current without taking a lock and keep
+// using it for as long as they hold the pin. publish() swaps in a new version
+// straight away, waits until nobody can still be reading the old one, and
+// then deletes it.
+//
+// Readers are counted in two sets of striped counters. Each publish flips
+// new readers over to the other set and waits for the one they left to
+// drain, twice, so it never waits behind readers that arrived after the swap.
+//
+// A thread that's reading can't wait for readers to drain, since it's one of
+// them. So a publish from inside a read swaps the new version in as usual but
+// retires the old one instead of waiting; whichever thread next finishes its
+// outermost read (or publishes from outside one) deletes it.
+template <class T>
+class rs_rcu {
+	public:
+		rs_rcu () : current(NULL), epoch(0), pending(0) {
+			for (unsigned int i = 0; i < 2; i++) {
+				for (unsigned int j = 0; j < stripes; j++) {
+					counters[i][j].readers.store(0);
+				}
+			}
+		}
+		~rs_rcu () {
+			delete current.load();
+			for (unsigned int i = 0; i < retired.size(); i++) {
+				delete retired[i];
+			}
+		}
+
+		// Pins the current version while it's in scope.
+		class reader {
+			public:
+				reader (const rs_rcu &rcu) : rcu(rcu) {
+					depth()++;
+					unsigned int e = rcu.epoch.load();
+					counter = &rcu.counters[e & 1][stripe()].readers;
+					counter->fetch_add(1);
+					value = rcu.current.load();
+				}
+				~reader () {
+					counter->fetch_sub(1, std::memory_order_release);
+					if (--depth() == 0 && rcu.pending.load() != 0) {
+						rcu.reclaim();
+					}
+				}
+
+				const T *get () const { return value; }
+				const T *operator-> () const { return value; }
+				const T &operator* () const { return *value; }
+
+			private:
+				reader (const reader &);            // Not copyable
+				reader &operator= (const reader &);
+
+				const rs_rcu &rcu;
+				std::atomic<long> *counter;
+				const T *value;
+		};
+
+		// Counts as a read on this thread without pinning anything, for work
+		// done on behalf of a reader on another thread (which holds the pin).
+		// Unlike a reader, it never deletes retired versions when it ends,
+		// since the reader it's working for may still be waiting on it.
+		class borrower {
+			public:
+				borrower () { depth()++; }
+				~borrower () { depth()--; }
+
+			private:
+				borrower (const borrower &);            // Not copyable
+				borrower &operator= (const borrower &);
+		};
+
+		// Swap in a new version (the rs_rcu owns it from here on) and delete
+		// the old one once no reader can still see it. Publishers take turns;
+		// readers never wait. From inside a read, the old version is retired
+		// rather than waited for.
+		void publish (T *next) {
+			T *old = current.exchange(next);
+			if (old != NULL) {
+				std::lock_guard<std::mutex> guard (retiring);
+				retired.push_back(old);
+				pending.store(retired.size());
+			}
+			if (depth() == 0) {
+				reclaim();
+			}
+		}
+
+	private:
+		rs_rcu (const rs_rcu &);            // Not copyable
+		rs_rcu &operator= (const rs_rcu &);
+
+		static constexpr unsigned int stripes = 16;
+
+		// Delete the retired versions, once every reader that might still
+		// see one has finished. Only ever called from outside a read.
+		void reclaim () const {
+			std::lock_guard<std::mutex> guard (publishing);
+			std::vector<T*> gone;
+			{
+				std::lock_guard<std::mutex> guard (retiring);
+				gone.swap(retired);
+				pending.store(0);
+			}
+			if (gone.empty()) {
+				return;
+			}
+			for (unsigned int flip = 0; flip < 2; flip++) {
+				unsigned int e = epoch.fetch_add(1);
+				for (unsigned int i = 0; i < stripes; i++) {
+					while (counters[e & 1][i].readers.load(std::memory_order_acquire) != 0) {
+						std::this_thread::yield();
+					}
+				}
+			}
+			for (unsigned int i = 0; i < gone.size(); i++) {
+				delete gone[i];
+			}
+		}
+
+		// How many reads (of any rs_rcu of this type) this thread is in.
+		static unsigned int &depth () {
+			thread_local unsigned int mine = 0;
+			return mine;
+		}
+
+		// Spread the reader threads over the stripes, so they don't all
+		// bounce the same cache line around.
+		static unsigned int stripe () {
+			static std::atomic<unsigned int> threads (0);
+			thread_local unsigned int mine = threads.fetch_add(1) % stripes;
+			return mine;
+		}
+
+		struct alignas(64) rs_rcu_counter {
+			std::atomic<long> readers;
+		};
+
+		mutable rs_rcu_counter counters[2][stripes];
+		std::atomic<T*> current;
+		mutable std::atomic<unsigned int> epoch;
+		mutable std::mutex publishing;
+
+		// Old versions waiting to be deleted, and how many there are.
+		mutable std::vector<T*> retired;
+		mutable std::atomic<size_t> pending;
+		mutable std::mutex retiring;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "rs_regex_cache.h"
+
+using std::string;
+
+rs_regex_cache::rs_regex_cache (size_t capacity) {
+	this->limit      = capacity > 0 ? capacity : 1;
+	this->hitCount   = 0;
+	this->missCount  = 0;
+	this->evictCount = 0;
+}
+
+rs_regex rs_regex_cache::get (const string &pattern, boost::regex_constants::syntax_option_type flags) {
+	string key = std::to_string((unsigned long)flags) + ":" + pattern;
+
+	{
+		std::lock_guard<std::mutex> guard (lock);
+		std::unordered_map<string, rs_regex_lru::iterator>::iterator found = entries.find(key);
+		if (found != entries.end()) {
+			hitCount++;
+			lru.splice(lru.begin(), lru, found->second);
+			return found->second->regex;
+		}
+		missCount++;
+	}
+
+	// Compile outside the lock so other lookups aren't held up. If two
+	// threads miss on the same pattern at once, the first one in wins.
+	rs_regex regex;
+	try {
+		regex = std::make_shared<const boost::regex>(pattern, flags);
+	}
+	catch (const boost::regex_error &) {
+		return rs_regex();
+	}
+
+	std::lock_guard<std::mutex> guard (lock);
+	std::unordered_map<string, rs_regex_lru::iterator>::iterator found = entries.find(key);
+	if (found != entries.end()) {
+		return found->second->regex;
+	}
+
+	rs_regex_entry entry;
+	entry.key   = key;
+	entry.regex = regex;
+	lru.push_front(entry);
+	entries[key] = lru.begin();
+	evict();
+
+	return regex;
+}
+
+void rs_regex_cache::evict () {
+	while (entries.size() > limit) {
+		entries.erase(lru.back().key);
+		lru.pop_back();
+		evictCount++;
+	}
+}
+
+void rs_regex_cache::setCapacity (size_t capacity) {
+	std::lock_guard<std::mutex> guard (lock);
+	limit = capacity > 0 ? capacity : 1;
+	evict();
+}
+
+void rs_regex_cache::clear () {
+	std::lock_guard<std::mutex> guard (lock);
+	entries.clear();
+	lru.clear();
+}
+
+size_t rs_regex_cache::size () const {
+	std::lock_guard<std::mutex> guard (lock);
+	return entries.size();
+}
+
+size_t rs_regex_cache::capacity () const {
+	std::lock_guard<std::mutex> guard (lock);
+	return limit;
+}
+
+unsigned long rs_regex_cache::hits () const {
+	std::lock_guard<std::mutex> guard (lock);
+	return hitCount;
+}
+
+unsigned long rs_regex_cache::misses () const {
+	std::lock_guard<std::mutex> guard (lock);
+	return missCount;
+}
+
+unsigned long rs_regex_cache::evictions () const {
+	std::lock_guard<std::mutex> guard (lock);
+	return evictCount;
+}
@@ -0,0 +1,56 @@
+#ifndef _rs_regex_cache_h
+#define _rs_regex_cache_h
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+#include "boost/regex.hpp"
+
+// A handle to a compiled pattern. Handles stay valid after the pattern is
+// evicted from the cache; holding one keeps the regex alive.
+typedef std::shared_ptr<const boost::regex> rs_regex;
+
+// A bounded, thread-safe cache of compiled regular expressions, keyed by the
+// pattern text and its flags. The least recently used pattern is evicted
+// once the cache is full.
+class rs_regex_cache {
+	public:
+		rs_regex_cache (size_t capacity = 1024);
+
+		// Get a compiled pattern, compiling it on a miss. Returns an empty
+		// handle if the pattern doesn't compile.
+		rs_regex get (const std::string &pattern,
+			boost::regex_constants::syntax_option_type flags = boost::regex_constants::perl);
+
+		void setCapacity (size_t capacity);
+		void clear ();
+
+		// Counters.
+		size_t size () const;
+		size_t capacity () const;
+		unsigned long hits () const;
+		unsigned long misses () const;
+		unsigned long evictions () const;
+
+	private:
+		struct rs_regex_entry {
+			std::string key;
+			rs_regex regex;
+		};
+		typedef std::list<rs_regex_entry> rs_regex_lru;
+
+		void evict ();
+
+		mutable std::mutex lock;
+		rs_regex_lru lru; // Most recently used first
+		std::unordered_map<std::string, rs_regex_lru::iterator> entries;
+		size_t limit;
+		unsigned long hitCount;
+		unsigned long missCount;
+		unsigned long evictCount;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "rs_sessions.h"
+
+using std::string;
+
+rs_sessions::rs_sessions ()
+	: limit(0), idleSeconds(0) {
+}
+
+bool rs_sessions::get (const string &id, rs_session &session) {
+	rs_shard &shard = shardOf(id);
+	rs_evicted evicted;
+	{
+		std::lock_guard<std::mutex> guard (shard.lock);
+		if (shard.users.find(id) == shard.users.end()) {
+			return false;
+		}
+		session = touch(shard, id).session;
+		evict(shard, &id, evicted);
+	}
+	notify(evicted);
+	return true;
+}
+
+void rs_sessions::put (const string &id, rs_session &&session) {
+	rs_shard &shard = shardOf(id);
+	rs_evicted evicted;
+	{
+		std::lock_guard<std::mutex> guard (shard.lock);
+		rs_session_entry &entry = touch(shard, id);
+		entry.session = std::move(session);
+		resize(shard, entry, id);
+		evict(shard, &id, evicted);
+	}
+	notify(evicted);
+}
+
+bool rs_sessions::getVar (const string &id, const string &name, string &value) {
+	rs_shard &shard = shardOf(id);
+	std::lock_guard<std::mutex> guard (shard.lock);
+	std::unordered_map<string, rs_session_entry>::const_iterator user = shard.users.find(id);
+	if (user == shard.users.end()) {
+		return false;
+	}
+	std::map<string, string>::const_iterator var = user->second.session.vars.find(name);
+	if (var == user->second.session.vars.end()) {
+		return false;
+	}
+	value = var->second;
+	return true;
+}
+
+void rs_sessions::setVar (const string &id, const string &name, const string &value) {
+	rs_shard &shard = shardOf(id);
+	rs_evicted evicted;
+	{
+		std::lock_guard<std::mutex> guard (shard.lock);
+		rs_session_entry &entry = touch(shard, id);
+		entry.session.vars[name] = value;
+		resize(shard, entry, id);
+		evict(shard, &id, evicted);
+	}
+	notify(evicted);
+}
+
+void rs_sessions::erase (const string &id) {
+	rs_shard &shard = shardOf(id);
+	std::lock_guard<std::mutex> guard (shard.lock);
+	std::unordered_map<string, rs_session_entry>::iterator user = shard.users.find(id);
+	if (user != shard.users.end()) {
+		shard.bytes -= user->second.bytes;
+		shard.lru.erase(user->second.lru);
+		shard.users.erase(user);
+	}
+}
+
+void rs_sessions::setLimit (size_t bytes) {
+	// Each shard gets an even share. Round up so a small cap doesn't
+	// become no cap at all.
+	limit = bytes > 0 ? (bytes + shards - 1) / shards : 0;
+}
+
+void rs_sessions::setIdle (std::chrono::seconds idle) {
+	idleSeconds = idle.count();
+}
+
+void rs_sessions::onEvict (rs_evict_handler handler) {
+	std::lock_guard<std::mutex> guard (handling);
+	this->handler = handler;
+}
+
+size_t rs_sessions::expire () {
+	size_t count = 0;
+	for (unsigned int i = 0; i < shards; i++) {
+		rs_evicted evicted;
+		{
+			std::lock_guard<std::mutex> guard (table[i].lock);
+			evict(table[i], NULL, evicted);
+		}
+		count += evicted.size();
+		notify(evicted);
+	}
+	return count;
+}
+
+size_t rs_sessions::size () const {
+	size_t count = 0;
+	for (unsigned int i = 0; i < shards; i++) {
+		std::lock_guard<std::mutex> guard (table[i].lock);
+		count += table[i].users.size();
+	}
+	return count;
+}
+
+size_t rs_sessions::bytes () const {
+	size_t count = 0;
+	for (unsigned int i = 0; i < shards; i++) {
+		std::lock_guard<std::mutex> guard (table[i].lock);
+		count += table[i].bytes;
+	}
+	return count;
+}
+
+unsigned long rs_sessions::evictions () const {
+	unsigned long count = 0;
+	for (unsigned int i = 0; i < shards; i++) {
+		std::lock_guard<std::mutex> guard (table[i].lock);
+		count += table[i].evictions;
+	}
+	return count;
+}
+
+// What a string has on the heap, if anything.
+static size_t rs_heap (const string &text) {
+	return text.capacity() > 15 ? text.capacity() + 1 : 0;
+}
+
+size_t rs_sessions::sizeOf (const string &id, const rs_session &session) {
+	// The hash table node and bucket, the LRU list node, and the key.
+	size_t size = sizeof(rs_session_entry) + sizeof(string) + 4 * sizeof(void*) + 3 * sizeof(void*);
+	size += rs_heap(id);
+
+	// The variables: one tree node each.
+	for (std::map<string, string>::const_iterator it = session.vars.begin(); it != session.vars.end(); it++) {
+		size += 4 * sizeof(void*) + 2 * sizeof(string);
+		size += rs_heap(it->first) + rs_heap(it->second);
+	}
+
+	// The history lives inline, but long messages spill onto the heap.
+	for (unsigned int i = 0; i < session.input.size(); i++) {
+		size += rs_heap(session.input[i]);
+	}
+	for (unsigned int i = 0; i < session.reply.size(); i++) {
+		size += rs_heap(session.reply[i]);
+	}
+	size += rs_heap(session.lastMatch);
+
+	return size;
+}
+
+rs_sessions::rs_shard &rs_sessions::shardOf (const string &id) {
+	return table[std::hash<string>()(id) % shards];
+}
+
+rs_sessions::rs_session_entry &rs_sessions::touch (rs_shard &shard, const string &id) {
+	std::pair<std::unordered_map<string, rs_session_entry>::iterator, bool> found =
+		shard.users.try_emplace(id);
+	rs_session_entry &entry = found.first->second;
+	if (found.second) {
+		shard.lru.push_front(&found.first->first);
+		entry.lru   = shard.lru.begin();
+		entry.bytes = 0;
+		resize(shard, entry, id);
+	}
+	else {
+		shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+	}
+	entry.used = rs_clock::now();
+	return entry;
+}
+
+void rs_sessions::resize (rs_shard &shard, rs_session_entry &entry, const string &id) {
+	size_t size = sizeOf(id, entry.session);
+	shard.bytes = shard.bytes - entry.bytes + size;
+	entry.bytes = size;
+}
+
+void rs_sessions::evict (rs_shard &shard, const string *keep, rs_evicted &out) {
+	size_t cap = limit;
+	long idle  = idleSeconds;
+	if (cap == 0 && idle == 0) {
+		return;
+	}
+
+	// The LRU list is in the order users were last touched, so the idle
+	// ones are all at the cold end too.
+	rs_clock::time_point now = rs_clock::now();
+	while (!shard.lru.empty()) {
+		const string &id = *shard.lru.back();
+		if (keep != NULL && id == *keep) {
+			break; // Never evict the user we're working on
+		}
+
+		std::unordered_map<string, rs_session_entry>::iterator user = shard.users.find(id);
+		bool full  = cap > 0 && shard.bytes > cap;
+		bool stale = idle > 0 && now - user->second.used > std::chrono::seconds(idle);
+		if (!full && !stale) {
+			break;
+		}
+
+		out.emplace_back(id, std::move(user->second.session));
+		shard.bytes -= user->second.bytes;
+		shard.evictions++;
+		shard.lru.pop_back();
+		shard.users.erase(user);
+	}
+}
+
+void rs_sessions::notify (rs_evicted &evicted) {
+	if (evicted.empty()) {
+		return;
+	}
+
+	rs_evict_handler call;
+	{
+		std::lock_guard<std::mutex> guard (handling);
+		call = handler;
+	}
+	if (call) {
+		for (size_t i = 0; i < evicted.size(); i++) {
+			call(evicted[i].first, evicted[i].second);
+		}
+	}
+}
@@ -0,0 +1,142 @@
+#ifndef _rs_sessions_h
+#define _rs_sessions_h
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+
+// The last N strings pushed, most recent first, in a fixed ring that lives
+// inline in its owner. Pushing the N+1th overwrites the oldest.
+template <unsigned int N>
+class rs_ring {
+	public:
+		rs_ring () : head(0), count(0) {}
+
+		void push (const std::string &item) {
+			head = (head + N - 1) % N;
+			items[head] = item;
+			if (count < N) {
+				count++;
+			}
+		}
+
+		unsigned int size () const {
+			return count;
+		}
+
+		// Numbered from 0, most recent first.
+		const std::string &operator[] (unsigned int index) const {
+			return items[(head + index) % N];
+		}
+
+	private:
+		std::string items[N];
+		unsigned int head;  // Where the most recent item is
+		unsigned int count; // How many items there are, up to N
+};
+
+// What we know about one user.
+struct rs_session {
+	std::map<std::string, std::string> vars; // <set>/<get> variables and their "topic"
+	rs_ring<9> input;                        // Their last 9 messages
+	rs_ring<9> reply;                        // Our last 9 replies to them
+	std::string lastMatch;                   // The trigger their last message matched
+};
+
+// Called with each user that's evicted from the store, e.g. to spill them
+// to somewhere more permanent.
+typedef std::function<void(const std::string &id, const rs_session &session)> rs_evict_handler;
+
+// A thread-safe store of user sessions. Users are spread over a fixed number
+// of shards by a hash of their ID, each with its own lock, so different
+// users rarely wait on each other.
+//
+// The store can be given a memory cap and an idle time. Each shard keeps its
+// users in least recently used order and evicts from the cold end when it
+// goes over its share of the cap, or when users have been idle for too long.
+// The eviction handler is called once the shard's lock is released.
+class rs_sessions {
+	public:
+		rs_sessions ();
+
+		// Copy a user's session out. Returns false (and leaves "session"
+		// alone) if there's no such user.
+		bool get (const std::string &id, rs_session &session);
+
+		// Store a user's session, replacing whatever was there.
+		void put (const std::string &id, rs_session &&session);
+
+		// Get or set one of a user's variables. Setting one creates the user
+		// if need be.
+		bool getVar (const std::string &id, const std::string &name, std::string &value);
+		void setVar (const std::string &id, const std::string &name, const std::string &value);
+
+		// Drop a user, without calling the eviction handler.
+		void erase (const std::string &id);
+
+		// Limits. Zero means no limit, which is the default for both.
+		void setLimit (size_t bytes);
+		void setIdle (std::chrono::seconds idle);
+		void onEvict (rs_evict_handler handler);
+
+		// Evict every user that's been idle for too long. Users are also
+		// evicted as the store is used, but only from the shards that are
+		// touched. Returns how many users were evicted.
+		size_t expire ();
+
+		// Counters.
+		size_t size () const;           // Users
+		size_t bytes () const;          // Roughly how much memory they take
+		unsigned long evictions () const;
+
+		// Roughly how much memory a session takes.
+		static size_t sizeOf (const std::string &id, const rs_session &session);
+
+	private:
+		rs_sessions (const rs_sessions &);            // Not copyable
+		rs_sessions &operator= (const rs_sessions &);
+
+		typedef std::chrono::steady_clock rs_clock;
+		typedef std::list<const std::string*> rs_lru; // Points at the keys in "users"
+
+		struct rs_session_entry {
+			rs_session session;
+			size_t bytes;
+			rs_clock::time_point used; // When it was last touched
+			rs_lru::iterator lru;      // Where it is in its shard's LRU list
+		};
+
+		struct alignas(64) rs_shard {
+			std::mutex lock;
+			std::unordered_map<std::string, rs_session_entry> users;
+			rs_lru lru; // Most recently used first
+			size_t bytes;
+			unsigned long evictions;
+			rs_shard () : bytes(0), evictions(0) {}
+		};
+
+		typedef std::vector< std::pair<std::string, rs_session> > rs_evicted;
+
+		static constexpr unsigned int shards = 64;
+
+		rs_shard &shardOf (const std::string &id);
+		rs_session_entry &touch (rs_shard &shard, const std::string &id);
+		void resize (rs_shard &shard, rs_session_entry &entry, const std::string &id);
+		void evict (rs_shard &shard, const std::string *keep, rs_evicted &out);
+		void notify (rs_evicted &evicted);
+
+		mutable rs_shard table[shards];
+
+		std::atomic<size_t> limit;     // Bytes per shard
+		std::atomic<long> idleSeconds;
+		std::mutex handling;           // Guards the handler
+		rs_evict_handler handler;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "rs_snapshot.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+uint64_t rs_fnv1a (const char *data, size_t length, uint64_t hash) {
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/******************************************************************************
+ * Writer                                                                     *
+ ******************************************************************************/
+
+void rs_snapshot_writer::u32 (uint32_t value) {
+	buffer.append((const char*)&value, sizeof(value));
+}
+
+void rs_snapshot_writer::u64 (uint64_t value) {
+	buffer.append((const char*)&value, sizeof(value));
+}
+
+void rs_snapshot_writer::i32 (int32_t value) {
+	buffer.append((const char*)&value, sizeof(value));
+}
+
+void rs_snapshot_writer::str (string_view value) {
+	u32(value.length());
+	buffer.append(value.data(), value.length());
+}
+
+void rs_snapshot_writer::strs (const vector<string> &values) {
+	u32(values.size());
+	for (unsigned int i = 0; i < values.size(); i++) {
+		str(values[i]);
+	}
+}
+
+void rs_snapshot_writer::strs (const rs_list<rs_text> &values) {
+	u32(values.size());
+	for (unsigned int i = 0; i < values.size(); i++) {
+		str(values[i]);
+	}
+}
+
+string &rs_snapshot_writer::image () {
+	return buffer;
+}
+
+/******************************************************************************
+ * Reader                                                                     *
+ ******************************************************************************/
+
+rs_snapshot_reader::rs_snapshot_reader (const char *data, size_t length) {
+	this->cursor = data;
+	this->end    = data + length;
+	this->failed = false;
+}
+
+bool rs_snapshot_reader::take (void *into, size_t length) {
+	if (failed || (size_t)(end - cursor) < length) {
+		failed = true;
+		memset(into, 0, length);
+		return false;
+	}
+	memcpy(into, cursor, length);
+	cursor += length;
+	return true;
+}
+
+uint32_t rs_snapshot_reader::u32 () {
+	uint32_t value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+uint64_t rs_snapshot_reader::u64 () {
+	uint64_t value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+int32_t rs_snapshot_reader::i32 () {
+	int32_t value;
+	take(&value, sizeof(value));
+	return value;
+}
+
+string_view rs_snapshot_reader::str () {
+	uint32_t length = u32();
+	if (failed || (size_t)(end - cursor) < length) {
+		failed = true;
+		return string_view();
+	}
+
+	// Point straight into the image; no copy.
+	string_view value (cursor, length);
+	cursor += length;
+	return value;
+}
+
+void rs_snapshot_reader::strs (vector<string> &into) {
+	uint32_t count = u32();
+	for (uint32_t i = 0; i < count && !failed; i++) {
+		into.push_back(string(str()));
+	}
+}
+
+void rs_snapshot_reader::strs (rs_list<rs_text> &into) {
+	uint32_t count = u32();
+	for (uint32_t i = 0; i < count && !failed; i++) {
+		into.emplace_back(str());
+	}
+}
+
+bool rs_snapshot_reader::ok () const {
+	return !failed;
+}
+
+bool rs_snapshot_reader::done () const {
+	return cursor == end;
+}
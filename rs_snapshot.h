@@ -0,0 +1,58 @@
+#ifndef _rs_snapshot_h
+#define _rs_snapshot_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+#include "rs_arena.h"
+
+// Building blocks for the binary brain snapshot (see RiveScript::saveSnapshot).
+// Everything is stored in the machine's native byte order; integers are fixed
+// width and strings are a uint32 length followed by the bytes.
+
+// 64-bit FNV-1a, used to fingerprint the source documents.
+uint64_t rs_fnv1a (const char *data, size_t length, uint64_t hash = 14695981039346656037ULL);
+
+// Appends values to an in-memory image.
+class rs_snapshot_writer {
+	public:
+		void u32 (uint32_t value);
+		void u64 (uint64_t value);
+		void i32 (int32_t value);
+		void str (std::string_view value);
+		void strs (const std::vector<std::string> &values);
+		void strs (const rs_list<rs_text> &values);
+
+		std::string &image ();
+
+	private:
+		std::string buffer;
+};
+
+// Reads values back out of a (memory-mapped) image. Reading past the end of
+// the image doesn't crash: it flags the reader as failed and returns zeros.
+class rs_snapshot_reader {
+	public:
+		rs_snapshot_reader (const char *data, size_t length);
+
+		uint32_t u32 ();
+		uint64_t u64 ();
+		int32_t i32 ();
+		std::string_view str ();
+		void strs (std::vector<std::string> &into);
+		void strs (rs_list<rs_text> &into); // Copied into the list's arena
+
+		bool ok () const;
+		bool done () const;
+
+	private:
+		bool take (void *into, size_t length);
+
+		const char *cursor;
+		const char *end;
+		bool failed;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <ctype.h>
+
+#include "rs_normalize.h"
+#include "rs_substituter.h"
+
+using std::map;
+using std::pair;
+using std::string;
+using std::string_view;
+using std::vector;
+
+// Whether a character counts as part of a word (regex \w). Any byte of a
+// UTF-8 character does, so a pattern can't match half of one.
+static inline bool rs_is_word (unsigned char c) {
+	return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// Substitution precedence: more words first, then longer first.
+static bool rs_sub_before (const pair<string, string> &a, const pair<string, string> &b) {
+	size_t wordsA = std::count(a.first.begin(), a.first.end(), ' ');
+	size_t wordsB = std::count(b.first.begin(), b.first.end(), ' ');
+	if (wordsA != wordsB) {
+		return wordsA > wordsB;
+	}
+	if (a.first.length() != b.first.length()) {
+		return a.first.length() > b.first.length();
+	}
+	return a.first < b.first;
+}
+
+rs_substituter::rs_substituter () {
+	build(map<string, string>());
+}
+
+void rs_substituter::build (const map<string, string> &subs) {
+	nodes.clear();
+	replace.clear();
+	length.clear();
+
+	rs_ac_node root;
+	root.fail    = 0;
+	root.pattern = -1;
+	root.output  = -1;
+	nodes.push_back(root);
+
+	// Number the patterns in precedence order.
+	vector< pair<string, string> > patterns;
+	for (map<string, string>::const_iterator it = subs.begin(); it != subs.end(); ++it) {
+		string pattern;
+		rs_casefold(it->first, pattern);
+		if (pattern.length() > 0) {
+			patterns.push_back(std::make_pair(pattern, it->second));
+		}
+	}
+	std::sort(patterns.begin(), patterns.end(), rs_sub_before);
+
+	// Build the trie.
+	for (unsigned int p = 0; p < patterns.size(); p++) {
+		const string &pattern = patterns[p].first;
+		int state = 0;
+		for (size_t i = 0; i < pattern.length(); i++) {
+			unsigned char c = pattern[i];
+			int next = child(state, c);
+			if (next < 0) {
+				rs_ac_node node;
+				node.fail    = 0;
+				node.pattern = -1;
+				node.output  = -1;
+				next = nodes.size();
+				nodes.push_back(node);
+
+				vector< pair<unsigned char, int> > &edges = nodes[state].next;
+				edges.insert(std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0)), std::make_pair(c, next));
+			}
+			state = next;
+		}
+
+		// Two patterns that only differ by case: the first one wins.
+		if (nodes[state].pattern < 0) {
+			nodes[state].pattern = p;
+		}
+		replace.push_back(patterns[p].second);
+		length.push_back(pattern.length());
+	}
+
+	// Breadth-first pass to fill in the failure and output links.
+	vector<int> queue;
+	for (unsigned int i = 0; i < nodes[0].next.size(); i++) {
+		queue.push_back(nodes[0].next[i].second);
+	}
+	for (size_t q = 0; q < queue.size(); q++) {
+		int state = queue[q];
+		for (unsigned int i = 0; i < nodes[state].next.size(); i++) {
+			unsigned char c = nodes[state].next[i].first;
+			int next = nodes[state].next[i].second;
+
+			nodes[next].fail = step(nodes[state].fail, c);
+			int fail = nodes[next].fail;
+			nodes[next].output = nodes[fail].pattern >= 0 ? fail : nodes[fail].output;
+			queue.push_back(next);
+		}
+	}
+}
+
+int rs_substituter::child (int state, unsigned char c) const {
+	const vector< pair<unsigned char, int> > &edges = nodes[state].next;
+	vector< pair<unsigned char, int> >::const_iterator it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0));
+	if (it != edges.end() && it->first == c) {
+		return it->second;
+	}
+	return -1;
+}
+
+int rs_substituter::step (int state, unsigned char c) const {
+	while (true) {
+		int next = child(state, c);
+		if (next >= 0) {
+			return next;
+		}
+		if (state == 0) {
+			return 0;
+		}
+		state = nodes[state].fail;
+	}
+}
+
+bool rs_substituter::empty () const {
+	return replace.empty();
+}
+
+size_t rs_substituter::bytes () const {
+	size_t bytes = rs_vector_bytes(nodes) + rs_vector_bytes(replace) + rs_vector_bytes(length);
+	for (unsigned int i = 0; i < nodes.size(); i++) {
+		bytes += rs_vector_bytes(nodes[i].next);
+	}
+	for (unsigned int i = 0; i < replace.size(); i++) {
+		bytes += rs_string_bytes(replace[i]);
+	}
+	return bytes;
+}
+
+string rs_substituter::apply (string_view message) const {
+	string out;
+	apply(message, out);
+	return out;
+}
+
+void rs_substituter::apply (string_view message, string &out) const {
+	out.clear();
+	if (empty()) {
+		out.append(message.data(), message.length());
+		return;
+	}
+
+	// Find every whole-word occurrence of every pattern in a single scan.
+	vector<rs_ac_match> matches;
+	int state = 0;
+	for (size_t i = 0; i < message.length(); i++) {
+		state = step(state, tolower((unsigned char)message[i]));
+
+		int found = nodes[state].pattern >= 0 ? state : nodes[state].output;
+		while (found >= 0) {
+			rs_ac_match match;
+			match.pattern = nodes[found].pattern;
+			match.length  = length[match.pattern];
+			match.start   = i + 1 - match.length;
+
+			bool before = match.start == 0 || !rs_is_word(message[match.start - 1]);
+			bool after  = i + 1 == message.length() || !rs_is_word(message[i + 1]);
+			if (before && after) {
+				matches.push_back(match);
+			}
+			found = nodes[found].output;
+		}
+	}
+
+	if (matches.empty()) {
+		out.append(message.data(), message.length());
+		return;
+	}
+
+	// Take the matches in precedence order (then left to right), skipping any
+	// that overlap text that's already been claimed.
+	std::sort(matches.begin(), matches.end(), [] (const rs_ac_match &a, const rs_ac_match &b) {
+		return a.pattern != b.pattern ? a.pattern < b.pattern : a.start < b.start;
+	});
+
+	vector<int> claimed (message.length(), -1); // Match number starting here, or -2 if covered
+	vector<rs_ac_match> taken;
+	for (unsigned int m = 0; m < matches.size(); m++) {
+		const rs_ac_match &match = matches[m];
+		bool free = true;
+		for (size_t i = match.start; i < match.start + match.length; i++) {
+			if (claimed[i] != -1) {
+				free = false;
+				break;
+			}
+		}
+		if (!free) {
+			continue;
+		}
+
+		claimed[match.start] = taken.size();
+		for (size_t i = match.start + 1; i < match.start + match.length; i++) {
+			claimed[i] = -2;
+		}
+		taken.push_back(match);
+	}
+
+	// Stitch the output together.
+	out.reserve(message.length());
+	for (size_t i = 0; i < message.length(); ) {
+		if (claimed[i] >= 0) {
+			const rs_ac_match &match = taken[claimed[i]];
+			out += replace[match.pattern];
+			i += match.length;
+		}
+		else {
+			out += message[i];
+			i++;
+		}
+	}
+}
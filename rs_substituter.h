@@ -0,0 +1,52 @@
+#ifndef _rs_substituter_h
+#define _rs_substituter_h
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "rs_memory.h"
+
+// Applies a whole set of substitutions (! sub or ! person) to a message in
+// one pass. The patterns are compiled into an Aho-Corasick automaton, so the
+// cost of a pass depends on the length of the message rather than on how many
+// substitutions there are.
+//
+// Matching follows the other RiveScript implementations: a pattern only
+// matches as whole words (the characters around it must not be letters,
+// digits or underscores), patterns with more words and then longer patterns
+// take precedence, and replaced text is never substituted again.
+class rs_substituter {
+	public:
+		rs_substituter ();
+
+		void build (const std::map<std::string, std::string> &subs);
+		void apply (std::string_view message, std::string &out) const;
+		std::string apply (std::string_view message) const;
+		bool empty () const;
+		size_t bytes () const; // Heap memory it holds
+
+	private:
+		struct rs_ac_node {
+			std::vector< std::pair<unsigned char, int> > next; // Sorted goto edges
+			int fail;    // Failure link
+			int pattern; // Pattern ending at this node, or -1
+			int output;  // Next node down the failure chain with a pattern, or -1
+		};
+		struct rs_ac_match {
+			size_t start;
+			size_t length;
+			int pattern;
+		};
+
+		int step (int state, unsigned char c) const;
+		int child (int state, unsigned char c) const;
+
+		std::vector<rs_ac_node> nodes;
+		std::vector<std::string> replace; // Replacement text, by pattern
+		std::vector<size_t> length;       // Pattern length, by pattern
+		// Patterns are numbered in precedence order, so a lower number wins.
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "rs_symbols.h"
+#include "rs_snapshot.h"
+
+using std::string;
+using std::string_view;
+
+rs_symbols::rs_symbols () {
+	clear();
+}
+
+uint32_t rs_symbols::intern (string_view name) {
+	std::lock_guard<std::mutex> guard (lock);
+
+	// Keep the table at most half full.
+	if ((names.size() + 1) * 2 > slots.size()) {
+		grow();
+	}
+
+	uint64_t hash = rs_fnv1a(name.data(), name.length());
+	size_t mask = slots.size() - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		uint32_t id = slots[i];
+		if (id == none) {
+			id = names.size();
+			names.push_back(string(name));
+			hashes.push_back(hash);
+			slots[i] = id;
+			return id;
+		}
+		if (hashes[id] == hash && names[id] == name) {
+			return id;
+		}
+	}
+}
+
+void rs_symbols::assign (const rs_symbols &from) {
+	std::lock_guard<std::mutex> guard (lock);
+	names  = from.names;
+	hashes = from.hashes;
+	slots  = from.slots;
+}
+
+uint32_t rs_symbols::find (string_view name) const {
+	uint64_t hash = rs_fnv1a(name.data(), name.length());
+	size_t mask = slots.size() - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		uint32_t id = slots[i];
+		if (id == none) {
+			return none;
+		}
+		if (hashes[id] == hash && names[id] == name) {
+			return id;
+		}
+	}
+}
+
+const string &rs_symbols::name (uint32_t id) const {
+	return names[id];
+}
+
+uint32_t rs_symbols::size () const {
+	return names.size();
+}
+
+size_t rs_symbols::bytes () const {
+	size_t bytes = rs_vector_bytes(names) + rs_vector_bytes(hashes) + rs_vector_bytes(slots);
+	for (unsigned int i = 0; i < names.size(); i++) {
+		bytes += rs_string_bytes(names[i]);
+	}
+	return bytes;
+}
+
+void rs_symbols::clear () {
+	names.clear();
+	hashes.clear();
+	slots.assign(16, none);
+}
+
+void rs_symbols::grow () {
+	slots.assign(slots.size() * 2, none);
+	size_t mask = slots.size() - 1;
+	for (uint32_t id = 0; id < names.size(); id++) {
+		size_t i = hashes[id] & mask;
+		while (slots[i] != none) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = id;
+	}
+}
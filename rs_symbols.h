@@ -0,0 +1,45 @@
+#ifndef _rs_symbols_h
+#define _rs_symbols_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+#include "rs_memory.h"
+
+// An interned symbol table: maps strings to dense integer IDs (0, 1, 2, ...)
+// and back. Lookups go through an open-addressing hash table.
+//
+// intern() may be called from several threads at once. find() and name()
+// take no lock, so they're only safe while nobody is interning.
+class rs_symbols {
+	public:
+		static constexpr uint32_t none = 0xFFFFFFFF; // "No such symbol"
+
+		rs_symbols ();
+
+		uint32_t intern (std::string_view name);
+		uint32_t find (std::string_view name) const;
+		const std::string &name (uint32_t id) const;
+		uint32_t size () const;
+		size_t bytes () const; // Heap memory it holds
+		void clear ();
+
+		// Become a copy of another table, with the same IDs.
+		void assign (const rs_symbols &from);
+
+	private:
+		rs_symbols (const rs_symbols &);            // Not copyable
+		rs_symbols &operator= (const rs_symbols &);
+
+		void grow ();
+
+		std::vector<std::string> names; // By ID
+		std::vector<uint64_t> hashes;   // By ID
+		std::vector<uint32_t> slots;    // Hash table of IDs; "none" if empty
+		std::mutex lock;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <string.h>
+#include <algorithm>
+
+#include "rs_trace.h"
+
+using std::string;
+
+rs_tracer::rs_tracer (size_t capacity)
+	: tail(0), head(0), lost(0), current(RS_TRACE_WARN), echo(RS_TRACE_WARN) {
+	// The ring is indexed with a mask, so round up to a power of two.
+	size_t size = 2;
+	while (size < capacity) {
+		size *= 2;
+	}
+	slots.reset(new rs_trace_slot[size]);
+	mask = size - 1;
+	for (size_t i = 0; i < size; i++) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+void rs_tracer::setLevel (rs_trace_level level) {
+	current = level;
+}
+
+void rs_tracer::setEcho (rs_trace_level level) {
+	echo = level;
+}
+
+rs_trace_level rs_tracer::level () const {
+	return (rs_trace_level)current.load(std::memory_order_relaxed);
+}
+
+void rs_tracer::emit (rs_trace_level level, const char *file, unsigned int line,
+	const char *phase, uint64_t duration, std::string_view message) {
+	if (level <= echo.load(std::memory_order_relaxed)) {
+		// Built up front so lines from different threads don't interleave.
+		string out = (level == RS_TRACE_WARN ? "RS-WARNING: " : "RS: ") + string(message);
+		if (duration > 0) {
+			out += " (" + std::to_string(duration / 1000) + " us)";
+		}
+		std::cout << out + "\n";
+	}
+
+	// Claim the next free slot. If the reader hasn't freed it yet, the ring
+	// is full.
+	size_t pos = tail.load(std::memory_order_relaxed);
+	rs_trace_slot *slot;
+	for (;;) {
+		slot = &slots[pos & mask];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			lost.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else {
+			pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	rs_trace_event &event = slot->event;
+	event.level    = level;
+	event.file     = file;
+	event.line     = line;
+	event.phase    = phase;
+	event.time     = now();
+	event.duration = duration;
+	size_t length = std::min(message.size(), sizeof(event.message) - 1);
+	memcpy(event.message, message.data(), length);
+	event.message[length] = '\0';
+
+	slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool rs_tracer::drain (rs_trace_event &event) {
+	size_t pos = head.load(std::memory_order_relaxed);
+	rs_trace_slot *slot;
+	for (;;) {
+		slot = &slots[pos & mask];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			return false;
+		}
+		else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	event = slot->event;
+
+	// Hand the slot back to the writers for their next lap.
+	slot->sequence.store(pos + mask + 1, std::memory_order_release);
+	return true;
+}
+
+size_t rs_tracer::capacity () const {
+	return mask + 1;
+}
+
+unsigned long rs_tracer::dropped () const {
+	return lost.load(std::memory_order_relaxed);
+}
+
+uint64_t rs_tracer::now () {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
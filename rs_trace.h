@@ -0,0 +1,132 @@
+#ifndef _rs_trace_h
+#define _rs_trace_h
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <stdint.h>
+
+// How much to trace. Each level includes the ones before it.
+enum rs_trace_level {
+	RS_TRACE_NONE = 0,
+	RS_TRACE_WARN,  // Problems with the documents or the caller's input
+	RS_TRACE_INFO,  // One timed event per load, sort, snapshot and reply
+	RS_TRACE_DEBUG  // Everything the interpreter is doing
+};
+
+// One traced event. Where it came from and its phase point at string
+// literals, so copying an event never allocates.
+struct rs_trace_event {
+	rs_trace_level level;
+	const char *file;   // Source file and line of the trace point
+	unsigned int line;
+	const char *phase;  // "load", "parse", "sort", "reply", ...
+	uint64_t time;      // When it happened, in ns since the epoch
+	uint64_t duration;  // How long it took in ns, for timed events
+	char message[200];  // Truncated if need be
+};
+
+// A leveled tracer. Events go into a bounded lock-free ring buffer that any
+// number of threads can write to at once, and that can be drained by
+// another thread without holding any of them up. When the ring is full, new
+// events are dropped (and counted) rather than waited on.
+//
+// Events at or below the echo level are also printed to the terminal as
+// they happen, the way debug mode always has.
+//
+// Trace points should go through the RS_TRACE macros, which check the
+// level before building the message, so a disabled level costs one relaxed
+// load. Building with RS_NO_TRACE compiles them out altogether.
+class rs_tracer {
+	public:
+		rs_tracer (size_t capacity = 1024);
+
+		void setLevel (rs_trace_level level);
+		void setEcho (rs_trace_level level);
+		rs_trace_level level () const;
+
+		bool enabled (rs_trace_level level) const {
+			return level <= current.load(std::memory_order_relaxed);
+		}
+
+		// Record an event, whether or not its level is enabled.
+		void emit (rs_trace_level level, const char *file, unsigned int line,
+			const char *phase, uint64_t duration, std::string_view message);
+
+		// Take the oldest event out of the ring. Returns false if it's empty.
+		bool drain (rs_trace_event &event);
+
+		// Counters.
+		size_t capacity () const;
+		unsigned long dropped () const; // Events lost to a full ring
+
+		// Nanoseconds since the epoch.
+		static uint64_t now ();
+
+	private:
+		rs_tracer (const rs_tracer &);            // Not copyable
+		rs_tracer &operator= (const rs_tracer &);
+
+		// A slot's sequence number says whose turn it is: it equals the
+		// write position when the slot is free to be written, and that
+		// plus one once the event in it is ready to be read.
+		struct alignas(64) rs_trace_slot {
+			std::atomic<size_t> sequence;
+			rs_trace_event event;
+		};
+
+		std::unique_ptr<rs_trace_slot[]> slots;
+		size_t mask;
+		alignas(64) std::atomic<size_t> tail; // Next slot to write
+		alignas(64) std::atomic<size_t> head; // Next slot to read
+		std::atomic<unsigned long> lost;
+		std::atomic<int> current;
+		std::atomic<int> echo;
+};
+
+// Times the scope it lives in, and records it as one event at the end. Does
+// nothing (not even read the clock) if the level was disabled at the start.
+class rs_trace_scope {
+	public:
+		rs_trace_scope (rs_tracer &tracer, rs_trace_level level, const char *file,
+			unsigned int line, const char *phase, const char *what)
+			: tracer(tracer.enabled(level) ? &tracer : NULL), level(level), file(file),
+			  line(line), phase(phase), what(what), start(this->tracer ? rs_tracer::now() : 0) {}
+		~rs_trace_scope () {
+			if (tracer != NULL) {
+				tracer->emit(level, file, line, phase, rs_tracer::now() - start, what);
+			}
+		}
+
+	private:
+		rs_trace_scope (const rs_trace_scope &);            // Not copyable
+		rs_trace_scope &operator= (const rs_trace_scope &);
+
+		rs_tracer *tracer;
+		rs_trace_level level;
+		const char *file;
+		unsigned int line;
+		const char *phase;
+		const char *what;
+		uint64_t start;
+};
+
+#ifdef RS_NO_TRACE
+# define RS_TRACE(tracer, level, phase, message) do { } while (0)
+# define RS_TRACE_SCOPE(tracer, level, phase, what) do { } while (0)
+#else
+// Record an event. "message" is only evaluated if the level is enabled.
+# define RS_TRACE(tracer, level, phase, message) \
+	do { \
+		if ((tracer).enabled(level)) { \
+			(tracer).emit(level, __FILE__, __LINE__, phase, 0, message); \
+		} \
+	} while (0)
+// Time the rest of the enclosing scope.
+# define RS_TRACE_SCOPE(tracer, level, phase, what) \
+	rs_trace_scope rs_trace_scope_ (tracer, level, __FILE__, __LINE__, phase, what)
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <string.h>
+
+#include "rs_trie.h"
+
+using std::string;
+using std::vector;
+
+rs_trie::rs_trie () {
+	build(vector<string>());
+}
+
+void rs_trie::build (const vector<string> &items) {
+	nodes.clear();
+	nodes.push_back(rs_trie_node());
+	nodes[0].end = false;
+	this->items = 0;
+
+	for (unsigned int i = 0; i < items.size(); i++) {
+		int node = 0;
+		for (size_t j = 0; j < items[i].length(); j++) {
+			char c = items[i][j];
+			int next = child(node, c);
+			if (next < 0) {
+				next = nodes.size();
+				nodes.push_back(rs_trie_node());
+				nodes[next].end = false;
+
+				vector< std::pair<char, int> > &edges = nodes[node].next;
+				edges.insert(std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0)), std::make_pair(c, next));
+			}
+			node = next;
+		}
+		if (!nodes[node].end) {
+			nodes[node].end = true;
+			this->items++;
+		}
+	}
+
+	// Spell it out once; every trigger that uses the array shares it.
+	regex = "(?:";
+	spell(0, regex);
+	regex += ")";
+}
+
+const string &rs_trie::pattern () const {
+	return regex;
+}
+
+size_t rs_trie::size () const {
+	return items;
+}
+
+size_t rs_trie::bytes () const {
+	size_t bytes = rs_vector_bytes(nodes) + rs_string_bytes(regex);
+	for (unsigned int i = 0; i < nodes.size(); i++) {
+		bytes += rs_vector_bytes(nodes[i].next);
+	}
+	return bytes;
+}
+
+int rs_trie::child (int node, char c) const {
+	const vector< std::pair<char, int> > &edges = nodes[node].next;
+	vector< std::pair<char, int> >::const_iterator it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0));
+	return it != edges.end() && it->first == c ? it->second : -1;
+}
+
+void rs_trie::spell (int node, string &out) const {
+	// The alternatives below a node, one per edge. Runs of nodes with a single
+	// edge and no item ending at them are written out as one literal.
+	const vector< std::pair<char, int> > &edges = nodes[node].next;
+	if (edges.empty()) {
+		return;
+	}
+
+	bool group = nodes[node].end || edges.size() > 1;
+	if (group) {
+		out += "(?:";
+	}
+	for (unsigned int i = 0; i < edges.size(); i++) {
+		if (i > 0) {
+			out += '|';
+		}
+
+		int next = edges[i].second;
+		char c = edges[i].first;
+		for (;;) {
+			if (strchr("\\^$.|?*+()[]{}/", c) != NULL) {
+				out += '\\';
+			}
+			out += c;
+			if (nodes[next].end || nodes[next].next.size() != 1) {
+				break;
+			}
+			c    = nodes[next].next[0].first;
+			next = nodes[next].next[0].second;
+		}
+		spell(next, out);
+	}
+	if (group) {
+		out += nodes[node].end ? ")?" : ")";
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef _rs_trie_h
+#define _rs_trie_h
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "rs_memory.h"
+
+// The items of a "! array", compiled for use in trigger patterns. A plain
+// (a|b|c|...) alternation makes the regex engine try every item in turn at
+// each position it's tried at, which is slow for arrays with thousands of
+// items. The items are put into a trie instead, and pattern() spells the trie
+// out as a regex with shared prefixes factored out, e.g. "new york|new
+// jersey|boston" becomes "(?:new (?:york|jersey)|boston)". The engine then
+// only follows branches that agree with the message so far.
+class rs_trie {
+	public:
+		rs_trie ();
+
+		void build (const std::vector<std::string> &items);
+
+		// The regex for "any one of the items", wrapped in a non-capturing
+		// group.
+		const std::string &pattern () const;
+
+		size_t size () const;  // Distinct items
+		size_t bytes () const; // Heap memory it holds
+
+	private:
+		struct rs_trie_node {
+			std::vector< std::pair<char, int> > next; // Sorted edges
+			bool end; // An item ends here
+		};
+
+		int child (int node, char c) const;
+		void spell (int node, std::string &out) const;
+
+		std::vector<rs_trie_node> nodes;
+		std::string regex;
+		size_t items;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include <set>
+#include <unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <sys/eventfd.h>
+#endif
+
+#include "rs_watcher.h"
+
+using std::string;
+
+rs_watcher::rs_watcher (rs_changed changed, unsigned int settleMs)
+	: changed(changed), settleMs(settleMs), notify(-1), wakeup(-1) {
+}
+
+rs_watcher::~rs_watcher () {
+	stop();
+}
+
+bool rs_watcher::watch (const string &folder) {
+	stop();
+#ifdef __linux__
+	notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notify < 0 || wakeup < 0 ||
+		inotify_add_watch(notify, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+		stop();
+		return false;
+	}
+	this->folder = folder;
+	thread = std::thread(&rs_watcher::run, this);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void rs_watcher::stop () {
+#ifdef __linux__
+	if (thread.joinable()) {
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) < 0) {
+			// It's non-blocking and only ever written once; can't happen.
+		}
+		thread.join();
+	}
+#endif
+	if (notify >= 0) {
+		close(notify);
+	}
+	if (wakeup >= 0) {
+		close(wakeup);
+	}
+	notify = -1;
+	wakeup = -1;
+}
+
+void rs_watcher::run () {
+#ifdef __linux__
+	std::set<string> pending; // Files changed since the last callback
+	alignas(struct inotify_event) char buffer[4096];
+
+	for (;;) {
+		// Wait for something to happen. Once something has, wait only until
+		// things have been quiet for a moment.
+		struct pollfd fds[2] = { { notify, POLLIN, 0 }, { wakeup, POLLIN, 0 } };
+		int ready = poll(fds, 2, pending.empty() ? -1 : (int)settleMs);
+		if (ready < 0 && errno != EINTR) {
+			return;
+		}
+		if (fds[1].revents & POLLIN) {
+			return;
+		}
+
+		if (ready == 0) {
+			for (std::set<string>::iterator it = pending.begin(); it != pending.end(); ++it) {
+				changed(folder + "/" + *it);
+			}
+			pending.clear();
+			continue;
+		}
+
+		ssize_t length;
+		while ((length = read(notify, buffer, sizeof(buffer))) > 0) {
+			for (char *p = buffer; p < buffer + length; ) {
+				struct inotify_event *event = (struct inotify_event*)p;
+				p += sizeof(struct inotify_event) + event->len;
+
+				// Skip hidden files (like loadDirectory() does) and editors'
+				// backups.
+				string name = event->len > 0 ? string(event->name) : "";
+				if (name.length() == 0 || name[0] == '.' || name[name.length() - 1] == '~') {
+					continue;
+				}
+				pending.insert(name);
+			}
+		}
+	}
+#endif
+}
@@ -0,0 +1,41 @@
+#ifndef _rs_watcher_h
+#define _rs_watcher_h
+
+#include <string>
+#include <thread>
+#include <functional>
+
+// Watches a directory for files being written, moved in, moved out or
+// deleted, and calls back with the path of each one from a thread of its
+// own. Changes are collected for a moment before the callback runs, so a
+// burst of writes to the same file comes through as one change.
+//
+// Built on inotify; on other systems watch() just returns false.
+class rs_watcher {
+	public:
+		typedef std::function<void(const std::string &path)> rs_changed;
+
+		rs_watcher (rs_changed changed, unsigned int settleMs = 100);
+		~rs_watcher ();
+
+		// Start watching. Returns false if the directory can't be watched.
+		bool watch (const std::string &folder);
+
+		// Stop watching, and wait for the callback to finish if it's running.
+		void stop ();
+
+	private:
+		rs_watcher (const rs_watcher &);            // Not copyable
+		rs_watcher &operator= (const rs_watcher &);
+
+		void run ();
+
+		rs_changed changed;
+		unsigned int settleMs;
+		std::string folder;
+		std::thread thread;
+		int notify;  // The inotify descriptor
+		int wakeup;  // Written to by stop() to end the thread
+};
+
+#endif